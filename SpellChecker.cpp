@@ -10,422 +10,9388 @@
 // Input/Output Includes
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 
 // Data Structure Includes
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 // Algorithm Includes
 #include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <random>
 
-// Function Prototypes
-int levenshtein_distance(const std::string& word1, const std::string& word2);
-std::unordered_map<std::string, bool> load_dictionary(
-    const std::string& filename);
-std::vector<std::string> spell_check(
-    const std::string& text, const std::unordered_set<std::string>& dictionary);
-std::vector<std::pair<std::string, std::string>> suggest_corrections(
-    const std::vector<std::string>& misspelled,
-    const std::unordered_set<std::string>& dictionary);
-void print_results(
-    const std::vector<std::string>& misspelled,
-    const std::vector<std::pair<std::string, std::string>>& corrections);
-void add_word_to_dictionary(
-    const std::unordered_map<std::string, bool>& dictionary,
-    const std::string& word);
+// Concurrency Includes
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// System Includes
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+
+// Daemon Protocol Includes
+#include "SpellClient.h"
+
+// Instrumentation Includes
+#include "SpellMetrics.h"
+
+// Text Normalization Includes
+#include "SpellUnicode.h"
+
+// Word IDs
+//
+// Within one dictionary snapshot every word has a dense ID: the layers are
+// numbered one after another, each by the numbering its gram and phonetic
+// indexes use followed by its delta. Suggestions are passed around and
+// cached as IDs, and their text is looked up only when it is written out. A
+// suggestion that splits a word into several is a phrase ID, with
+// PHRASE_ID set, naming the list of word IDs the calling thread's cache
+// keeps for it.
+typedef uint32_t WordId;
+const WordId NO_WORD = std::numeric_limits<WordId>::max();
+const WordId PHRASE_ID = WordId(1) << 31;
 
 // Global Cache
-std::unordered_map<std::string, std::string> cache;
+//
+// Each thread keeps its own suggestion cache, so suggestions never take a
+// lock. Purging bumps a shared generation, and each thread drops its entries
+// the next time it sees the new generation. The cache also remembers which
+// dictionary snapshot its suggestions came from and starts over when asked
+// about a different one, so a reloaded dictionary never serves stale
+// suggestions, and the word IDs it holds always belong to that snapshot.
+struct SuggestionCache {
+    uint64_t generation = 0;
+    uint64_t dictionary_generation = 0;
+    std::unordered_map<std::string, WordId> entries;
+    std::vector<std::vector<WordId>> phrases;
+};
+
+thread_local SuggestionCache cache;
+std::atomic<uint64_t> cache_generation{0};
+
+// Request Arenas
+//
+// The temporaries of one check or suggest request, or of one document --
+// its tokens, normalized words and misspellings -- come from a per-thread
+// monotonic arena and are released together when the request is done, in
+// place of one heap allocation and free per word. The arena starts with a
+// REQUEST_ARENA_SIZE buffer. A request that outgrows it takes the rest from
+// the heap, and the next reset grows the buffer by that much, up to
+// REQUEST_ARENA_MAX_SIZE, so steady traffic stops touching the heap.
+const size_t REQUEST_ARENA_SIZE = 64 * 1024;
+const size_t REQUEST_ARENA_MAX_SIZE = 4 * 1024 * 1024;
+
+#if SPELLCHECK_METRICS
+// Heap allocations made by each thread, counted by the replacement operators
+// new below so the benchmark can report allocations per call. Every form of
+// new and delete is replaced, so memory from malloc and aligned_alloc is
+// always returned with free. std::pmr::new_delete_resource() uses the
+// aligned forms.
+thread_local uint64_t heap_allocations = 0;
+
+/**
+ * Allocate and count a block for the replacement operators new.
+ *
+ * @param size The size of the block.
+ * @param alignment Its alignment, or 0 for the default.
+ * @return The block, or null if out of memory.
+ */
+void* counted_allocation(size_t size, size_t alignment) noexcept {
+    heap_allocations++;
+    size = size ? size : 1;
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment,
+                              (size + alignment - 1) / alignment * alignment);
+}
+
+/**
+ * Like counted_allocation, but throws std::bad_alloc when out of memory.
+ */
+void* counted_allocation_or_throw(size_t size, size_t alignment) {
+    void* memory = counted_allocation(size, alignment);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new(size_t size) {
+    return counted_allocation_or_throw(size, 0);
+}
+void* operator new[](size_t size) {
+    return counted_allocation_or_throw(size, 0);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    return counted_allocation_or_throw(size, size_t(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return counted_allocation_or_throw(size, size_t(alignment));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_allocation(size, 0);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_allocation(size, 0);
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+    return counted_allocation(size, size_t(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+    return counted_allocation(size, size_t(alignment));
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete[](void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+void operator delete[](void* memory, size_t) noexcept { std::free(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete(void* memory, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+void operator delete[](void* memory, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+#endif
+
+/**
+ * The arena behind ScopedArena. Scopes nest; only the outermost one resets
+ * the arena when it ends.
+ */
+class RequestArena {
+   public:
+    RequestArena() : buffer_(REQUEST_ARENA_SIZE) {
+        resource_.emplace(buffer_.data(), buffer_.size(), &overflow_);
+    }
+
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    /**
+     * @return The memory resource to allocate request temporaries from.
+     */
+    std::pmr::memory_resource* resource() {
+        return &*resource_;
+    }
+
+    /**
+     * Open a scope on the arena.
+     */
+    void enter() {
+        depth_++;
+    }
+
+    /**
+     * Close a scope, resetting the arena if it was the outermost.
+     */
+    void leave() {
+        if (--depth_ == 0) {
+            reset();
+        }
+    }
+
+   private:
+    /**
+     * Heap memory taken once the buffer is full, tallied so the next reset
+     * can size the buffer to hold it.
+     */
+    class OverflowResource : public std::pmr::memory_resource {
+       public:
+        size_t bytes = 0;
+
+       private:
+        void* do_allocate(size_t size, size_t alignment) override {
+            bytes += size;
+            return std::pmr::new_delete_resource()->allocate(size, alignment);
+        }
+
+        void do_deallocate(void* memory, size_t size,
+                           size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(memory, size,
+                                                        alignment);
+        }
+
+        bool do_is_equal(
+            const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    /**
+     * Release everything allocated since the last reset, growing the buffer
+     * first if the request overflowed it.
+     */
+    void reset() {
+        resource_.reset();
+        size_t wanted = std::min(buffer_.size() + overflow_.bytes,
+                                 REQUEST_ARENA_MAX_SIZE);
+        if (wanted > buffer_.size()) {
+            buffer_.assign(wanted, 0);
+        }
+        overflow_.bytes = 0;
+        resource_.emplace(buffer_.data(), buffer_.size(), &overflow_);
+    }
+
+    std::vector<char> buffer_;
+    OverflowResource overflow_;
+    std::optional<std::pmr::monotonic_buffer_resource> resource_;
+    int depth_ = 0;
+};
+
+/**
+ * @return The calling thread's request arena.
+ */
+RequestArena& request_arena() {
+    thread_local RequestArena arena;
+    return arena;
+}
+
+/**
+ * Marks the extent of a request whose temporaries come from the calling
+ * thread's arena. Everything allocated from resource() must be destroyed
+ * before the scope ends, so declare the scope before the containers that use
+ * it.
+ */
+class ScopedArena {
+   public:
+    ScopedArena() : arena_(request_arena()) {
+        arena_.enter();
+    }
+
+    ~ScopedArena() {
+        arena_.leave();
+    }
+
+    ScopedArena(const ScopedArena&) = delete;
+    ScopedArena& operator=(const ScopedArena&) = delete;
+
+    std::pmr::memory_resource* resource() const {
+        return arena_.resource();
+    }
+
+   private:
+    RequestArena& arena_;
+};
+
+// Compiled Dictionary Format
+//
+// A compiled dictionary starts with an 8 byte magic followed by the word
+// count, the size of the word blob, an offset table with one entry per word
+// plus a terminating entry, a table of one frequency byte per word, and
+// finally the sorted words packed back to back. All integers are stored as
+// little-endian 32-bit values. Images with the version 1 magic have no
+// frequency table and are read with every frequency 0.
+//
+// Images with the indexed magic, written by `compile-dict --perfect-hash`,
+// store their words in the order of a minimal perfect hash instead of sorted
+// order and append the hash after the words: the partition count, the
+// bucket count and the remap count, a table of (first key, first bucket,
+// first remap entry, seed) for each partition plus a terminating entry, a
+// 16-bit pilot per bucket, the remap entries, and a fingerprint byte per
+// word.
+const char COMPILED_DICTIONARY_MAGIC[] = "SPLDICT2";
+const char COMPILED_DICTIONARY_MAGIC_V1[] = "SPLDICT1";
+const char COMPILED_DICTIONARY_MAGIC_INDEXED[] = "SPLDICT3";
+const size_t COMPILED_DICTIONARY_MAGIC_SIZE = 8;
+
+// Compiled Tries
+//
+// `compile-dict --trie` writes the words as a LOUDS succinct trie instead:
+// the trie magic, the word count and the edge count as 32-bit values, one
+// label byte per edge in breadth-first order, zero padding to a multiple of
+// 8 bytes, three bit vectors of one bit per edge stored as little-endian
+// 64-bit words, and a frequency byte per word in breadth-first order. The
+// bit vectors mark the edges that lead to a node with children of its own,
+// the first edge of each node, and the edges a word ends at. Shared prefixes
+// are stored once, so a large word list takes a few bytes per word.
+const char COMPILED_TRIE_MAGIC[] = "SPLTRIE1";
+
+/**
+ * The layouts `compile-dict` can write.
+ */
+enum CompiledFormat { COMPILED_SORTED, COMPILED_PERFECT_HASH, COMPILED_TRIE };
+
+// Perfect Hash Index
+//
+// The index is a PTHash-style minimal perfect hash. Words are split into
+// partitions of about PERFECT_HASH_PARTITION_KEYS, which are built in
+// parallel. Within a partition each word hashes to a bucket, and each bucket
+// stores the pilot that sends all of its words to free positions of a table
+// PERFECT_HASH_LOAD_FACTOR full; the few words that land past the end of
+// the partition are remapped to its holes. Pilots take 16 bits, so with
+// PERFECT_HASH_BUCKET_FACTOR * n / log2(n) buckets the index approaches 4
+// bits per word as partitions fill up; small dictionaries pay more per word
+// for the partition table and the extra buckets. A partition that cannot be
+// built is retried with a new seed.
+const size_t PERFECT_HASH_PARTITION_KEYS = 50000;
+const double PERFECT_HASH_BUCKET_FACTOR = 3.5;
+const double PERFECT_HASH_LOAD_FACTOR = 0.99;
+const uint32_t PERFECT_HASH_MAX_SEEDS = 64;
+
+// Word Frequencies
+//
+// A dictionary line may give a word's corpus count as `word<TAB>count`.
+// Counts are kept as one byte per word on a log scale, eight steps per
+// doubling, which still tells common words from rare ones. Words without a
+// count have frequency 0.
+const double FREQUENCY_STEPS_PER_DOUBLING = 8;
+
+// A suggestion at distance 1 with at least this frequency, a count of about
+// a million, is taken without searching the rest of the dictionary for a
+// more frequent one.
+const uint8_t EARLY_STOP_FREQUENCY = 160;
+
+// Suggestion Distance
+//
+// Suggestions are ranked by optimal string alignment distance by default,
+// which counts swapping two adjacent letters, as in "teh", as one edit
+// rather than two. The plain Levenshtein distance can be selected instead.
+// Changing the metric purges the suggestion caches.
+enum DistanceMetric { DISTANCE_LEVENSHTEIN, DISTANCE_DAMERAU };
+
+std::atomic<DistanceMetric> distance_metric{DISTANCE_DAMERAU};
+
+// Suggestions are at most MIN_SUGGESTION_DISTANCE edits away, except that
+// long words, where more slips are normal, may be one edit further for each
+// SUGGESTION_LETTERS_PER_EDIT code points, up to MAX_SUGGESTION_DISTANCE.
+const int MIN_SUGGESTION_DISTANCE = 2;
+const int MAX_SUGGESTION_DISTANCE = 4;
+const size_t SUGGESTION_LETTERS_PER_EDIT = 4;
+
+// Word Segmentation
+//
+// A misspelling of at least SEGMENT_MIN_LENGTH code points that splits into
+// dictionary words, such as "thequickbrown", can be corrected to the split.
+// The split counts as one edit per space it inserts, so it is only chosen
+// over a near word that is more edits away: "forwad" is corrected to
+// "forward", not "for wad". A split is preferred to searching further out
+// for long words or by sound. Every piece must have at least
+// SEGMENT_MIN_PIECE code points, so short words do not dissolve into
+// letters. Each piece costs SEGMENT_WORD_COST less its frequency, so the
+// split with the fewest words wins, and among splits with as many words,
+// the one with the most common words.
+const size_t SEGMENT_MIN_LENGTH = 6;
+const size_t SEGMENT_MIN_PIECE = 2;
+const int SEGMENT_WORD_COST = 256;
+
+// Keyboard Costs
+//
+// Among suggestions the same number of edits away, the one whose edits look
+// most like slips of the finger wins. Substituting a key for one of its
+// neighbours on a QWERTY keyboard, or swapping two adjacent letters, costs
+// half as much as any other edit.
+const int KEYBOARD_EDIT_COST = 2;
+const int KEYBOARD_ADJACENT_COST = 1;
+
+// Completions
+//
+// Completing a prefix lists the words that start with it, most frequent
+// first and in byte order among equally frequent words. Each layer keeps the
+// largest frequency below every node of its trie, or in every aligned block
+// of its frequency table, and follows those maxima straight to the best
+// words instead of visiting every word with the prefix.
+const size_t DEFAULT_COMPLETIONS = 10;
+
+// The most completions a daemon request may ask for.
+const size_t MAX_COMPLETIONS = 1000;
+
+// Daemon Buffers
+//
+// The daemon holds at most one maximum-size frame of unanswered input per
+// client, and stops reading from a client, and answering the requests it
+// has already sent, while more than DAEMON_OUTPUT_HIGH_WATER bytes of its
+// responses are waiting to be sent. A client that never reads its answers
+// therefore pins a bounded amount of memory.
+const size_t DAEMON_INPUT_LIMIT =
+    spell_protocol::LENGTH_PREFIX_SIZE + spell_protocol::MAX_FRAME_SIZE;
+const size_t DAEMON_OUTPUT_HIGH_WATER = 4 * 1024 * 1024;
+
+// Command Line Exit Codes
+const int EXIT_CLEAN = 0;
+const int EXIT_MISSPELLED = 1;
+const int EXIT_USAGE = 2;
+
+// Result Output
+//
+// `check` formats its results into a buffer and writes the buffer out once
+// it holds RESULT_BUFFER_SIZE bytes, so a report of many misspellings takes a
+// few large writes rather than one per line. With --line-buffered each
+// result is flushed as soon as it is found instead, for a reader that is
+// following the output as it comes.
+const size_t RESULT_BUFFER_SIZE = 64 * 1024;
+
+// Directory Checking
+//
+// `check` walks the directories it is given with a pool of threads that
+// both list directories and check files, so discovery and checking overlap.
+// Entries matched by --ignore patterns or by the gitignore-style files named
+// in IGNORE_FILES are skipped, as are the ignore files themselves, .git
+// directories, and files whose first BINARY_PROBE_SIZE bytes contain a NUL
+// byte. Patterns may use "**" for any number of directories at the start,
+// middle or end. With --metrics the walk reports its throughput and up to
+// SLOW_FILE_COUNT files that took more than SLOW_FILE_FACTOR times the
+// median file to check.
+const char* const IGNORE_FILES[] = {".gitignore", ".spellignore"};
+const size_t BINARY_PROBE_SIZE = 8192;
+const double SLOW_FILE_FACTOR = 10;
+const size_t SLOW_FILE_COUNT = 5;
+
+// Dictionary Snapshots
+//
+// The dictionary is a stack of layers: a large read-only base, usually a
+// compiled dictionary mapped straight from disk, with small overlays of
+// per-user or per-project words above it. A word is spelled correctly if any
+// layer has it. Each layer is a shared table plus a small sorted delta of
+// words added since the table was built, so adding a word copies only the
+// delta of the top layer and never the base.
+//
+// Readers never see the dictionary change underneath them. Each version of
+// the stack is an immutable DictionarySnapshot. Writers build a new snapshot
+// beside the current one and publish it with an atomic pointer swap, so
+// lookups and suggestions never take a lock.
+//
+// Old snapshots are reclaimed with epochs. A reader announces the global
+// epoch in its own slot before loading the snapshot pointer and clears the
+// slot when it is done. A writer tags each snapshot it replaces with the
+// epoch current at the swap and then advances the epoch; a retired snapshot
+// is freed once no slot announces an epoch at or below its tag, since every
+// reader that could still hold it announced such an epoch.
+
+// Words are folded from a layer's delta into a fresh table once the delta
+// grows past this size, which keeps delta lookups short.
+const size_t DICTIONARY_DELTA_LIMIT = 1024;
+
+// The most threads that can read the dictionary at the same time. A thread
+// claims a slot the first time it reads and releases it when it exits.
+const size_t MAX_READER_THREADS = 256;
+
+// Source of snapshot generations. Generations are unique across every shared
+// dictionary in the process, so a cache keyed on one can never mistake a
+// snapshot of another dictionary for its own.
+std::atomic<uint64_t> dictionary_generation{0};
+
+/**
+ * Scramble the bits of a 64-bit value with the MurmurHash3 finalizer.
+ *
+ * @param value The value to scramble.
+ * @return The scrambled value.
+ */
+inline uint64_t mix_hash(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    return value ^ value >> 33;
+}
+
+/**
+ * Hash a word for the perfect hash index. The hash is part of the compiled
+ * format, so it reads the bytes in a fixed order on every platform.
+ *
+ * @param word The word to hash.
+ * @return The hash.
+ */
+inline uint64_t hash_word(std::string_view word) {
+    uint64_t value = 0x9e3779b97f4a7c15ULL ^ word.size();
+    uint64_t chunk = 0;
+    for (size_t i = 0; i < word.size(); i++) {
+        chunk |= uint64_t(static_cast<unsigned char>(word[i])) << (8 * (i % 8));
+        if (i % 8 == 7) {
+            value = mix_hash(value ^ chunk);
+            chunk = 0;
+        }
+    }
+    return mix_hash(value ^ chunk);
+}
+
+/**
+ * Derive the per-partition hash of a word, which a new seed changes
+ * completely.
+ *
+ * @param hash The word's hash.
+ * @param seed The partition's seed.
+ * @return The partition hash.
+ */
+inline uint64_t perfect_hash_key(uint64_t hash, uint32_t seed) {
+    return mix_hash(hash + (uint64_t(seed) + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/**
+ * Choose the bucket of a word within its partition. Three buckets in ten
+ * receive six words in ten, so buckets differ in size and the large ones,
+ * placed first while the table is empty, find their pilots quickly.
+ *
+ * @param key The word's partition hash.
+ * @param buckets The number of buckets in the partition.
+ * @return The bucket.
+ */
+inline uint32_t perfect_hash_bucket(uint64_t key, uint32_t buckets) {
+    uint32_t dense = std::max<uint32_t>(1, buckets * 3 / 10);
+    uint64_t low = uint32_t(key);
+    if (uint32_t(key >> 32) < 0x9999999aU || dense == buckets) {
+        return low * dense >> 32;
+    }
+    return dense + (low * (buckets - dense) >> 32);
+}
+
+/**
+ * Find the table position of a word for a given pilot.
+ *
+ * @param key The word's partition hash.
+ * @param pilot The pilot of the word's bucket.
+ * @param size The size of the partition's table.
+ * @return The position, less than size.
+ */
+inline uint32_t perfect_hash_position(uint64_t key, uint16_t pilot,
+                                      uint32_t size) {
+    uint64_t value = mix_hash(key ^ (pilot * 0x9e3779b97f4a7c15ULL));
+    return (value >> 32) * size >> 32;
+}
+
+/**
+ * A word that completes a prefix, and its frequency.
+ */
+struct Completion {
+    std::string word;
+    uint8_t frequency;
+};
+
+/**
+ * @param a A completion.
+ * @param b Another completion.
+ * @return True if a ranks before b: it is more frequent, or as frequent and
+ * earlier in byte order.
+ */
+inline bool completion_before(const Completion& a, const Completion& b) {
+    return a.frequency != b.frequency ? a.frequency > b.frequency
+                                      : a.word < b.word;
+}
+
+/**
+ * The largest frequency in every aligned block of 2, 4, 8, ... entries of a
+ * frequency table, so the most frequent entries of a range are found by
+ * descending into the blocks that hold them rather than reading the range.
+ * The tree takes about one byte per entry on top of the table itself.
+ */
+class FrequencyTree {
+   public:
+    /**
+     * Build the tree over a frequency table.
+     *
+     * @param frequencies The table, which must outlive the tree, or null if
+     * every frequency is 0.
+     * @param size The number of entries in the table.
+     */
+    void build(const uint8_t* frequencies, size_t size) {
+        leaves_ = frequencies;
+        levels_.clear();
+        if (!frequencies) {
+            return;
+        }
+        for (size_t level = 1; size >> level > 0; level++) {
+            std::vector<uint8_t> blocks(size >> level);
+            for (size_t block = 0; block < blocks.size(); block++) {
+                blocks[block] = std::max(maximum(level - 1, 2 * block),
+                                         maximum(level - 1, 2 * block + 1));
+            }
+            levels_.push_back(std::move(blocks));
+        }
+    }
+
+    /**
+     * Find the most frequent entries of a set of ranges, most frequent
+     * first.
+     *
+     * @param ranges The ranges, each as its first entry and the entry just
+     * past it.
+     * @param limit The most entries to find.
+     * @param before Orders two equally frequent entries of different
+     * ranges; within a range, entries are ordered by index, which must
+     * agree with it.
+     * @param found Receives the indexes of the entries.
+     */
+    template <typename Before>
+    void top(const std::vector<std::pair<size_t, size_t>>& ranges,
+             size_t limit, Before before, std::vector<size_t>& found) const {
+        // Each range hands out its entries in order from a heap of its own:
+        // it starts as the largest aligned blocks that cover the range, and
+        // the block that can hold the best entry, the one with the largest
+        // maximum and the leftmost among equal maxima, is always opened
+        // first.
+        struct Block {
+            uint8_t maximum;
+            size_t start;
+            size_t level;
+            bool operator<(const Block& other) const {
+                return maximum != other.maximum ? maximum < other.maximum
+                                                : start > other.start;
+            }
+        };
+        std::vector<std::vector<Block>> heaps(ranges.size());
+        std::vector<size_t> cursors(ranges.size());
+        for (size_t range = 0; range < ranges.size() && leaves_; range++) {
+            size_t last = ranges[range].second;
+            for (size_t start = ranges[range].first; start < last;) {
+                size_t level = 0;
+                while (level < levels_.size() &&
+                       start % (size_t(2) << level) == 0 &&
+                       start + (size_t(2) << level) <= last) {
+                    level++;
+                }
+                heaps[range].push_back(
+                    {maximum(level, start >> level), start, level});
+                start += size_t(1) << level;
+            }
+            std::make_heap(heaps[range].begin(), heaps[range].end());
+        }
+        auto next = [&](size_t range, size_t& index) {
+            if (!leaves_) {
+                index = ranges[range].first + cursors[range]++;
+                return index < ranges[range].second;
+            }
+            std::vector<Block>& heap = heaps[range];
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end());
+                Block block = heap.back();
+                heap.pop_back();
+                if (block.level == 0) {
+                    index = block.start;
+                    return true;
+                }
+                size_t level = block.level - 1;
+                size_t left = block.start >> level;
+                heap.push_back({maximum(level, left), block.start, level});
+                std::push_heap(heap.begin(), heap.end());
+                heap.push_back({maximum(level, left + 1),
+                                block.start + (size_t(1) << level), level});
+                std::push_heap(heap.begin(), heap.end());
+            }
+            return false;
+        };
+
+        // Merge the ranges by taking the best of their next entries.
+        auto after = [&](const std::pair<size_t, size_t>& a,
+                         const std::pair<size_t, size_t>& b) {
+            uint8_t a_frequency = leaves_ ? leaves_[a.first] : 0;
+            uint8_t b_frequency = leaves_ ? leaves_[b.first] : 0;
+            return a_frequency != b_frequency ? a_frequency < b_frequency
+                                              : before(b.first, a.first);
+        };
+        std::priority_queue<std::pair<size_t, size_t>,
+                            std::vector<std::pair<size_t, size_t>>,
+                            decltype(after)>
+            heads(after);
+        size_t index;
+        for (size_t range = 0; range < ranges.size(); range++) {
+            if (next(range, index)) {
+                heads.emplace(index, range);
+            }
+        }
+
+        found.clear();
+        while (!heads.empty() && found.size() < limit) {
+            size_t range = heads.top().second;
+            found.push_back(heads.top().first);
+            heads.pop();
+            if (next(range, index)) {
+                heads.emplace(index, range);
+            }
+        }
+    }
+
+    /**
+     * @return The memory held by the tree.
+     */
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        for (const auto& blocks : levels_) {
+            bytes += blocks.size();
+        }
+        return bytes;
+    }
+
+   private:
+    /**
+     * @param level The level of a block; level 0 is the table itself.
+     * @param block The index of the block within its level.
+     * @return The largest frequency in the block.
+     */
+    uint8_t maximum(size_t level, size_t block) const {
+        return level ? levels_[level - 1][block] : leaves_[block];
+    }
+
+    const uint8_t* leaves_ = nullptr;
+    std::vector<std::vector<uint8_t>> levels_;
+};
+
+/**
+ * A compiled dictionary mapped read-only into memory. Lookups binary search
+ * the sorted image in place, or go straight to the one candidate a perfect
+ * hash index names, so the words are never copied onto the heap and every
+ * process mapping the same file shares one copy in the page cache.
+ *
+ * The file must not be rewritten in place while it is mapped; replace it by
+ * renaming a new file over it, as `compile-dict` does.
+ */
+class MappedDictionary {
+   public:
+    MappedDictionary(const MappedDictionary&) = delete;
+    MappedDictionary& operator=(const MappedDictionary&) = delete;
+
+    ~MappedDictionary() {
+        if (data_) {
+            munmap(const_cast<unsigned char*>(data_), size_);
+        }
+    }
+
+    /**
+     * Map a compiled dictionary file.
+     *
+     * @param filename The name of the file to map.
+     * @return The mapped dictionary, or null if the file could not be mapped
+     * or is not a valid compiled dictionary.
+     */
+    static std::shared_ptr<const MappedDictionary> open(
+        const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat info;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::shared_ptr<MappedDictionary> image(new MappedDictionary());
+        image->data_ = static_cast<const unsigned char*>(data);
+        image->size_ = info.st_size;
+        if (!image->validate()) {
+            return nullptr;
+        }
+        return image;
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return True if the word is in the image.
+     */
+    bool contains(std::string_view word) const {
+        return index_of(word) < count_;
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return The index of the word, or size() if it is not in the image.
+     */
+    size_t index_of(std::string_view word) const {
+        if (partitions_) {
+            return indexed_find(word);
+        }
+
+        size_t low = 0;
+        size_t high = count_;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            int order = this->word(middle).compare(word);
+            if (order == 0) {
+                return middle;
+            }
+            if (order < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return count_;
+    }
+
+    /**
+     * Visit the words of the image that are prefixes of a text, shortest
+     * first. A sorted image narrows one binary search as the prefix grows.
+     *
+     * @param text The text.
+     * @param visit Called with the length in bytes and the frequency of
+     * each word.
+     */
+    template <typename Visitor>
+    void for_each_prefix(std::string_view text, Visitor visit) const {
+        size_t low = 0;
+        for (size_t length = 1; length <= text.size(); length++) {
+            std::string_view prefix = text.substr(0, length);
+            if (partitions_) {
+                size_t index = indexed_find(prefix);
+                if (index < count_) {
+                    visit(length, frequency(index));
+                }
+                continue;
+            }
+
+            size_t high = count_;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (word(middle) < prefix) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            if (low == count_ || word(low).substr(0, length) != prefix) {
+                return;
+            }
+            if (word(low).size() == length) {
+                visit(length, frequency(low));
+            }
+        }
+    }
+
+    /**
+     * @param index The index of a word, less than size().
+     * @return The word, pointing into the mapped image.
+     */
+    std::string_view word(size_t index) const {
+        uint32_t start = offset(index);
+        return std::string_view(blob_ + start, offset(index + 1) - start);
+    }
+
+    /**
+     * @param index The index of a word, less than size().
+     * @return The word's quantized frequency.
+     */
+    uint8_t frequency(size_t index) const {
+        return frequencies_ ? frequencies_[index] : 0;
+    }
+
+    /**
+     * Find the most frequent words that start with a prefix. The words of a
+     * sorted image that share a prefix sit together, so the frequency tree
+     * finds the best of them directly; an image in perfect hash order is
+     * scanned instead.
+     *
+     * @param prefix The prefix.
+     * @param limit The most words to find.
+     * @param found The completions to append the words to.
+     */
+    void complete(std::string_view prefix, size_t limit,
+                  std::vector<Completion>& found) const {
+        if (partitions_) {
+            std::vector<Completion> matches;
+            for (size_t i = 0; i < count_; i++) {
+                std::string_view word = this->word(i);
+                if (word.substr(0, prefix.size()) == prefix) {
+                    matches.push_back({std::string(word), frequency(i)});
+                }
+            }
+            limit = std::min(limit, matches.size());
+            std::partial_sort(matches.begin(), matches.begin() + limit,
+                              matches.end(), completion_before);
+            std::move(matches.begin(), matches.begin() + limit,
+                      std::back_inserter(found));
+            return;
+        }
+
+        size_t first = 0;
+        size_t last = count_;
+        while (first < last) {
+            size_t middle = first + (last - first) / 2;
+            if (word(middle) < prefix) {
+                first = middle + 1;
+            } else {
+                last = middle;
+            }
+        }
+        last = count_;
+        for (size_t low = first; low < last;) {
+            size_t middle = low + (last - low) / 2;
+            if (word(middle).substr(0, prefix.size()) == prefix) {
+                low = middle + 1;
+            } else {
+                last = middle;
+            }
+        }
+
+        std::vector<size_t> indexes;
+        ranks_.top({{first, last}}, limit, std::less<size_t>(), indexes);
+        for (size_t index : indexes) {
+            found.push_back({std::string(word(index)), frequency(index)});
+        }
+    }
+
+    /**
+     * @return The number of words in the image.
+     */
+    size_t size() const { return count_; }
+
+    /**
+     * @return True if every word in the image is ASCII.
+     */
+    bool ascii() const { return ascii_; }
+
+    /**
+     * @return True if the image has a perfect hash index.
+     */
+    bool indexed() const { return partitions_ != nullptr; }
+
+    /**
+     * @return The size of the perfect hash index in bits per word, not
+     * counting the fingerprints.
+     */
+    double index_bits_per_word() const {
+        return count_ ? (fingerprints_ - partitions_) * 8.0 / count_ : 0;
+    }
+
+    /**
+     * @return The number of bytes mapped.
+     */
+    size_t mapped_bytes() const { return size_; }
+
+    /**
+     * @return The memory held by the image, counting the mapping at its full
+     * size.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + size_ + ranks_.memory_bytes();
+    }
+
+   private:
+    MappedDictionary() = default;
+
+    /**
+     * Decode the little-endian 32-bit value at a position in the image.
+     *
+     * @param bytes The position to decode.
+     * @return The decoded value.
+     */
+    static uint32_t decode_u32(const unsigned char* bytes) {
+        return uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 |
+               uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+    }
+
+    /**
+     * @param index An index into the offset table, at most size().
+     * @return The blob offset stored at that index.
+     */
+    uint32_t offset(size_t index) const {
+        return decode_u32(offsets_ + 4 * index);
+    }
+
+    /**
+     * Look a word up through the perfect hash index, which names the only
+     * position the word can be at. The fingerprint rejects most absent words
+     * without touching the words themselves.
+     *
+     * @param word The word to look up.
+     * @return The index of the word, or size() if it is not in the image.
+     */
+    size_t indexed_find(std::string_view word) const {
+        uint64_t hash = hash_word(word);
+        size_t partition = (hash >> 32) * partition_count_ >> 32;
+        const unsigned char* entry = partitions_ + 16 * partition;
+        uint32_t first_key = decode_u32(entry);
+        uint32_t keys = decode_u32(entry + 16) - first_key;
+        if (keys == 0) {
+            return count_;
+        }
+        uint32_t first_bucket = decode_u32(entry + 4);
+        uint32_t first_remap = decode_u32(entry + 8);
+        uint32_t remaps = decode_u32(entry + 24) - first_remap;
+
+        uint64_t key = perfect_hash_key(hash, decode_u32(entry + 12));
+        uint32_t bucket = perfect_hash_bucket(
+            key, decode_u32(entry + 20) - first_bucket);
+        const unsigned char* pilot = pilots_ + 2 * (first_bucket + bucket);
+        uint32_t position = perfect_hash_position(
+            key, uint16_t(pilot[0] | pilot[1] << 8), keys + remaps);
+        if (position >= keys) {
+            position = decode_u32(remap_ + 4 * (first_remap + position - keys));
+            if (position >= keys) {
+                return count_;
+            }
+        }
+
+        size_t index = first_key + position;
+        return fingerprints_[index] == uint8_t(hash) &&
+                       this->word(index) == word
+                   ? index
+                   : count_;
+    }
+
+    /**
+     * Check the header and offset table so lookups can trust them.
+     *
+     * @return True if the image is a well-formed compiled dictionary.
+     */
+    bool validate() {
+        const size_t header_size = COMPILED_DICTIONARY_MAGIC_SIZE + 8;
+        if (size_ < header_size) {
+            return false;
+        }
+        bool indexed = std::memcmp(data_, COMPILED_DICTIONARY_MAGIC_INDEXED,
+                                   COMPILED_DICTIONARY_MAGIC_SIZE) == 0;
+        bool has_frequencies =
+            indexed || std::memcmp(data_, COMPILED_DICTIONARY_MAGIC,
+                                   COMPILED_DICTIONARY_MAGIC_SIZE) == 0;
+        if (!has_frequencies &&
+            std::memcmp(data_, COMPILED_DICTIONARY_MAGIC_V1,
+                        COMPILED_DICTIONARY_MAGIC_SIZE) != 0) {
+            return false;
+        }
+
+        count_ = decode_u32(data_ + COMPILED_DICTIONARY_MAGIC_SIZE);
+        uint64_t blob_size =
+            decode_u32(data_ + COMPILED_DICTIONARY_MAGIC_SIZE + 4);
+        uint64_t table_size = 4 * (uint64_t(count_) + 1);
+        uint64_t frequencies_size = has_frequencies ? count_ : 0;
+        uint64_t words_size =
+            header_size + table_size + frequencies_size + blob_size;
+        if (indexed ? words_size > size_ : words_size != size_) {
+            return false;
+        }
+        offsets_ = data_ + header_size;
+        if (has_frequencies) {
+            frequencies_ = offsets_ + table_size;
+        }
+        blob_ = reinterpret_cast<const char*>(offsets_ + table_size +
+                                              frequencies_size);
+
+        for (size_t i = 0; i < count_; i++) {
+            if (offset(i) > offset(i + 1)) {
+                return false;
+            }
+        }
+        if (offset(count_) != blob_size) {
+            return false;
+        }
+
+        ascii_ = is_ascii(std::string_view(blob_, blob_size));
+        if (!indexed) {
+            ranks_.build(frequencies_, count_);
+        }
+        return !indexed || validate_index(words_size);
+    }
+
+    /**
+     * Check the perfect hash index that follows the words so lookups can
+     * trust its partition table.
+     *
+     * @param start The offset of the index in the image.
+     * @return True if the index is well formed.
+     */
+    bool validate_index(uint64_t start) {
+        if (size_ - start < 12) {
+            return false;
+        }
+        const unsigned char* counts = data_ + start;
+        uint32_t partition_count = decode_u32(counts);
+        uint64_t buckets = decode_u32(counts + 4);
+        uint64_t remaps = decode_u32(counts + 8);
+        uint64_t partitions_size = 16 * (uint64_t(partition_count) + 1);
+        if (partition_count == 0 ||
+            start + 12 + partitions_size + 2 * buckets + 4 * remaps +
+                    count_ != size_) {
+            return false;
+        }
+
+        const unsigned char* partitions = counts + 12;
+        const uint64_t totals[3] = {count_, buckets, remaps};
+        for (int field = 0; field < 3; field++) {
+            if (decode_u32(partitions + 4 * field) != 0 ||
+                decode_u32(partitions + partitions_size - 16 + 4 * field) !=
+                    totals[field]) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < partition_count; i++) {
+            const unsigned char* entry = partitions + 16 * i;
+            uint32_t keys = decode_u32(entry + 16) - decode_u32(entry);
+            if (decode_u32(entry) > decode_u32(entry + 16) ||
+                decode_u32(entry + 4) > decode_u32(entry + 20) ||
+                decode_u32(entry + 8) > decode_u32(entry + 24) ||
+                (keys > 0 && decode_u32(entry + 4) == decode_u32(entry + 20))) {
+                return false;
+            }
+        }
+
+        partition_count_ = partition_count;
+        partitions_ = partitions;
+        pilots_ = partitions + partitions_size;
+        remap_ = pilots_ + 2 * buckets;
+        fingerprints_ = remap_ + 4 * remaps;
+        return true;
+    }
+
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    uint32_t count_ = 0;
+    const unsigned char* offsets_ = nullptr;
+    const unsigned char* frequencies_ = nullptr;
+    const char* blob_ = nullptr;
+    bool ascii_ = true;
+    uint32_t partition_count_ = 0;
+    const unsigned char* partitions_ = nullptr;
+    const unsigned char* pilots_ = nullptr;
+    const unsigned char* remap_ = nullptr;
+    const unsigned char* fingerprints_ = nullptr;
+    FrequencyTree ranks_;
+};
+
+/**
+ * What a visitor of MappedTrie::walk wants done after seeing an edge.
+ */
+enum WalkAction { WALK_DESCEND, WALK_SKIP, WALK_STOP };
+
+/**
+ * A compiled trie mapped read-only into memory. The trie is stored in LOUDS
+ * form: the edges of each node sit together in label order, and the nodes
+ * follow one another in breadth-first order, so the children of the k-th
+ * edge with children form the (k + 1)-th node. Rank directories and node
+ * samples built when the file is opened find a child in constant time.
+ *
+ * Like a MappedDictionary, the file must be replaced by renaming rather than
+ * rewritten in place.
+ */
+class MappedTrie {
+   public:
+    // Every this many nodes, the word holding the node's first edge is
+    // recorded, so finding a node scans at most a few words.
+    static const size_t NODE_SAMPLE_RATE = 64;
+
+    MappedTrie(const MappedTrie&) = delete;
+    MappedTrie& operator=(const MappedTrie&) = delete;
+
+    ~MappedTrie() {
+        if (data_) {
+            munmap(const_cast<unsigned char*>(data_), size_);
+        }
+    }
+
+    /**
+     * Map a compiled trie file.
+     *
+     * @param filename The name of the file to map.
+     * @return The mapped trie, or null if the file could not be mapped or is
+     * not a valid compiled trie.
+     */
+    static std::shared_ptr<const MappedTrie> open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat info;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::shared_ptr<MappedTrie> trie(new MappedTrie());
+        trie->data_ = static_cast<const unsigned char*>(data);
+        trie->size_ = info.st_size;
+        if (!trie->validate()) {
+            return nullptr;
+        }
+        return trie;
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return True if the word is in the trie.
+     */
+    bool contains(std::string_view word) const {
+        return index_of(word) < edges_;
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return The edge the word ends at, or edges() if it is not in the
+     * trie.
+     */
+    size_t index_of(std::string_view word) const {
+        size_t edge = find(word);
+        return edge < edges_ && ends_[edge] ? edge : edges_;
+    }
+
+    /**
+     * Visit the words of the trie that are prefixes of a text, shortest
+     * first, by following the text down from the root.
+     *
+     * @param text The text.
+     * @param visit Called with the length in bytes and the frequency of
+     * each word.
+     */
+    template <typename Visitor>
+    void for_each_prefix(std::string_view text, Visitor visit) const {
+        size_t edge = 0;
+        for (size_t i = 0; i < text.size() && edges_ > 0; i++) {
+            unsigned char label = static_cast<unsigned char>(text[i]);
+            while (labels_[edge] != label) {
+                edge++;
+                if (edge == edges_ || nodes_[edge]) {
+                    return;
+                }
+            }
+            if (ends_[edge]) {
+                visit(i + 1, word_frequency(edge));
+            }
+            if (!children_[edge]) {
+                return;
+            }
+            edge = child(edge);
+        }
+    }
+
+    /**
+     * Walk the words that start with a prefix, and the prefixes of those
+     * words, in lexicographic order, one edge at a time.
+     *
+     * @param prefix The prefix to start from; every path starts with it.
+     * @param visit Called with the path to each edge and, if a word ends
+     * there, a pointer to its frequency; returns whether to descend below
+     * the edge, skip its subtree, or stop the walk.
+     * @return False if the walk was stopped.
+     */
+    template <typename Visitor>
+    bool walk(std::string_view prefix, Visitor visit) const {
+        return walk_edges(prefix, [&](std::string_view path, size_t edge) {
+            uint8_t frequency = word_frequency(edge);
+            return visit(path, ends_[edge] ? &frequency : nullptr);
+        });
+    }
+
+    /**
+     * Find the most frequent words that start with a prefix. The edges of
+     * each node are ordered by the largest frequency at or below them, and
+     * nodes are opened best first, so only the paths down to the words
+     * found are read.
+     *
+     * @param prefix The prefix.
+     * @param limit The most words to find.
+     * @param found The completions to append the words to.
+     */
+    void complete(std::string_view prefix, size_t limit,
+                  std::vector<Completion>& found) const {
+        // An opened node: the path to it, its first edge, and the largest
+        // frequency at or below each of its edges. The edges are taken best
+        // first, in label order among equals.
+        struct Node {
+            std::string path;
+            size_t first;
+            std::vector<uint8_t> maxima;
+        };
+        // A candidate is an edge of a node, standing for its subtree and
+        // every edge of the node taken after it, or the word ending at the
+        // edge. Its frequency and the path through the edge bound every
+        // word it stands for, so candidates come off the queue in
+        // completion order.
+        struct Candidate {
+            uint8_t frequency;
+            size_t node;
+            size_t position;
+            bool word;
+        };
+        std::vector<Node> nodes;
+        auto label = [&](const Candidate& candidate) {
+            return labels_[nodes[candidate.node].first + candidate.position];
+        };
+        auto after = [&](const Candidate& a, const Candidate& b) {
+            if (a.frequency != b.frequency) {
+                return a.frequency < b.frequency;
+            }
+            const std::string& a_path = nodes[a.node].path;
+            const std::string& b_path = nodes[b.node].path;
+            size_t length = std::min(a_path.size(), b_path.size()) + 1;
+            for (size_t i = 0; i < length; i++) {
+                unsigned char a_byte =
+                    i < a_path.size() ? a_path[i] : label(a);
+                unsigned char b_byte =
+                    i < b_path.size() ? b_path[i] : label(b);
+                if (a_byte != b_byte) {
+                    return a_byte > b_byte;
+                }
+            }
+            return a_path.size() > b_path.size();
+        };
+        std::priority_queue<Candidate, std::vector<Candidate>,
+                            decltype(after)>
+            candidates(after);
+
+        // Queue the edge taken after a position, or the best edge when the
+        // position is the node's edge count: the next edge as frequent,
+        // else the leftmost of the most frequent edges that are less so.
+        auto push_next = [&](size_t index, size_t position) {
+            const std::vector<uint8_t>& maxima = nodes[index].maxima;
+            size_t next = maxima.size();
+            if (position < maxima.size()) {
+                for (size_t i = position + 1; i < maxima.size(); i++) {
+                    if (maxima[i] == maxima[position]) {
+                        candidates.push({maxima[i], index, i, false});
+                        return;
+                    }
+                }
+            }
+            for (size_t i = 0; i < maxima.size(); i++) {
+                if ((position == maxima.size() ||
+                     maxima[i] < maxima[position]) &&
+                    (next == maxima.size() || maxima[i] > maxima[next])) {
+                    next = i;
+                }
+            }
+            if (next < maxima.size()) {
+                candidates.push({maxima[next], index, next, false});
+            }
+        };
+        auto open = [&](std::string path, size_t first) {
+            Node node{std::move(path), first, {}};
+            size_t child_rank = children_.rank(first);
+            size_t end_rank = ends_.rank(first);
+            for (size_t edge = first, last = node_end(first); edge < last;
+                 edge++) {
+                uint8_t frequency = 0;
+                if (ends_[edge]) {
+                    frequency = frequencies_[end_rank++];
+                }
+                if (children_[edge]) {
+                    frequency = std::max(frequency, maxima_[child_rank++]);
+                }
+                node.maxima.push_back(frequency);
+            }
+            nodes.push_back(std::move(node));
+            push_next(nodes.size() - 1, nodes.back().maxima.size());
+        };
+
+        if (prefix.empty()) {
+            if (edges_ > 0) {
+                open(std::string(), 0);
+            }
+        } else {
+            size_t edge = find(prefix);
+            if (edge == edges_) {
+                return;
+            }
+            uint8_t frequency = subtree_frequency(edge);
+            nodes.push_back({std::string(prefix.substr(0, prefix.size() - 1)),
+                             edge, {frequency}});
+            candidates.push({frequency, 0, 0, false});
+        }
+
+        size_t limit_end = found.size() + limit;
+        while (!candidates.empty() && found.size() < limit_end) {
+            Candidate candidate = candidates.top();
+            candidates.pop();
+            std::string path = nodes[candidate.node].path;
+            path += static_cast<char>(label(candidate));
+            if (candidate.word) {
+                found.push_back({std::move(path), candidate.frequency});
+                continue;
+            }
+
+            size_t edge = nodes[candidate.node].first + candidate.position;
+            push_next(candidate.node, candidate.position);
+            if (ends_[edge]) {
+                candidates.push({word_frequency(edge), candidate.node,
+                                 candidate.position, true});
+            }
+            if (children_[edge]) {
+                open(std::move(path), child(edge));
+            }
+        }
+    }
+
+    /**
+     * Visit every word in the trie in lexicographic order.
+     *
+     * @param visit Called with each word and its frequency; returning false
+     * stops the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_word(Visitor& visit) const {
+        return walk("", [&](std::string_view path, const uint8_t* frequency) {
+            return frequency && !visit(path, *frequency) ? WALK_STOP
+                                                         : WALK_DESCEND;
+        });
+    }
+
+    /**
+     * Visit every word in the trie in lexicographic order, along with the
+     * edge it ends at.
+     *
+     * @param visit Called with each word and its edge; returning false stops
+     * the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_word_end(Visitor visit) const {
+        return walk_edges("", [&](std::string_view path, size_t edge) {
+            return ends_[edge] && !visit(path, edge) ? WALK_STOP
+                                                     : WALK_DESCEND;
+        });
+    }
+
+    /**
+     * Spell out the word ending at an edge by climbing to the root.
+     *
+     * @param edge An edge a word ends at.
+     * @param word Receives the word.
+     * @return The word's frequency.
+     */
+    uint8_t word_at(size_t edge, std::string& word) const {
+        uint8_t frequency = word_frequency(edge);
+        word.clear();
+        for (;;) {
+            word += static_cast<char>(labels_[edge]);
+            size_t node = nodes_.rank(edge + 1) - 1;
+            if (node == 0) {
+                break;
+            }
+            edge = children_.select(node - 1);
+        }
+        std::reverse(word.begin(), word.end());
+        return frequency;
+    }
+
+    /**
+     * @return The number of words in the trie.
+     */
+    size_t size() const { return count_; }
+
+    /**
+     * @return True if every word in the trie is ASCII.
+     */
+    bool ascii() const { return ascii_; }
+
+    /**
+     * @return The number of edges in the trie.
+     */
+    size_t edges() const { return edges_; }
+
+    /**
+     * @return The number of bytes mapped.
+     */
+    size_t mapped_bytes() const { return size_; }
+
+    /**
+     * @return The memory held by the trie, counting the mapping at its full
+     * size.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + size_ + children_.memory_bytes() +
+               nodes_.memory_bytes() + ends_.memory_bytes() +
+               node_samples_.size() * sizeof(uint32_t) + maxima_.size();
+    }
+
+   private:
+    MappedTrie() = default;
+
+    static uint32_t decode_u32(const unsigned char* bytes) {
+        return uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 |
+               uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+    }
+
+    static uint64_t decode_u64(const unsigned char* bytes) {
+        uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap64(value);
+#endif
+        return value;
+    }
+
+    /**
+     * @param value A 64-bit word.
+     * @param index Which set bit to find, counting from 0; less than the
+     * number of set bits in value.
+     * @return The position of the set bit.
+     */
+    static size_t select_in_word(uint64_t value, size_t index) {
+        size_t shift = 0;
+        for (size_t width = 32; width >= 8; width /= 2) {
+            uint64_t low = value >> shift & ((uint64_t(1) << width) - 1);
+            size_t ones = __builtin_popcountll(low);
+            if (index >= ones) {
+                index -= ones;
+                shift += width;
+            }
+        }
+        uint64_t rest = value >> shift;
+        for (; index > 0; index--) {
+            rest &= rest - 1;
+        }
+        return shift + __builtin_ctzll(rest);
+    }
+
+    /**
+     * A bit vector of one bit per edge in the mapped file, with a rank
+     * directory on the heap: the set bits before each block of 256 and,
+     * within the block, before each 64-bit word.
+     */
+    struct RankedBits {
+        const unsigned char* bits = nullptr;
+        std::vector<uint32_t> blocks;
+        std::vector<uint8_t> words;
+
+        bool operator[](size_t index) const {
+            return bits[index / 8] >> (index % 8) & 1;
+        }
+
+        uint64_t word(size_t index) const {
+            return decode_u64(bits + 8 * index);
+        }
+
+        /**
+         * @param index A position, at most the number of bits.
+         * @return The number of set bits before index.
+         */
+        size_t rank(size_t index) const {
+            size_t count = blocks[index / 256] + words[index / 64];
+            if (index % 64) {
+                count += __builtin_popcountll(
+                    word(index / 64) & ((uint64_t(1) << (index % 64)) - 1));
+            }
+            return count;
+        }
+
+        /**
+         * @param index Which set bit to find, counting from 0; less than
+         * the number of set bits.
+         * @return The position of the set bit.
+         */
+        size_t select(size_t index) const {
+            size_t block = std::upper_bound(blocks.begin(), blocks.end(),
+                                            uint32_t(index)) -
+                           blocks.begin() - 1;
+            size_t remaining = index - blocks[block];
+            for (size_t i = block * 4;; i++) {
+                uint64_t value = word(i);
+                size_t ones = __builtin_popcountll(value);
+                if (remaining < ones) {
+                    return i * 64 + select_in_word(value, remaining);
+                }
+                remaining -= ones;
+            }
+        }
+
+        /**
+         * Build the rank directory.
+         *
+         * @param size The number of bits.
+         * @return The number of set bits.
+         */
+        size_t build(size_t size) {
+            size_t word_count = (size + 63) / 64;
+            blocks.assign(word_count / 4 + 1, 0);
+            words.assign(word_count + 1, 0);
+            size_t count = 0;
+            for (size_t i = 0; i <= word_count; i++) {
+                if (i % 4 == 0) {
+                    blocks[i / 4] = count;
+                }
+                words[i] = count - blocks[i / 4];
+                if (i < word_count) {
+                    count += __builtin_popcountll(word(i));
+                }
+            }
+            return count;
+        }
+
+        /**
+         * @return The memory held by the rank directory.
+         */
+        size_t memory_bytes() const {
+            return blocks.size() * sizeof(uint32_t) + words.size();
+        }
+    };
+
+    /**
+     * Walk the edges below a prefix in lexicographic order, as walk does,
+     * handing the visitor each edge itself.
+     *
+     * @param prefix The prefix to start from.
+     * @param visit Called with the path to each edge and the edge; returns
+     * whether to descend below the edge, skip its subtree, or stop the walk.
+     * @return False if the walk was stopped.
+     */
+    template <typename Visitor>
+    bool walk_edges(std::string_view prefix, Visitor visit) const {
+        std::string path(prefix);
+        size_t node = 0;
+        if (!prefix.empty()) {
+            size_t edge = find(prefix);
+            if (edge == edges_) {
+                return true;
+            }
+            WalkAction action = visit(std::string_view(path), edge);
+            if (action == WALK_STOP) {
+                return false;
+            }
+            if (action == WALK_SKIP || !children_[edge]) {
+                return true;
+            }
+            node = child(edge);
+        } else if (edges_ == 0) {
+            return true;
+        }
+
+        // Each frame is the next edge to visit in a node and the node's end.
+        std::vector<std::pair<size_t, size_t>> stack;
+        stack.emplace_back(node, node_end(node));
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.first == frame.second) {
+                stack.pop_back();
+                continue;
+            }
+            size_t edge = frame.first++;
+            path.resize(prefix.size() + stack.size() - 1);
+            path += static_cast<char>(labels_[edge]);
+
+            WalkAction action = visit(std::string_view(path), edge);
+            if (action == WALK_STOP) {
+                return false;
+            }
+            if (action == WALK_DESCEND && children_[edge]) {
+                size_t first = child(edge);
+                stack.emplace_back(first, node_end(first));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Find the first edge of a node, scanning forward from the word that
+     * holds the nearest sampled node before it.
+     *
+     * @param node The node, counting the root as 0.
+     * @return The position of the (node + 1)-th set bit of the node vector.
+     */
+    size_t node_start(size_t node) const {
+        size_t word = node_samples_[node / NODE_SAMPLE_RATE];
+        size_t remaining = node - nodes_.rank(word * 64);
+        for (;; word++) {
+            uint64_t value = nodes_.word(word);
+            size_t ones = __builtin_popcountll(value);
+            if (remaining < ones) {
+                return word * 64 + select_in_word(value, remaining);
+            }
+            remaining -= ones;
+        }
+    }
+
+    /**
+     * @param first The first edge of a node.
+     * @return The position just past the node's last edge.
+     */
+    size_t node_end(size_t first) const {
+        size_t next = first + 1;
+        if (next >= edges_) {
+            return edges_;
+        }
+        size_t word = next / 64;
+        uint64_t value = nodes_.word(word) & ~uint64_t(0) << (next % 64);
+        while (value == 0) {
+            if (++word * 64 >= edges_) {
+                return edges_;
+            }
+            value = nodes_.word(word);
+        }
+        return word * 64 + __builtin_ctzll(value);
+    }
+
+    /**
+     * @param edge An edge with children.
+     * @return The first edge of the node the edge leads to.
+     */
+    size_t child(size_t edge) const {
+        return node_start(children_.rank(edge) + 1);
+    }
+
+    /**
+     * @param edge An edge.
+     * @return The frequency of the word ending at the edge, or 0 if none
+     * does.
+     */
+    uint8_t word_frequency(size_t edge) const {
+        return ends_[edge] ? frequencies_[ends_.rank(edge)] : 0;
+    }
+
+    /**
+     * @param edge An edge.
+     * @return The largest frequency of the word ending at the edge and the
+     * words below it.
+     */
+    uint8_t subtree_frequency(size_t edge) const {
+        uint8_t frequency = word_frequency(edge);
+        return children_[edge]
+                   ? std::max(frequency, maxima_[children_.rank(edge)])
+                   : frequency;
+    }
+
+    /**
+     * Follow a path from the root.
+     *
+     * @param path The labels to follow; must not be empty.
+     * @return The last edge of the path, or the edge count if the trie does
+     * not have the path.
+     */
+    size_t find(std::string_view path) const {
+        if (path.empty() || edges_ == 0) {
+            return edges_;
+        }
+        size_t edge = 0;
+        for (size_t i = 0;; i++) {
+            unsigned char label = static_cast<unsigned char>(path[i]);
+            while (labels_[edge] != label) {
+                edge++;
+                if (edge == edges_ || nodes_[edge]) {
+                    return edges_;
+                }
+            }
+            if (i + 1 == path.size()) {
+                return edge;
+            }
+            if (!children_[edge]) {
+                return edges_;
+            }
+            edge = child(edge);
+        }
+    }
+
+    /**
+     * Check the layout and the shape of the trie so walks can trust it:
+     * every node but the root hangs off exactly one edge, and children
+     * always come after their parents, so every walk ends.
+     *
+     * @return True if the file is a well-formed compiled trie.
+     */
+    bool validate() {
+        const size_t header_size = COMPILED_DICTIONARY_MAGIC_SIZE + 8;
+        if (size_ < header_size ||
+            std::memcmp(data_, COMPILED_TRIE_MAGIC,
+                        COMPILED_DICTIONARY_MAGIC_SIZE) != 0) {
+            return false;
+        }
+        count_ = decode_u32(data_ + COMPILED_DICTIONARY_MAGIC_SIZE);
+        edges_ = decode_u32(data_ + COMPILED_DICTIONARY_MAGIC_SIZE + 4);
+
+        uint64_t labels_size = (uint64_t(edges_) + 7) / 8 * 8;
+        uint64_t bits_size = (uint64_t(edges_) + 63) / 64 * 8;
+        if (header_size + labels_size + 3 * bits_size + count_ != size_) {
+            return false;
+        }
+        labels_ = data_ + header_size;
+        children_.bits = labels_ + labels_size;
+        nodes_.bits = children_.bits + bits_size;
+        ends_.bits = nodes_.bits + bits_size;
+        frequencies_ = ends_.bits + bits_size;
+
+        // Bits past the last edge must be clear for the counts to hold.
+        if (edges_ % 64) {
+            uint64_t unused = ~((uint64_t(1) << (edges_ % 64)) - 1);
+            for (const RankedBits* bits : {&children_, &nodes_, &ends_}) {
+                if (bits->word(edges_ / 64) & unused) {
+                    return false;
+                }
+            }
+        }
+
+        size_t with_children = children_.build(edges_);
+        size_t nodes = nodes_.build(edges_);
+        node_samples_.clear();
+        for (size_t edge = 0, node = 0; edge < edges_; edge++) {
+            if (nodes_[edge] && node++ % NODE_SAMPLE_RATE == 0) {
+                node_samples_.push_back(edge / 64);
+            }
+        }
+        if (ends_.build(edges_) != count_ ||
+            (edges_ > 0 && (!nodes_[0] || nodes != with_children + 1))) {
+            return false;
+        }
+
+        size_t node = 0;
+        size_t children = 0;
+        for (size_t edge = 0; edge < edges_; edge++) {
+            node += nodes_[edge];
+            if (children_[edge] && ++children + 1 <= node) {
+                return false;
+            }
+            if (!children_[edge] && !ends_[edge]) {
+                return false;
+            }
+        }
+
+        // Children come after their parents, so one backward pass sees
+        // every node before the edge it hangs off.
+        maxima_.assign(with_children, 0);
+        size_t child_rank = with_children;
+        size_t end_rank = count_;
+        uint8_t maximum = 0;
+        for (size_t edge = edges_; edge-- > 0;) {
+            uint8_t frequency = ends_[edge] ? frequencies_[--end_rank] : 0;
+            if (children_[edge]) {
+                frequency = std::max(frequency, maxima_[--child_rank]);
+            }
+            maximum = std::max(maximum, frequency);
+            if (nodes_[edge]) {
+                if (node > 1) {
+                    maxima_[node - 2] = maximum;
+                }
+                node--;
+                maximum = 0;
+            }
+        }
+
+        ascii_ = is_ascii(std::string_view(
+            reinterpret_cast<const char*>(labels_), edges_));
+        return true;
+    }
+
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    uint32_t count_ = 0;
+    uint32_t edges_ = 0;
+    const unsigned char* labels_ = nullptr;
+    RankedBits children_;
+    RankedBits nodes_;
+    RankedBits ends_;
+    const unsigned char* frequencies_ = nullptr;
+    std::vector<uint32_t> node_samples_;
+    std::vector<uint8_t> maxima_;
+    bool ascii_ = true;
+};
+
+// Packed Word Tables
+//
+// In-memory layers store their words re-encoded over the layer's own
+// alphabet. Each distinct code point in the layer gets a symbol ID from 1 up,
+// with symbol 0 standing for any code point the layer does not use, and the
+// words are packed back to back at the fewest bits per symbol that hold every
+// ID: 5 bits for plain English, 6 for most alphabets with accents. Words are
+// sorted by length, so suggestions only visit words of a plausible length,
+// and are found through an open-addressing table of word indices.
+//
+// Suggestions compare symbols directly when the alphabet fits in this many
+// symbols, symbol 0 included, and decode the words otherwise.
+const size_t KERNEL_ALPHABET_SIZE = 64;
+
+/**
+ * The alphabet of a packed word table: a dense symbol ID for each code point
+ * used by its words, assigned in code point order.
+ */
+class SymbolAlphabet {
+   public:
+    SymbolAlphabet() = default;
+
+    /**
+     * @param code_points The code points of the alphabet, sorted and unique.
+     */
+    explicit SymbolAlphabet(std::vector<uint32_t> code_points)
+        : code_points_(std::move(code_points)) {
+        for (size_t i = 0; i < code_points_.size(); i++) {
+            if (code_points_[i] < 0x80) {
+                ascii_symbols_[code_points_[i]] = i + 1;
+            }
+        }
+    }
+
+    /**
+     * @return The number of symbols, counting symbol 0.
+     */
+    size_t size() const { return code_points_.size() + 1; }
+
+    /**
+     * @return True if every code point in the alphabet is ASCII.
+     */
+    bool ascii() const {
+        return code_points_.empty() || code_points_.back() < 0x80;
+    }
+
+    /**
+     * @param code_point A code point.
+     * @return Its symbol, or 0 if it is not in the alphabet.
+     */
+    uint16_t symbol(uint32_t code_point) const {
+        if (code_point < 0x80) {
+            return ascii_symbols_[code_point];
+        }
+        auto found = std::lower_bound(code_points_.begin(),
+                                      code_points_.end(), code_point);
+        if (found == code_points_.end() || *found != code_point) {
+            return 0;
+        }
+        return found - code_points_.begin() + 1;
+    }
+
+    /**
+     * @param symbol A symbol other than 0.
+     * @return The code point it stands for.
+     */
+    uint32_t code_point(uint16_t symbol) const {
+        return code_points_[symbol - 1];
+    }
+
+    /**
+     * Encode a UTF-8 word, skipping invalid bytes.
+     *
+     * @param word The word to encode.
+     * @param symbols Receives one symbol per code point.
+     * @return True if every code point is in the alphabet.
+     */
+    bool encode(std::string_view word, std::vector<uint16_t>& symbols) const {
+        symbols.clear();
+        bool known = true;
+        size_t pos = 0;
+        while (pos < word.size()) {
+            uint32_t code_point;
+            if (decode_utf8(word, pos, code_point)) {
+                symbols.push_back(symbol(code_point));
+                known = known && symbols.back() != 0;
+            }
+        }
+        return known;
+    }
+
+   private:
+    uint16_t ascii_symbols_[0x80] = {};
+    std::vector<uint32_t> code_points_;
+};
+
+/**
+ * An immutable table of words and their frequencies, stored as symbols of a
+ * SymbolAlphabet packed into a bit array. See "Packed Word Tables" above.
+ */
+class PackedWords {
+   public:
+    /**
+     * Pack a table of words.
+     *
+     * @param words The words and their frequencies.
+     * @return The packed table.
+     */
+    static std::shared_ptr<const PackedWords> build(
+        const std::unordered_map<std::string, uint8_t>& words) {
+        std::shared_ptr<PackedWords> packed(new PackedWords());
+
+        // Measure every word and collect the alphabet in one pass.
+        std::vector<std::pair<const std::string*, uint8_t>> entries;
+        std::vector<uint32_t> lengths;
+        entries.reserve(words.size());
+        lengths.reserve(words.size());
+        bool ascii_used[0x80] = {};
+        std::vector<uint32_t> code_points;
+        for (const auto& entry : words) {
+            size_t length = 0;
+            size_t pos = 0;
+            while (pos < entry.first.size()) {
+                uint32_t code_point;
+                if (decode_utf8(entry.first, pos, code_point)) {
+                    if (code_point < 0x80) {
+                        ascii_used[code_point] = true;
+                    } else {
+                        code_points.push_back(code_point);
+                    }
+                    length++;
+                }
+            }
+            entries.emplace_back(&entry.first, entry.second);
+            lengths.push_back(length);
+        }
+        std::sort(code_points.begin(), code_points.end());
+        code_points.erase(std::unique(code_points.begin(), code_points.end()),
+                          code_points.end());
+        std::vector<uint32_t> alphabet;
+        for (uint32_t code_point = 0; code_point < 0x80; code_point++) {
+            if (ascii_used[code_point]) {
+                alphabet.push_back(code_point);
+            }
+        }
+        alphabet.insert(alphabet.end(), code_points.begin(), code_points.end());
+        packed->alphabet_ = SymbolAlphabet(std::move(alphabet));
+
+        size_t largest = packed->alphabet_.size() - 1;
+        while ((size_t(1) << packed->symbol_bits_) <= largest) {
+            packed->symbol_bits_++;
+        }
+        packed->symbol_mask_ = (uint64_t(1) << packed->symbol_bits_) - 1;
+
+        // Order the words by length, then bytes.
+        std::vector<uint32_t> order(entries.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return lengths[a] != lengths[b] ? lengths[a] < lengths[b]
+                                            : *entries[a].first <
+                                                  *entries[b].first;
+        });
+
+        size_t total = 0;
+        for (uint32_t length : lengths) {
+            total += length;
+        }
+        // A spare word lets symbol() read two words at the very end.
+        packed->bits_.assign(total * packed->symbol_bits_ / 64 + 2, 0);
+        packed->offsets_.reserve(entries.size() + 1);
+        packed->frequencies_.reserve(entries.size());
+
+        size_t position = 0;
+        for (uint32_t i : order) {
+            while (packed->length_starts_.size() <= lengths[i]) {
+                packed->length_starts_.push_back(packed->offsets_.size());
+            }
+            packed->offsets_.push_back(position);
+            packed->frequencies_.push_back(entries[i].second);
+
+            const std::string& word = *entries[i].first;
+            size_t pos = 0;
+            while (pos < word.size()) {
+                uint32_t code_point;
+                if (decode_utf8(word, pos, code_point)) {
+                    packed->set_symbol(position++,
+                                       packed->alphabet_.symbol(code_point));
+                }
+            }
+        }
+        packed->offsets_.push_back(position);
+        packed->length_starts_.push_back(packed->frequencies_.size());
+        packed->ranks_.build(packed->frequencies_.data(),
+                             packed->frequencies_.size());
+
+        size_t slots = 16;
+        while (slots < 2 * entries.size()) {
+            slots *= 2;
+        }
+        packed->slots_.assign(slots, 0);
+        for (size_t i = 0; i < entries.size(); i++) {
+            size_t slot = packed->hash(i) & (slots - 1);
+            while (packed->slots_[slot] != 0) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            packed->slots_[slot] = i + 1;
+        }
+        return packed;
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return True if the word is in the table.
+     */
+    bool contains(std::string_view word) const {
+        return index_of(word) < size();
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return The index of the word, or size() if it is not in the table.
+     */
+    size_t index_of(std::string_view word) const {
+        thread_local std::vector<uint16_t> symbols;
+        return size() > 0 && alphabet_.encode(word, symbols)
+                   ? find(symbols.data(), symbols.size())
+                   : size();
+    }
+
+    /**
+     * Visit the words of the table that are prefixes of a text, shortest
+     * first. The text is encoded one code point at a time and each prefix
+     * probes the hash table, up to the length of the longest word.
+     *
+     * @param text The text.
+     * @param visit Called with the length in bytes and the frequency of
+     * each word.
+     */
+    template <typename Visitor>
+    void for_each_prefix(std::string_view text, Visitor visit) const {
+        thread_local std::vector<uint16_t> symbols;
+        symbols.clear();
+        size_t pos = 0;
+        size_t longest =
+            length_starts_.size() < 2 ? 0 : length_starts_.size() - 2;
+        while (pos < text.size() && symbols.size() < longest) {
+            uint32_t code_point;
+            if (!decode_utf8(text, pos, code_point)) {
+                continue;
+            }
+            uint16_t symbol = alphabet_.symbol(code_point);
+            if (symbol == 0) {
+                return;
+            }
+            symbols.push_back(symbol);
+            size_t index = find(symbols.data(), symbols.size());
+            if (index < size()) {
+                visit(pos, frequency(index));
+            }
+        }
+    }
+
+    /**
+     * @return The number of words in the table.
+     */
+    size_t size() const { return frequencies_.size(); }
+
+    /**
+     * @param index The index of a word.
+     * @return The word's length in code points.
+     */
+    size_t length(size_t index) const {
+        return offsets_[index + 1] - offsets_[index];
+    }
+
+    /**
+     * @param index The index of a word.
+     * @return The position of the word's first symbol.
+     */
+    size_t offset(size_t index) const { return offsets_[index]; }
+
+    /**
+     * @param index The index of a word.
+     * @return The word's frequency.
+     */
+    uint8_t frequency(size_t index) const { return frequencies_[index]; }
+
+    /**
+     * @param position The position of a symbol in the packed array.
+     * @return The symbol.
+     */
+    uint16_t symbol(size_t position) const {
+        size_t bit = position * symbol_bits_;
+        size_t shift = bit % 64;
+        uint64_t value = bits_[bit / 64] >> shift;
+        if (shift + symbol_bits_ > 64) {
+            value |= bits_[bit / 64 + 1] << (64 - shift);
+        }
+        return value & symbol_mask_;
+    }
+
+    /**
+     * Decode a word back to UTF-8.
+     *
+     * @param index The index of the word.
+     * @param word Receives the word.
+     */
+    void decode(size_t index, std::string& word) const {
+        word.clear();
+        for (size_t i = offsets_[index]; i < offsets_[index + 1]; i++) {
+            append_utf8(word, alphabet_.code_point(symbol(i)));
+        }
+    }
+
+    /**
+     * @return The alphabet the words are encoded over.
+     */
+    const SymbolAlphabet& alphabet() const { return alphabet_; }
+
+    /**
+     * @return The memory held by the table.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + alphabet_.size() * sizeof(uint32_t) +
+               bits_.size() * sizeof(uint64_t) +
+               offsets_.size() * sizeof(uint32_t) + frequencies_.size() +
+               length_starts_.size() * sizeof(uint32_t) +
+               slots_.size() * sizeof(uint32_t) + ranks_.memory_bytes();
+    }
+
+    /**
+     * Find the most frequent words that start with a prefix. The words of
+     * each length that share a prefix sit together, since symbols are
+     * numbered in code point order, so the frequency tree finds the best of
+     * them directly.
+     *
+     * @param prefix The prefix.
+     * @param limit The most words to find.
+     * @param found The completions to append the words to.
+     */
+    void complete(std::string_view prefix, size_t limit,
+                  std::vector<Completion>& found) const {
+        std::vector<uint16_t> symbols;
+        if (!alphabet_.encode(prefix, symbols)) {
+            return;
+        }
+
+        // Compare the start of a word with the prefix.
+        auto compare = [&](size_t index) {
+            for (size_t i = 0; i < symbols.size(); i++) {
+                uint16_t symbol = this->symbol(offsets_[index] + i);
+                if (symbol != symbols[i]) {
+                    return symbol < symbols[i] ? -1 : 1;
+                }
+            }
+            return 0;
+        };
+
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (size_t length = symbols.size();
+             length + 1 < length_starts_.size(); length++) {
+            size_t first = length_starts_[length];
+            size_t last = length_starts_[length + 1];
+            while (first < last) {
+                size_t middle = first + (last - first) / 2;
+                if (compare(middle) < 0) {
+                    first = middle + 1;
+                } else {
+                    last = middle;
+                }
+            }
+            last = length_starts_[length + 1];
+            for (size_t low = first; low < last;) {
+                size_t middle = low + (last - low) / 2;
+                if (compare(middle) == 0) {
+                    low = middle + 1;
+                } else {
+                    last = middle;
+                }
+            }
+
+            ranges.emplace_back(first, last);
+        }
+
+        // Words of different lengths compare symbol by symbol, then by
+        // length, which agrees with byte order.
+        auto before = [&](size_t a, size_t b) {
+            size_t common = std::min(length(a), length(b));
+            for (size_t i = 0; i < common; i++) {
+                uint16_t a_symbol = symbol(offsets_[a] + i);
+                uint16_t b_symbol = symbol(offsets_[b] + i);
+                if (a_symbol != b_symbol) {
+                    return a_symbol < b_symbol;
+                }
+            }
+            return length(a) < length(b);
+        };
+        std::vector<size_t> indexes;
+        ranks_.top(ranges, limit, before, indexes);
+        std::string word;
+        for (size_t index : indexes) {
+            decode(index, word);
+            found.push_back({word, frequencies_[index]});
+        }
+    }
+
+    /**
+     * Visit the words whose lengths are within a bound of a given length,
+     * nearest lengths first. The bound is read again before each word, so
+     * the visitor may tighten it as it goes.
+     *
+     * @param length The length to search around, in code points.
+     * @param bound The largest length difference of interest.
+     * @param visit Called with the index of each word; returning false
+     * stops the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_near(size_t length, const int& bound, Visitor visit) const {
+        for (size_t difference = 0; difference <= size_t(bound);
+             difference++) {
+            for (int side = 0; side < (difference == 0 ? 1 : 2); side++) {
+                if (side == 0 && difference > length) {
+                    continue;
+                }
+                size_t bucket =
+                    side == 0 ? length - difference : length + difference;
+                if (bucket + 1 >= length_starts_.size()) {
+                    continue;
+                }
+                for (size_t i = length_starts_[bucket];
+                     i < length_starts_[bucket + 1] &&
+                     difference <= size_t(bound);
+                     i++) {
+                    if (!visit(i)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+   private:
+    PackedWords() = default;
+
+    void set_symbol(size_t position, uint16_t symbol) {
+        size_t bit = position * symbol_bits_;
+        size_t shift = bit % 64;
+        bits_[bit / 64] |= uint64_t(symbol) << shift;
+        if (shift + symbol_bits_ > 64) {
+            bits_[bit / 64 + 1] |= uint64_t(symbol) >> (64 - shift);
+        }
+    }
+
+    /**
+     * @param symbols The symbols of a word.
+     * @param count The number of symbols.
+     * @return The index of the word, or size() if it is not in the table.
+     */
+    size_t find(const uint16_t* symbols, size_t count) const {
+        uint64_t word_hash = hash(symbols, count);
+        size_t mask = slots_.size() - 1;
+        for (size_t slot = word_hash & mask; slots_[slot] != 0;
+             slot = (slot + 1) & mask) {
+            size_t index = slots_[slot] - 1;
+            if (length(index) == count && equal(index, symbols)) {
+                return index;
+            }
+        }
+        return size();
+    }
+
+    bool equal(size_t index, const uint16_t* symbols) const {
+        for (size_t i = 0; i < length(index); i++) {
+            if (symbol(offsets_[index] + i) != symbols[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64_t hash(const uint16_t* symbols, size_t length) {
+        uint64_t value = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; i++) {
+            value = (value ^ symbols[i]) * 1099511628211ULL;
+        }
+        return value ^ value >> 32;
+    }
+
+    uint64_t hash(size_t index) const {
+        uint64_t value = 14695981039346656037ULL;
+        for (size_t i = offsets_[index]; i < offsets_[index + 1]; i++) {
+            value = (value ^ symbol(i)) * 1099511628211ULL;
+        }
+        return value ^ value >> 32;
+    }
+
+    SymbolAlphabet alphabet_;
+    size_t symbol_bits_ = 1;
+    uint64_t symbol_mask_ = 1;
+    std::vector<uint64_t> bits_;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint8_t> frequencies_;
+    std::vector<uint32_t> length_starts_;
+    std::vector<uint32_t> slots_;
+    FrequencyTree ranks_;
+};
+
+// Membership Filters
+//
+// With --filter, each layer built or loaded gets a blocked Bloom filter over
+// the words of its table or image, so looking up a word the layer does not
+// have usually costs one cache line instead of a probe of the table or a
+// binary search of the image. Every key sets MEMBERSHIP_FILTER_HASHES bits
+// in a single 512-bit block, which at MEMBERSHIP_FILTER_BITS_PER_KEY bits
+// per key lets about 1% of absent words through. Words in a layer's delta
+// are always looked up exactly.
+const size_t MEMBERSHIP_FILTER_BITS_PER_KEY = 10;
+const int MEMBERSHIP_FILTER_HASHES = 7;
+
+std::atomic<bool> membership_filters{false};
+
+/**
+ * A blocked Bloom filter over a set of words. It never rejects a word that
+ * was inserted, and accepts a word that was not with a small probability.
+ */
+class MembershipFilter {
+   public:
+    /**
+     * Create an empty filter sized for a number of keys.
+     *
+     * @param keys The number of words that will be inserted.
+     */
+    explicit MembershipFilter(size_t keys)
+        : blocks_(std::max<size_t>(
+              1, (keys * MEMBERSHIP_FILTER_BITS_PER_KEY + 511) / 512)),
+          keys_(keys) {}
+
+    /**
+     * @param word The word to add.
+     */
+    void insert(std::string_view word) {
+        uint64_t value = hash(word);
+        Block& block = blocks_[block_index(value)];
+        uint64_t bits = mix(value);
+        for (int i = 0; i < MEMBERSHIP_FILTER_HASHES; i++, bits >>= 9) {
+            block.words[bits >> 6 & 7] |= uint64_t(1) << (bits & 63);
+        }
+    }
+
+    /**
+     * @param word The word to look up.
+     * @return False if the word was certainly not inserted.
+     */
+    bool may_contain(std::string_view word) const {
+        uint64_t value = hash(word);
+        const Block& block = blocks_[block_index(value)];
+        uint64_t bits = mix(value);
+        for (int i = 0; i < MEMBERSHIP_FILTER_HASHES; i++, bits >>= 9) {
+            if (!(block.words[bits >> 6 & 7] & uint64_t(1) << (bits & 63))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @return The size of the filter in bits per inserted word.
+     */
+    double bits_per_key() const {
+        return keys_ ? blocks_.size() * 512.0 / keys_ : 0;
+    }
+
+    /**
+     * @return The memory held by the filter.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + blocks_.size() * sizeof(Block);
+    }
+
+   private:
+    struct alignas(64) Block {
+        uint64_t words[8];
+    };
+
+    static uint64_t hash(std::string_view word) {
+        return std::hash<std::string_view>()(word);
+    }
+
+    // Bits for the positions within a block, independent of the bits that
+    // chose the block.
+    static uint64_t mix(uint64_t value) {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdULL;
+        return value ^ value >> 33;
+    }
+
+    size_t block_index(uint64_t value) const {
+        return (value >> 32) * blocks_.size() >> 32;
+    }
+
+    std::vector<Block> blocks_;
+    size_t keys_;
+};
+
+// Gram Indexes
+//
+// With --grams, each layer built or loaded gets an inverted index from the
+// trigrams of its words, counted in code points with two padding characters
+// at each end, to the words that have them. Suggestions further than
+// MIN_SUGGESTION_DISTANCE edits away come from the words that share enough
+// trigrams with the misspelling instead of from a scan: one edit changes at
+// most three trigrams, so a word d edits away shares all but 3d of them. A
+// transposition of two letters changes the four trigrams that cover either,
+// so under the Damerau metric the bound is 4d.
+// Trigrams are hashed into at most GRAM_INDEX_MAX_BUCKETS posting lists, and
+// each list is stored as varint gaps between ascending word numbers.
+const size_t GRAM_SIZE = 3;
+const size_t GRAM_INDEX_MAX_BUCKETS = size_t(1) << 18;
+
+std::atomic<bool> gram_indexes{false};
+
+/**
+ * An inverted index from the trigrams of a set of words to the numbers of
+ * the words that have them. The numbers are whatever the words are looked
+ * up by in the table, image or trie the index was built over.
+ */
+class GramIndex {
+   public:
+    /**
+     * Build an index.
+     *
+     * @param ids One more than the largest word number.
+     * @param keys The number of words.
+     * @param for_each Called twice with a visitor, which it must call with
+     * the number and text of each word, in the same order both times.
+     * @return The index.
+     */
+    template <typename Source>
+    static std::shared_ptr<const GramIndex> build(size_t ids, size_t keys,
+                                                  Source for_each) {
+        std::shared_ptr<GramIndex> index(new GramIndex());
+        index->ids_ = ids;
+        index->words_ = keys;
+        size_t buckets = 1;
+        while (buckets < std::min(keys, GRAM_INDEX_MAX_BUCKETS)) {
+            buckets *= 2;
+        }
+        index->mask_ = buckets - 1;
+
+        // Count each list, then place every word number in its lists.
+        std::vector<uint32_t> starts(buckets + 1, 0);
+        std::vector<uint32_t> grams;
+        for_each([&](uint32_t, std::string_view word) {
+            index->buckets(word, grams);
+            for (uint32_t bucket : grams) {
+                starts[bucket + 1]++;
+            }
+        });
+        for (size_t i = 0; i < buckets; i++) {
+            starts[i + 1] += starts[i];
+        }
+        std::vector<uint32_t> postings(starts[buckets]);
+        std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+        for_each([&](uint32_t id, std::string_view word) {
+            index->buckets(word, grams);
+            for (uint32_t bucket : grams) {
+                postings[next[bucket]++] = id;
+            }
+        });
+
+        index->offsets_.resize(buckets + 1);
+        for (size_t i = 0; i < buckets; i++) {
+            index->offsets_[i] = index->postings_.size();
+            auto first = postings.begin() + starts[i];
+            auto last = postings.begin() + starts[i + 1];
+            if (!std::is_sorted(first, last)) {
+                std::sort(first, last);
+            }
+            uint32_t previous = 0;
+            for (; first != last; ++first) {
+                index->append_gap(*first - previous);
+                previous = *first;
+            }
+        }
+        index->offsets_[buckets] = index->postings_.size();
+        index->postings_.shrink_to_fit();
+        return index;
+    }
+
+    /**
+     * Find the words that might be within a distance of a word: those that
+     * share all but the trigrams that many edits can change, GRAM_SIZE per
+     * edit, or GRAM_SIZE + 1 when an edit can be a transposition.
+     *
+     * @param word The word.
+     * @param distance The largest distance of interest.
+     * @param metric The distance the words are measured by.
+     * @param found The word numbers to append the candidates to.
+     * @return False if the word has too few trigrams to rule any word out,
+     * in which case nothing is appended.
+     */
+    bool candidates(std::string_view word, int distance, DistanceMetric metric,
+                    std::vector<uint32_t>& found) const {
+        // The counts are kept per thread and only the words a query touched
+        // are cleared after it, so a query costs its posting lists rather
+        // than the size of the layer.
+        thread_local std::vector<uint32_t> grams;
+        thread_local std::vector<uint8_t> counts;
+        thread_local std::vector<uint32_t> touched;
+        buckets(word, grams);
+        size_t per_edit = GRAM_SIZE + (metric == DISTANCE_DAMERAU ? 1 : 0);
+        size_t changed = per_edit * distance;
+        if (grams.size() <= changed ||
+            grams.size() > std::numeric_limits<uint8_t>::max()) {
+            return false;
+        }
+
+        uint8_t threshold = grams.size() - changed;
+        if (counts.size() < ids_) {
+            counts.resize(ids_, 0);
+        }
+        touched.clear();
+        for (uint32_t bucket : grams) {
+            const uint8_t* pos = postings_.data() + offsets_[bucket];
+            const uint8_t* end = postings_.data() + offsets_[bucket + 1];
+            uint32_t id = 0;
+            while (pos < end) {
+                id += read_gap(pos);
+                uint8_t count = ++counts[id];
+                if (count == 1) {
+                    touched.push_back(id);
+                }
+                if (count == threshold) {
+                    found.push_back(id);
+                }
+            }
+        }
+        for (uint32_t id : touched) {
+            counts[id] = 0;
+        }
+        METRIC_COUNT(COUNTER_GRAM_CANDIDATES, found.size());
+        return true;
+    }
+
+    /**
+     * @return The size of the index in bytes per word.
+     */
+    double bytes_per_word() const {
+        return words_ ? double(memory_bytes()) / words_ : 0;
+    }
+
+    /**
+     * @return The memory held by the index.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + offsets_.size() * sizeof(uint32_t) +
+               postings_.capacity();
+    }
+
+   private:
+    GramIndex() = default;
+
+    /**
+     * @param word A word.
+     * @param grams Receives the distinct posting lists of the word's
+     * trigrams.
+     */
+    void buckets(std::string_view word, std::vector<uint32_t>& grams) const {
+        uint32_t window[GRAM_SIZE] = {};
+        size_t pos = 0;
+        size_t padding = GRAM_SIZE - 1;
+        grams.clear();
+        while (pos < word.size() || padding > 0) {
+            uint32_t code_point = 0;
+            if (pos < word.size()) {
+                if (!decode_utf8(word, pos, code_point)) {
+                    continue;
+                }
+            } else {
+                padding--;
+            }
+            window[0] = window[1];
+            window[1] = window[2];
+            window[2] = code_point;
+            grams.push_back(mix_hash(uint64_t(window[0]) << 42 |
+                                     uint64_t(window[1]) << 21 | window[2]) &
+                            mask_);
+        }
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    }
+
+    void append_gap(uint32_t gap) {
+        while (gap >= 0x80) {
+            postings_.push_back(uint8_t(gap | 0x80));
+            gap >>= 7;
+        }
+        postings_.push_back(uint8_t(gap));
+    }
+
+    static uint32_t read_gap(const uint8_t*& pos) {
+        uint32_t gap = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = *pos++;
+            gap |= uint32_t(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return gap;
+            }
+        }
+    }
+
+    size_t ids_ = 0;
+    size_t words_ = 0;
+    uint32_t mask_ = 0;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint8_t> postings_;
+};
+
+// Phonetic Indexes
+//
+// With --phonetic, each layer built or loaded also gets a table from the
+// phonetic key of each of its words, a Metaphone code, to the words with
+// that key. When nothing is within edit distance, words that sound like the
+// misspelling, such as "phonetic" for "fonetik", are ranked the same way as
+// any other suggestion, up to PHONETIC_EDITS_PER_LETTER edits for every code
+// point of the misspelling, rounded up. Keys are found by hash, so no word of
+// the table is read unless it sounds like the misspelling.
+const double PHONETIC_EDITS_PER_LETTER = 2.0 / 3;
+
+std::atomic<bool> phonetic_indexes{false};
+
+/**
+ * Compute the Metaphone key of a word: a code for how the consonants of an
+ * English word sound. Words that sound alike, such as "fonetik" and
+ * "phonetic", usually get the same key. Only ASCII letters are coded.
+ *
+ * @param word The word.
+ * @return The key, empty if the word has no ASCII letters.
+ */
+std::string phonetic_key(std::string_view word) {
+    std::string w;
+    for (char c : word) {
+        if (std::isalpha(static_cast<unsigned char>(c))) {
+            w += std::toupper(static_cast<unsigned char>(c));
+        }
+    }
+    std::string key;
+    if (w.empty()) {
+        return key;
+    }
+
+    auto at = [&](size_t i) { return i < w.size() ? w[i] : '\0'; };
+    auto vowel = [](char c) {
+        return c == 'A' || c == 'E' || c == 'I' || c == 'O' || c == 'U';
+    };
+    auto front = [](char c) { return c == 'E' || c == 'I' || c == 'Y'; };
+
+    // Silent and special first letters.
+    size_t i = 0;
+    if (((w[0] == 'K' || w[0] == 'G' || w[0] == 'P') && at(1) == 'N') ||
+        (w[0] == 'A' && at(1) == 'E') || (w[0] == 'W' && at(1) == 'R')) {
+        i = 1;
+    } else if (w[0] == 'X') {
+        key += 'S';
+        i = 1;
+    } else if (w[0] == 'W' && at(1) == 'H') {
+        key += 'W';
+        i = 2;
+    }
+
+    for (; i < w.size(); i++) {
+        char c = w[i];
+        char previous = i > 0 ? w[i - 1] : '\0';
+        char next = at(i + 1);
+        if (c == previous && c != 'C') {
+            continue;
+        }
+        switch (c) {
+            case 'A':
+            case 'E':
+            case 'I':
+            case 'O':
+            case 'U':
+                if (i == 0) {
+                    key += 'A';
+                }
+                break;
+            case 'B':
+                if (!(previous == 'M' && next == '\0')) {
+                    key += 'B';
+                }
+                break;
+            case 'C':
+                if (next == 'I' && at(i + 2) == 'A') {
+                    key += 'X';
+                } else if (next == 'H') {
+                    key += previous == 'S' ? 'K' : 'X';
+                    i++;
+                } else if (front(next)) {
+                    if (previous != 'S') {
+                        key += 'S';
+                    }
+                } else {
+                    key += 'K';
+                }
+                break;
+            case 'D':
+                if (next == 'G' && front(at(i + 2))) {
+                    key += 'J';
+                    i++;
+                } else {
+                    key += 'T';
+                }
+                break;
+            case 'G':
+                if (next == 'H' && at(i + 2) != '\0' && !vowel(at(i + 2))) {
+                    break;
+                }
+                if (next == 'N' &&
+                    (i + 2 == w.size() ||
+                     (at(i + 2) == 'E' && at(i + 3) == 'D' &&
+                      i + 4 == w.size()))) {
+                    break;
+                }
+                key += front(next) && previous != 'G' ? 'J' : 'K';
+                break;
+            case 'H':
+                if (vowel(next) && previous != 'C' && previous != 'G' &&
+                    previous != 'P' && previous != 'S' && previous != 'T') {
+                    key += 'H';
+                }
+                break;
+            case 'K':
+                if (previous != 'C') {
+                    key += 'K';
+                }
+                break;
+            case 'P':
+                if (next == 'H') {
+                    key += 'F';
+                    i++;
+                } else {
+                    key += 'P';
+                }
+                break;
+            case 'Q':
+                key += 'K';
+                break;
+            case 'S':
+                if (next == 'H') {
+                    key += 'X';
+                    i++;
+                } else if (next == 'I' &&
+                           (at(i + 2) == 'O' || at(i + 2) == 'A')) {
+                    key += 'X';
+                } else {
+                    key += 'S';
+                }
+                break;
+            case 'T':
+                if (next == 'I' && (at(i + 2) == 'O' || at(i + 2) == 'A')) {
+                    key += 'X';
+                } else if (next == 'H') {
+                    key += '0';
+                    i++;
+                } else if (!(next == 'C' && at(i + 2) == 'H')) {
+                    key += 'T';
+                }
+                break;
+            case 'V':
+                key += 'F';
+                break;
+            case 'W':
+            case 'Y':
+                if (vowel(next)) {
+                    key += c;
+                }
+                break;
+            case 'X':
+                key += "KS";
+                break;
+            case 'Z':
+                key += 'S';
+                break;
+            default:
+                key += c;
+                break;
+        }
+    }
+    return key;
+}
+
+/**
+ * A table from the phonetic keys of a set of words to the numbers of the
+ * words with each key, numbered as for GramIndex. Keys are stored as
+ * hashes sorted together with the word numbers.
+ */
+class PhoneticIndex {
+   public:
+    /**
+     * Build an index. Takes the same arguments as GramIndex::build so that
+     * build_layer_index can build either, but unlike a gram index it needs
+     * no table sized by the largest word number, so ids is unused.
+     *
+     * @param ids One more than the largest word number.
+     * @param keys The number of words.
+     * @param for_each Called with a visitor, which it must call with the
+     * number and text of each word.
+     * @return The index.
+     */
+    template <typename Source>
+    static std::shared_ptr<const PhoneticIndex> build(size_t /* ids */,
+                                                      size_t keys,
+                                                      Source for_each) {
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        entries.reserve(keys);
+        for_each([&](uint32_t id, std::string_view word) {
+            std::string key = phonetic_key(word);
+            if (!key.empty()) {
+                entries.emplace_back(hash_word(key), id);
+            }
+        });
+        std::sort(entries.begin(), entries.end());
+
+        std::shared_ptr<PhoneticIndex> index(new PhoneticIndex());
+        index->words_ = keys;
+        index->hashes_.reserve(entries.size());
+        index->ids_.reserve(entries.size());
+        for (const auto& entry : entries) {
+            index->hashes_.push_back(entry.first);
+            index->ids_.push_back(entry.second);
+        }
+        return index;
+    }
+
+    /**
+     * Find the words with a phonetic key.
+     *
+     * @param key The key; empty keys match nothing.
+     * @param found The word numbers to append the words to.
+     */
+    void candidates(const std::string& key,
+                    std::vector<uint32_t>& found) const {
+        if (key.empty()) {
+            return;
+        }
+        auto range =
+            std::equal_range(hashes_.begin(), hashes_.end(), hash_word(key));
+        size_t first = range.first - hashes_.begin();
+        size_t last = range.second - hashes_.begin();
+        found.insert(found.end(), ids_.begin() + first, ids_.begin() + last);
+    }
+
+    /**
+     * @return The size of the index in bytes per word.
+     */
+    double bytes_per_word() const {
+        return words_ ? double(memory_bytes()) / words_ : 0;
+    }
+
+    /**
+     * @return The memory held by the index.
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + hashes_.capacity() * sizeof(uint64_t) +
+               ids_.capacity() * sizeof(uint32_t);
+    }
+
+   private:
+    PhoneticIndex() = default;
+
+    size_t words_ = 0;
+    std::vector<uint64_t> hashes_;
+    std::vector<uint32_t> ids_;
+};
+
+/**
+ * Lookup statistics for a dictionary layer, shared by every snapshot the
+ * layer appears in. Lookups a membership filter answers count as rejections,
+ * and lookups it lets through that the layer then misses as false positives.
+ */
+struct LayerCounters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> filter_rejections{0};
+    std::atomic<uint64_t> filter_false_positives{0};
+};
+
+/**
+ * One layer of the dictionary stack: a mapped compiled image or trie, or a
+ * shared packed table of words and their frequencies, plus a sorted delta of
+ * words added to it since, which have frequency 0. The image, trie and table
+ * are shared by every snapshot the layer appears in, as is the membership
+ * filter over them when there is one. The layer also remembers whether all
+ * of its words are ASCII, which lets suggestions measure them in bytes.
+ */
+struct DictionaryLayer {
+    std::string name;
+    std::shared_ptr<const MappedDictionary> image;
+    std::shared_ptr<const MappedTrie> trie;
+    std::shared_ptr<const PackedWords> words;
+    std::shared_ptr<const MembershipFilter> filter;
+    std::shared_ptr<const GramIndex> grams;
+    std::shared_ptr<const PhoneticIndex> phonetic;
+    std::vector<std::string> delta;
+    bool ascii = true;
+    std::shared_ptr<LayerCounters> counters =
+        std::make_shared<LayerCounters>();
+
+    /**
+     * @param word The word to look up.
+     * @return True if the word is in this layer.
+     */
+    bool contains(std::string_view word) const {
+        if (filter && !filter->may_contain(word)) {
+#if SPELLCHECK_METRICS
+            counters->filter_rejections.fetch_add(1,
+                                                  std::memory_order_relaxed);
+#endif
+        } else if ((image && image->contains(word)) ||
+                   (trie && trie->contains(word)) ||
+                   (words && words->contains(word))) {
+            return true;
+        } else if (filter) {
+#if SPELLCHECK_METRICS
+            counters->filter_false_positives.fetch_add(
+                1, std::memory_order_relaxed);
+#endif
+        }
+        return !delta.empty() &&
+               std::binary_search(delta.begin(), delta.end(), word);
+    }
+
+    /**
+     * @return The number of words in this layer.
+     */
+    size_t size() const {
+        return (image ? image->size() : 0) + (trie ? trie->size() : 0) +
+               (words ? words->size() : 0) + delta.size();
+    }
+
+    /**
+     * @return The number of word numbers this layer uses: one per word of
+     * its image, table or delta, and one per edge of its trie.
+     */
+    size_t numbers() const {
+        return (image ? image->size() : 0) + (trie ? trie->edges() : 0) +
+               (words ? words->size() : 0) + delta.size();
+    }
+
+    /**
+     * Number a word of this layer the way its indexes do, with the delta
+     * numbered after the image, trie or table. The membership filter and
+     * lookup counters are left alone.
+     *
+     * @param word The word to look up.
+     * @return The number of the word, or numbers() if it is not in this
+     * layer.
+     */
+    size_t index_of(std::string_view word) const {
+        size_t base = numbers() - delta.size();
+        size_t index = image  ? image->index_of(word)
+                       : trie ? trie->index_of(word)
+                       : words ? words->index_of(word)
+                               : 0;
+        if (index < base) {
+            return index;
+        }
+        auto found = std::lower_bound(delta.begin(), delta.end(), word);
+        return found != delta.end() && *found == word
+                   ? base + (found - delta.begin())
+                   : numbers();
+    }
+
+    /**
+     * @param index The number of a word of this layer.
+     * @param word Receives the word.
+     */
+    void word_at(size_t index, std::string& word) const {
+        size_t base = numbers() - delta.size();
+        if (index >= base) {
+            word = delta[index - base];
+        } else if (image) {
+            word = image->word(index);
+        } else if (trie) {
+            trie->word_at(index, word);
+        } else {
+            words->decode(index, word);
+        }
+    }
+
+    /**
+     * @return The approximate memory held by this layer, counting a mapped
+     * image or trie at its full size.
+     */
+    size_t memory_bytes() const {
+        size_t bytes = (image ? image->memory_bytes() : 0) +
+                       (trie ? trie->memory_bytes() : 0) +
+                       (words ? words->memory_bytes() : 0) +
+                       (filter ? filter->memory_bytes() : 0) +
+                       (grams ? grams->memory_bytes() : 0) +
+                       (phonetic ? phonetic->memory_bytes() : 0);
+        for (const auto& word : delta) {
+            bytes += sizeof(std::string) + word.capacity() + 1;
+        }
+        return bytes;
+    }
+
+    /**
+     * Find the most frequent words in this layer that start with a prefix.
+     *
+     * @param prefix The prefix.
+     * @param limit The most words to find.
+     * @param found The completions to append to. More than limit words may
+     * be appended, but the best limit words of the layer are among them.
+     */
+    void complete(std::string_view prefix, size_t limit,
+                  std::vector<Completion>& found) const {
+        if (image) {
+            image->complete(prefix, limit, found);
+        }
+        if (trie) {
+            trie->complete(prefix, limit, found);
+        }
+        if (words) {
+            words->complete(prefix, limit, found);
+        }
+        for (auto it = std::lower_bound(delta.begin(), delta.end(), prefix);
+             it != delta.end() && limit > 0 &&
+             std::string_view(*it).substr(0, prefix.size()) == prefix;
+             ++it, limit--) {
+            found.push_back({*it, 0});
+        }
+    }
+
+    /**
+     * Visit the words of this layer that are prefixes of a text.
+     *
+     * @param text The text.
+     * @param visit Called with the length in bytes and the frequency of
+     * each word.
+     */
+    template <typename Visitor>
+    void for_each_prefix(std::string_view text, Visitor visit) const {
+        if (image) {
+            image->for_each_prefix(text, visit);
+        }
+        if (trie) {
+            trie->for_each_prefix(text, visit);
+        }
+        if (words) {
+            words->for_each_prefix(text, visit);
+        }
+        for (size_t length = 1; length <= text.size() && !delta.empty();
+             length++) {
+            if (std::binary_search(delta.begin(), delta.end(),
+                                   text.substr(0, length))) {
+                visit(length, uint8_t(0));
+            }
+        }
+    }
+
+    /**
+     * Visit every word in this layer.
+     *
+     * @param visit Called with each word and its frequency; returning false
+     * stops the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_word(Visitor& visit) const {
+        if (words) {
+            std::string word;
+            for (size_t i = 0; i < words->size(); i++) {
+                words->decode(i, word);
+                if (!visit(std::string_view(word), words->frequency(i))) {
+                    return false;
+                }
+            }
+        }
+        if (trie && !trie->for_each_word(visit)) {
+            return false;
+        }
+        return for_each_unpacked_word(visit);
+    }
+
+    /**
+     * Visit the words of this layer that are not in its packed table or
+     * trie: those of its mapped image and its delta.
+     *
+     * @param visit Called with each word and its frequency; returning false
+     * stops the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_unpacked_word(Visitor& visit) const {
+        if (image) {
+            for (size_t i = 0; i < image->size(); i++) {
+                if (!visit(image->word(i), image->frequency(i))) {
+                    return false;
+                }
+            }
+        }
+        for (const auto& word : delta) {
+            if (!visit(std::string_view(word), uint8_t(0))) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Build a membership filter over the table, image or trie of a layer, if
+ * membership filters are enabled and the layer has any words outside its
+ * delta.
+ *
+ * @param layer The layer to build the filter for.
+ */
+void build_membership_filter(DictionaryLayer& layer) {
+    size_t keys = (layer.image ? layer.image->size() : 0) +
+                  (layer.trie ? layer.trie->size() : 0) +
+                  (layer.words ? layer.words->size() : 0);
+    if (!membership_filters.load() || keys == 0) {
+        layer.filter = nullptr;
+        return;
+    }
+
+    auto filter = std::make_shared<MembershipFilter>(keys);
+    if (layer.image) {
+        for (size_t i = 0; i < layer.image->size(); i++) {
+            filter->insert(layer.image->word(i));
+        }
+    }
+    if (layer.trie) {
+        auto insert = [&](std::string_view word, uint8_t) {
+            filter->insert(word);
+            return true;
+        };
+        layer.trie->for_each_word(insert);
+    }
+    if (layer.words) {
+        std::string word;
+        for (size_t i = 0; i < layer.words->size(); i++) {
+            layer.words->decode(i, word);
+            filter->insert(word);
+        }
+    }
+    layer.filter = std::move(filter);
+}
+
+/**
+ * Build an index over the table, image or trie of a layer. Its words are
+ * numbered by their position in the table or image, or by the trie edge
+ * they end at.
+ *
+ * @param layer The layer to index.
+ * @return The index, empty if the layer has only a delta.
+ */
+template <typename Index>
+std::shared_ptr<const Index> build_layer_index(const DictionaryLayer& layer) {
+    if (layer.image) {
+        const MappedDictionary& image = *layer.image;
+        return Index::build(image.size(), image.size(), [&](auto visit) {
+            for (size_t i = 0; i < image.size(); i++) {
+                visit(i, image.word(i));
+            }
+        });
+    }
+    if (layer.trie) {
+        const MappedTrie& trie = *layer.trie;
+        return Index::build(trie.edges(), trie.size(), [&](auto visit) {
+            trie.for_each_word_end([&](std::string_view word, size_t edge) {
+                visit(edge, word);
+                return true;
+            });
+        });
+    }
+    size_t size = layer.words ? layer.words->size() : 0;
+    return Index::build(size, size, [&](auto visit) {
+        std::string word;
+        for (size_t i = 0; i < size; i++) {
+            layer.words->decode(i, word);
+            visit(i, word);
+        }
+    });
+}
+
+/**
+ * Build the gram and phonetic indexes of a layer that are enabled.
+ *
+ * @param layer The layer to build the indexes for.
+ */
+void build_suggestion_indexes(DictionaryLayer& layer) {
+    layer.grams =
+        gram_indexes.load() ? build_layer_index<GramIndex>(layer) : nullptr;
+    layer.phonetic = phonetic_indexes.load()
+                         ? build_layer_index<PhoneticIndex>(layer)
+                         : nullptr;
+}
+
+/**
+ * Build an in-memory dictionary layer from a table of words.
+ *
+ * @param name The name the layer is reported under.
+ * @param words The words of the layer and their frequencies.
+ * @return The new layer.
+ */
+DictionaryLayer make_dictionary_layer(
+    const std::string& name,
+    const std::unordered_map<std::string, uint8_t>& words) {
+    DictionaryLayer layer;
+    layer.name = name;
+    layer.words = PackedWords::build(words);
+    layer.ascii = layer.words->alphabet().ascii();
+    build_membership_filter(layer);
+    build_suggestion_indexes(layer);
+    return layer;
+}
+
+/**
+ * An immutable version of the dictionary stack. The base is always the
+ * first layer and overlays follow it in the order they were added.
+ */
+struct DictionarySnapshot {
+    std::vector<DictionaryLayer> layers;
+    uint64_t generation = 0;
+
+    /**
+     * Look a word up in each layer in turn, starting from the base since it
+     * holds most of the words.
+     *
+     * @param word The word to look up.
+     * @return True if the word is in the dictionary.
+     */
+    bool contains(std::string_view word) const {
+        for (const auto& layer : layers) {
+            if (layer.contains(word)) {
+#if SPELLCHECK_METRICS
+                layer.counters->hits.fetch_add(1, std::memory_order_relaxed);
+#endif
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Give a word its ID in this snapshot, from the first layer that has it.
+     *
+     * @param word The word to look up.
+     * @return The word's ID, or NO_WORD if it is not in the dictionary.
+     */
+    WordId find_id(std::string_view word) const {
+        size_t base = 0;
+        for (const auto& layer : layers) {
+            size_t index = layer.index_of(word);
+            if (index < layer.numbers()) {
+                return base + index < PHRASE_ID ? WordId(base + index)
+                                                : NO_WORD;
+            }
+            base += layer.numbers();
+        }
+        return NO_WORD;
+    }
+
+    /**
+     * @param id The ID of a word in this snapshot.
+     * @param word Receives the word.
+     */
+    void word_at(WordId id, std::string& word) const {
+        size_t index = id;
+        for (const auto& layer : layers) {
+            if (index < layer.numbers()) {
+                layer.word_at(index, word);
+                return;
+            }
+            index -= layer.numbers();
+        }
+        word.clear();
+    }
+
+    /**
+     * @return The number of words in the dictionary, counting a word once
+     * for every layer it appears in.
+     */
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& layer : layers) {
+            total += layer.size();
+        }
+        return total;
+    }
+
+    /**
+     * @return True if the dictionary has no words.
+     */
+    bool empty() const { return size() == 0; }
+
+    /**
+     * @return True if every word in the dictionary is ASCII.
+     */
+    bool ascii() const {
+        for (const auto& layer : layers) {
+            if (!layer.ascii) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Complete a prefix from every layer. A word in several layers counts
+     * at its highest frequency.
+     *
+     * @param prefix The prefix, already normalized like a dictionary word.
+     * @param limit The most completions to return.
+     * @return The completions, most frequent first and in byte order among
+     * equally frequent words.
+     */
+    std::vector<Completion> complete(std::string_view prefix,
+                                     size_t limit) const {
+        METRIC_TIMER(PHASE_COMPLETE);
+        std::vector<Completion> found;
+        for (const auto& layer : layers) {
+            layer.complete(prefix, limit, found);
+        }
+
+        std::sort(found.begin(), found.end(), completion_before);
+        std::unordered_set<std::string_view> seen;
+        std::vector<Completion> completions;
+        for (const auto& completion : found) {
+            if (completions.size() == limit) {
+                break;
+            }
+            if (seen.insert(completion.word).second) {
+                completions.push_back(completion);
+            }
+        }
+        return completions;
+    }
+
+    /**
+     * Visit every word in the dictionary, layer by layer from the base up.
+     * A word in several layers is visited once per layer.
+     *
+     * @param visit Called with each word as a std::string_view and its
+     * frequency as a uint8_t; returning false stops the visit.
+     * @return False if the visit was stopped early.
+     */
+    template <typename Visitor>
+    bool for_each_word(Visitor visit) const {
+        for (const auto& layer : layers) {
+            if (!layer.for_each_word(visit)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * A reader's announcement of the epoch it entered in. Zero means the thread
+ * is not reading. Slots sit on separate cache lines so readers on different
+ * threads never write to the same line.
+ */
+struct alignas(64) ReaderSlot {
+    std::atomic<bool> claimed{false};
+    std::atomic<uint64_t> epoch{0};
+};
+
+ReaderSlot reader_slots[MAX_READER_THREADS];
+std::atomic<uint64_t> global_epoch{1};
+
+/**
+ * The calling thread's reader slot and how deeply its reads are nested. The
+ * slot is released when the thread exits.
+ */
+struct ReaderState {
+    ReaderSlot* slot = nullptr;
+    unsigned depth = 0;
+
+    ~ReaderState() {
+        if (slot) {
+            slot->claimed.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ReaderState reader_state;
+
+/**
+ * Claim a free reader slot for the calling thread, waiting for one to be
+ * released if every slot is taken.
+ *
+ * @return The claimed slot.
+ */
+ReaderSlot* claim_reader_slot() {
+    while (true) {
+        for (auto& slot : reader_slots) {
+            bool expected = false;
+            if (!slot.claimed.load(std::memory_order_relaxed) &&
+                slot.claimed.compare_exchange_strong(expected, true)) {
+                return &slot;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+/**
+ * A dictionary stack that many threads can read while others add words,
+ * stack overlays or replace the base. Readers go through DictionaryReader
+ * and never block; writers are serialized with each other but never wait for
+ * readers.
+ */
+class SharedDictionary {
+   public:
+    SharedDictionary() {
+        DictionarySnapshot* snapshot = new DictionarySnapshot();
+        snapshot->layers.push_back(make_dictionary_layer("base", {}));
+        current_.store(snapshot);
+    }
+
+    SharedDictionary(const SharedDictionary&) = delete;
+    SharedDictionary& operator=(const SharedDictionary&) = delete;
+
+    /**
+     * Free every snapshot. No reader may still be using the dictionary.
+     */
+    ~SharedDictionary() {
+        delete current_.load();
+        for (const auto& retired : retired_) {
+            delete retired.first;
+        }
+    }
+
+    /**
+     * Replace the base layer, keeping every overlay above it.
+     *
+     * @param base The new base layer.
+     */
+    void replace(DictionaryLayer base) {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        DictionarySnapshot* snapshot =
+            new DictionarySnapshot(*current_.load());
+        snapshot->layers[0] = std::move(base);
+        publish(snapshot);
+    }
+
+    /**
+     * Publish an arbitrary change to the layer stack.
+     *
+     * @param change Called with a copy of the current layers to modify.
+     */
+    template <typename Change>
+    void update(Change change) {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        DictionarySnapshot* snapshot =
+            new DictionarySnapshot(*current_.load());
+        change(snapshot->layers);
+        publish(snapshot);
+    }
+
+    /**
+     * Stack an overlay on top of the dictionary.
+     *
+     * @param overlay The new top layer.
+     */
+    void add_overlay(DictionaryLayer overlay) {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        DictionarySnapshot* snapshot =
+            new DictionarySnapshot(*current_.load());
+        snapshot->layers.push_back(std::move(overlay));
+        publish(snapshot);
+    }
+
+    /**
+     * Add a word to the top overlay, so it survives the base being
+     * replaced. An overlay is created for added words if the stack has none
+     * or its top layer is a read-only image or trie.
+     *
+     * @param word The word to add.
+     * @return True if the word was added, false if it was already present.
+     */
+    bool add_word(const std::string& word) {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        const DictionarySnapshot* current = current_.load();
+        if (current->contains(word)) {
+            return false;
+        }
+
+        // Copying the snapshot copies only the layers' shared pointers and
+        // deltas, never their tables.
+        DictionarySnapshot* snapshot = new DictionarySnapshot(*current);
+        // Only an in-memory table can take a delta: mapped images and tries
+        // have no table to fold it into.
+        if (snapshot->layers.size() == 1 || !snapshot->layers.back().words) {
+            snapshot->layers.push_back(make_dictionary_layer("added", {}));
+        }
+
+        DictionaryLayer& top = snapshot->layers.back();
+        if (top.delta.size() < DICTIONARY_DELTA_LIMIT) {
+            top.delta.insert(
+                std::upper_bound(top.delta.begin(), top.delta.end(), word),
+                word);
+            top.ascii = top.ascii && is_ascii(word);
+        } else {
+            // Fold the delta into a new table. Readers of the old snapshot
+            // keep the old table alive through their shared pointer.
+            std::unordered_map<std::string, uint8_t> words;
+            std::string packed;
+            for (size_t i = 0; i < top.words->size(); i++) {
+                top.words->decode(i, packed);
+                words.emplace(packed, top.words->frequency(i));
+            }
+            for (const auto& added : top.delta) {
+                words.emplace(added, 0);
+            }
+            words.emplace(word, 0);
+            DictionaryLayer folded =
+                make_dictionary_layer(top.name, words);
+            folded.counters = top.counters;
+            top = std::move(folded);
+        }
+
+        publish(snapshot);
+        return true;
+    }
+
+    /**
+     * Free the retired snapshots that no reader can still be using.
+     */
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        reclaim_locked();
+    }
+
+   private:
+    friend class DictionaryReader;
+
+    /**
+     * Make a snapshot the current one and retire the one it replaces. The
+     * writer mutex must be held.
+     *
+     * @param snapshot The snapshot to publish.
+     */
+    void publish(DictionarySnapshot* snapshot) {
+        snapshot->generation = dictionary_generation.fetch_add(1) + 1;
+        const DictionarySnapshot* old = current_.exchange(snapshot);
+        retired_.emplace_back(old, global_epoch.fetch_add(1));
+        reclaim_locked();
+    }
+
+    /**
+     * Free the retired snapshots that no reader can still be using. The
+     * writer mutex must be held.
+     */
+    void reclaim_locked() {
+        uint64_t oldest = std::numeric_limits<uint64_t>::max();
+        for (const auto& slot : reader_slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) {
+                oldest = std::min(oldest, epoch);
+            }
+        }
+
+        size_t kept = 0;
+        for (const auto& retired : retired_) {
+            if (retired.second < oldest) {
+                delete retired.first;
+            } else {
+                retired_[kept++] = retired;
+            }
+        }
+        retired_.resize(kept);
+    }
+
+    std::atomic<const DictionarySnapshot*> current_;
+    std::mutex writer_mutex_;
+    std::vector<std::pair<const DictionarySnapshot*, uint64_t>> retired_;
+};
+
+/**
+ * Pins the current snapshot of a shared dictionary for as long as the reader
+ * is in scope. Creating a reader is a few atomic operations on the calling
+ * thread's own slot and never blocks. Readers may be nested.
+ */
+class DictionaryReader {
+   public:
+    explicit DictionaryReader(const SharedDictionary& dictionary) {
+        if (reader_state.depth++ == 0) {
+            if (!reader_state.slot) {
+                reader_state.slot = claim_reader_slot();
+            }
+            reader_state.slot->epoch.store(global_epoch.load());
+        }
+        snapshot_ = dictionary.current_.load();
+    }
+
+    ~DictionaryReader() {
+        if (--reader_state.depth == 0) {
+            reader_state.slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    DictionaryReader(const DictionaryReader&) = delete;
+    DictionaryReader& operator=(const DictionaryReader&) = delete;
+
+    const DictionarySnapshot& operator*() const { return *snapshot_; }
+    const DictionarySnapshot* operator->() const { return snapshot_; }
+
+   private:
+    const DictionarySnapshot* snapshot_;
+};
+
+// Function Prototypes
+int edit_distance(std::string_view word1, std::string_view word2,
+                  DistanceMetric metric);
+std::unordered_map<std::string, uint8_t> load_dictionary(
+    const std::string& filename);
+std::pmr::vector<std::pmr::string> spell_check(
+    const std::string& text, const DictionarySnapshot& dictionary,
+    std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+std::vector<std::pair<std::string, std::string>> suggest_corrections(
+    const std::vector<std::string>& misspelled,
+    const DictionarySnapshot& dictionary);
+void print_results(
+    const std::vector<std::string>& misspelled,
+    const std::vector<std::pair<std::string, WordId>>& corrections,
+    const DictionarySnapshot& dictionary);
+class DictionaryJournal;
+void add_word_to_dictionary(SharedDictionary& dictionary,
+                            DictionaryJournal* journal);
+std::vector<std::pair<std::string, WordId>> suggest_corrections_cached(
+    const std::vector<std::string>& misspelled,
+    const DictionarySnapshot& dictionary);
+std::string strip_punctuation(std::string_view word);
+void append_json_string(std::string& out, const std::string& value);
+std::string path_to_uri(std::string_view path);
+
+/**
+ * Dynamic-programming edit distance between two sequences of characters,
+ * counting insertions, deletions and substitutions, and under
+ * DISTANCE_DAMERAU also swaps of two adjacent characters. Only three rows of
+ * the table are kept, in buffers reused by the calling thread, so this does
+ * not allocate once warmed up.
+ *
+ * @param word1 The first word, as bytes or code points.
+ * @param word2 The second word, as bytes or code points.
+ * @param metric The distance to compute.
+ * @return The edit distance between the two words.
+ * @see https://en.wikipedia.org/wiki/Levenshtein_distance
+ * @see https://en.wikipedia.org/wiki/Damerau%E2%80%93Levenshtein_distance
+ */
+template <typename Char>
+int edit_distance_table(std::basic_string_view<Char> word1,
+                        std::basic_string_view<Char> word2,
+                        DistanceMetric metric) {
+    thread_local std::vector<int> rows[3];
+    for (auto& row : rows) {
+        row.assign(word2.size() + 1, 0);
+    }
+
+    // The distances from the empty prefix of word1 to each prefix of word2.
+    std::vector<int>* before = &rows[0];
+    std::vector<int>* previous = &rows[1];
+    std::vector<int>* current = &rows[2];
+    for (size_t j = 0; j <= word2.size(); j++) {
+        (*previous)[j] = j;
+    }
+
+    for (size_t i = 1; i <= word1.size(); i++) {
+        (*current)[0] = i;
+        for (size_t j = 1; j <= word2.size(); j++) {
+            int cost = word1[i - 1] == word2[j - 1] ? 0 : 1;
+            int distance =
+                std::min({(*previous)[j] + 1, (*current)[j - 1] + 1,
+                          (*previous)[j - 1] + cost});
+            if (metric == DISTANCE_DAMERAU && i > 1 && j > 1 &&
+                word1[i - 1] == word2[j - 2] && word1[i - 2] == word2[j - 1]) {
+                distance = std::min(distance, (*before)[j - 2] + 1);
+            }
+            (*current)[j] = distance;
+        }
+
+        std::vector<int>* oldest = before;
+        before = previous;
+        previous = current;
+        current = oldest;
+    }
+
+    return (*previous)[word2.size()];
+}
+
+/**
+ * Edit distance between two UTF-8 words, counted in code points. ASCII words
+ * are compared byte by byte; others are decoded first. Used for words too
+ * long for DistancePattern.
+ *
+ * @param word1 The first word.
+ * @param word2 The second word.
+ * @param metric The distance to compute.
+ * @return The edit distance between the two words.
+ */
+int edit_distance(std::string_view word1, std::string_view word2,
+                  DistanceMetric metric) {
+    if (is_ascii(word1) && is_ascii(word2)) {
+        return edit_distance_table(word1, word2, metric);
+    }
+
+    thread_local std::u32string code_points1, code_points2;
+    decode_utf8(word1, code_points1);
+    decode_utf8(word2, code_points2);
+    return edit_distance_table(std::u32string_view(code_points1),
+                               std::u32string_view(code_points2), metric);
+}
+
+/**
+ * The state of the bit-parallel distance algorithm of Myers, as formulated by
+ * Hyyrö, after some prefix of the word being compared against. Bit i of the
+ * vertical deltas tells whether the distance from the first i + 1 characters
+ * of the prepared word goes up (positive) or down (negative) from the row
+ * above; the score tracks the last row. Hyyrö's extension adds adjacent
+ * transpositions for DISTANCE_DAMERAU.
+ *
+ * @see https://doi.org/10.1145/316542.316550
+ */
+struct BitParallelColumns {
+    uint64_t positive = ~uint64_t(0);
+    uint64_t negative = 0;
+    uint64_t diagonal = 0;
+    uint64_t previous_matches = 0;
+    int score;
+
+    /**
+     * @param length The length of the prepared word, at most 64.
+     */
+    explicit BitParallelColumns(size_t length) : score(length) {}
+
+    /**
+     * Advance by one character of the word being compared against.
+     *
+     * @param matches The positions of the character in the prepared word.
+     * @param last The bit of the prepared word's last character.
+     * @param metric The distance to compute.
+     */
+    void advance(uint64_t matches, uint64_t last, DistanceMetric metric) {
+        uint64_t transposed = 0;
+        if (metric == DISTANCE_DAMERAU) {
+            transposed = ((~diagonal & matches) << 1) & previous_matches;
+        }
+        diagonal = (((matches & positive) + positive) ^ positive) | matches |
+                   negative | transposed;
+
+        uint64_t horizontal_positive = negative | ~(diagonal | positive);
+        uint64_t horizontal_negative = positive & diagonal;
+        if (horizontal_positive & last) {
+            score++;
+        } else if (horizontal_negative & last) {
+            score--;
+        }
+
+        horizontal_positive = (horizontal_positive << 1) | 1;
+        horizontal_negative <<= 1;
+        positive = horizontal_negative | ~(diagonal | horizontal_positive);
+        negative = horizontal_positive & diagonal;
+        previous_matches = matches;
+    }
+};
+
+/**
+ * A misspelled word prepared for computing its distance to many dictionary
+ * words in UTF-8. Words of up to 64 code points use BitParallelColumns, so
+ * nothing is allocated per comparison, and a comparison stops as soon as it
+ * cannot finish within its bound. ASCII characters find their match masks
+ * in a table; the few other code points a word has are looked up in a short
+ * list. Longer words fall back to edit_distance.
+ */
+class DistancePattern {
+   public:
+    /**
+     * Prepare a word for comparison.
+     *
+     * @param word The word, in UTF-8; must outlive the pattern.
+     * @param metric The distance to compute.
+     */
+    DistancePattern(std::string_view word, DistanceMetric metric)
+        : word_(word), metric_(metric) {
+        size_t pos = 0;
+        while (pos < word_.size()) {
+            uint32_t code_point;
+            if (!decode_utf8(word_, pos, code_point)) {
+                continue;
+            }
+            if (length_ < 64) {
+                mask_slot(code_point) |= uint64_t(1) << length_;
+            }
+            length_++;
+        }
+    }
+
+    /**
+     * @return The length of the prepared word in code points.
+     */
+    size_t length() const { return length_; }
+
+    /**
+     * Compute the distance from the prepared word to another word.
+     *
+     * @param other The word to compare against, in UTF-8.
+     * @param bound The largest distance of interest.
+     * @return The distance, or some value greater than bound if the distance
+     * is greater than bound.
+     */
+    int distance(std::string_view other, int bound) const {
+        METRIC_COUNT(COUNTER_DISTANCE_EVALUATIONS, 1);
+        if (length_ == 0) {
+            return utf8_length(other);
+        }
+        if (length_ > 64) {
+            return edit_distance(word_, other, metric_);
+        }
+
+        BitParallelColumns columns(length_);
+        const uint64_t last = uint64_t(1) << (length_ - 1);
+        size_t pos = 0;
+
+        // ASCII characters index the mask table directly; the first other
+        // byte hands the rest of the word over to the decoding loop below.
+        for (; pos < other.size(); pos++) {
+            unsigned char byte = other[pos];
+            if (byte >= 0x80) {
+                break;
+            }
+            columns.advance(ascii_masks_[byte], last, metric_);
+
+            // Each remaining character can lower the score by at most one,
+            // and no more characters than bytes remain.
+            if (columns.score - int(other.size() - pos - 1) > bound) {
+                return bound + 1;
+            }
+        }
+
+        return pos < other.size()
+                   ? decoded_distance(other, pos, columns, last, bound)
+                   : columns.score;
+    }
+
+   private:
+    /**
+     * Finish a distance computation by decoding the rest of the other word,
+     * once it turns out not to be ASCII.
+     *
+     * @param other The word being compared against.
+     * @param pos Where the computation stopped.
+     * @param columns The state of the computation.
+     * @param last The bit of the prepared word's last character.
+     * @param bound The largest distance of interest.
+     * @return The distance, or some value greater than bound.
+     */
+    int decoded_distance(std::string_view other, size_t pos,
+                         BitParallelColumns columns, uint64_t last,
+                         int bound) const;
+
+    /**
+     * @param code_point A code point.
+     * @return The positions of the code point in the prepared word.
+     */
+    uint64_t mask(uint32_t code_point) const {
+        if (code_point < 0x80) {
+            return ascii_masks_[code_point];
+        }
+        for (size_t i = 0; i < wide_count_; i++) {
+            if (wide_code_points_[i] == code_point) {
+                return wide_masks_[i];
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @param code_point A code point of the prepared word.
+     * @return The mask to record its positions in, added if it is new.
+     */
+    uint64_t& mask_slot(uint32_t code_point) {
+        if (code_point < 0x80) {
+            return ascii_masks_[code_point];
+        }
+        for (size_t i = 0; i < wide_count_; i++) {
+            if (wide_code_points_[i] == code_point) {
+                return wide_masks_[i];
+            }
+        }
+        wide_code_points_[wide_count_] = code_point;
+        return wide_masks_[wide_count_++];
+    }
+
+    std::string_view word_;
+    DistanceMetric metric_;
+    size_t length_ = 0;
+    uint64_t ascii_masks_[0x80] = {};
+    uint32_t wide_code_points_[64] = {};
+    uint64_t wide_masks_[64] = {};
+    size_t wide_count_ = 0;
+};
+
+int DistancePattern::decoded_distance(std::string_view other, size_t pos,
+                                      BitParallelColumns columns,
+                                      uint64_t last, int bound) const {
+    while (pos < other.size()) {
+        uint32_t code_point;
+        if (!decode_utf8(other, pos, code_point)) {
+            continue;
+        }
+        columns.advance(mask(code_point), last, metric_);
+        if (columns.score - int(other.size() - pos) > bound) {
+            return bound + 1;
+        }
+    }
+    return columns.score;
+}
+
+/**
+ * A misspelled word prepared for computing its distance to the words of one
+ * packed table. The word is encoded over the table's alphabet once, so each
+ * comparison reads symbols straight from the packed array and finds their
+ * match masks in a table of KERNEL_ALPHABET_SIZE entries. Code points the
+ * table does not use become symbol 0, which no table word contains. Words
+ * longer than 64 code points and tables with larger alphabets fall back to
+ * a DistancePattern over the decoded words.
+ */
+class SymbolPattern {
+   public:
+    /**
+     * Prepare a word for comparison.
+     *
+     * @param word The word, in UTF-8; must outlive the pattern.
+     * @param words The table to compare against; must outlive the pattern.
+     * @param metric The distance to compute.
+     */
+    SymbolPattern(std::string_view word, const PackedWords& words,
+                  DistanceMetric metric)
+        : words_(words), metric_(metric), fallback_(word, metric) {
+        std::vector<uint16_t> symbols;
+        words.alphabet().encode(word, symbols);
+        length_ = symbols.size();
+        packed_ = length_ <= 64 &&
+                  words.alphabet().size() <= KERNEL_ALPHABET_SIZE;
+        if (packed_) {
+            for (size_t i = 0; i < length_; i++) {
+                masks_[symbols[i]] |= uint64_t(1) << i;
+            }
+        }
+    }
+
+    /**
+     * @return The length of the prepared word in code points.
+     */
+    size_t length() const { return length_; }
+
+    /**
+     * Compute the distance from the prepared word to a word of the table.
+     *
+     * @param index The index of the table word.
+     * @param bound The largest distance of interest.
+     * @return The distance, or some value greater than bound if the distance
+     * is greater than bound.
+     */
+    int distance(size_t index, int bound) const {
+        if (!packed_) {
+            thread_local std::string other;
+            words_.decode(index, other);
+            return fallback_.distance(other, bound);
+        }
+
+        METRIC_COUNT(COUNTER_DISTANCE_EVALUATIONS, 1);
+        size_t other_length = words_.length(index);
+        if (length_ == 0) {
+            return other_length;
+        }
+
+        BitParallelColumns columns(length_);
+        const uint64_t last = uint64_t(1) << (length_ - 1);
+        size_t first = words_.offset(index);
+        for (size_t i = 0; i < other_length; i++) {
+            columns.advance(masks_[words_.symbol(first + i)], last, metric_);
+
+            // Each remaining character can lower the score by at most one.
+            if (columns.score - int(other_length - i - 1) > bound) {
+                return bound + 1;
+            }
+        }
+        return columns.score;
+    }
+
+   private:
+    const PackedWords& words_;
+    DistanceMetric metric_;
+    DistancePattern fallback_;
+    size_t length_ = 0;
+    bool packed_ = false;
+    uint64_t masks_[KERNEL_ALPHABET_SIZE] = {};
+};
+
+/**
+ * Substitution costs between every pair of code points below U+0100, in the
+ * units of KEYBOARD_EDIT_COST.
+ */
+struct KeyboardCostTable {
+    uint8_t costs[256][256];
+};
+
+/**
+ * Build the substitution cost table from the QWERTY layout. Each row of keys
+ * sits half a key to the right of the row above, so a key touches its two
+ * neighbours in its own row, the keys above it and above-right of it, and the
+ * keys below it and below-left of it. Letters cost the same in either case.
+ *
+ * @return The cost table.
+ */
+constexpr KeyboardCostTable make_keyboard_costs() {
+    const char* rows[] = {"1234567890-=", "qwertyuiop[]", "asdfghjkl;'",
+                          "zxcvbnm,./"};
+    int row_of[256] = {};
+    int column_of[256] = {};
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; rows[row][column] != '\0'; column++) {
+            unsigned char key = rows[row][column];
+            row_of[key] = row + 1;
+            column_of[key] = column;
+            if (key >= 'a' && key <= 'z') {
+                row_of[key - 'a' + 'A'] = row + 1;
+                column_of[key - 'a' + 'A'] = column;
+            }
+        }
+    }
+
+    KeyboardCostTable table = {};
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            int row_a = row_of[a], row_b = row_of[b];
+            int offset = column_of[b] - column_of[a];
+            bool adjacent =
+                row_a != 0 && row_b != 0 &&
+                ((row_b == row_a && (offset == 1 || offset == -1)) ||
+                 (row_b == row_a - 1 && (offset == 0 || offset == 1)) ||
+                 (row_b == row_a + 1 && (offset == 0 || offset == -1)));
+            bool same = a == b || (row_a != 0 && row_a == row_b && offset == 0);
+            table.costs[a][b] = same       ? 0
+                                : adjacent ? KEYBOARD_ADJACENT_COST
+                                           : KEYBOARD_EDIT_COST;
+        }
+    }
+    return table;
+}
+
+constexpr KeyboardCostTable KEYBOARD_COSTS = make_keyboard_costs();
+
+/**
+ * The cost of substituting one code point for another. Code points beyond
+ * the table are never keyboard neighbours.
+ *
+ * @param from The code point replaced.
+ * @param to The code point replacing it.
+ * @return The cost, in the units of KEYBOARD_EDIT_COST.
+ */
+inline int substitution_cost(uint32_t from, uint32_t to) {
+    if (from < 0x100 && to < 0x100) {
+        return KEYBOARD_COSTS.costs[from][to];
+    }
+    return from == to ? 0 : KEYBOARD_EDIT_COST;
+}
+
+/**
+ * Weighted edit distance between two words using the keyboard substitution
+ * costs, with one instantiation per distance metric so the transposition
+ * check is compiled out of the Levenshtein kernel. Like edit_distance_table,
+ * it keeps three rows of the table in buffers reused by the calling thread.
+ *
+ * @param word1 The first word, as bytes or code points.
+ * @param word2 The second word, as bytes or code points.
+ * @return The weighted distance, in the units of KEYBOARD_EDIT_COST.
+ */
+template <DistanceMetric metric, typename Char>
+int keyboard_distance(std::basic_string_view<Char> word1,
+                      std::basic_string_view<Char> word2) {
+    using Unit = std::make_unsigned_t<Char>;
+    thread_local std::vector<int> rows[3];
+    for (auto& row : rows) {
+        row.assign(word2.size() + 1, 0);
+    }
+
+    std::vector<int>* before = &rows[0];
+    std::vector<int>* previous = &rows[1];
+    std::vector<int>* current = &rows[2];
+    for (size_t j = 0; j <= word2.size(); j++) {
+        (*previous)[j] = j * KEYBOARD_EDIT_COST;
+    }
+
+    for (size_t i = 1; i <= word1.size(); i++) {
+        Unit from = word1[i - 1];
+        (*current)[0] = i * KEYBOARD_EDIT_COST;
+        for (size_t j = 1; j <= word2.size(); j++) {
+            int distance = std::min(
+                {(*previous)[j] + KEYBOARD_EDIT_COST,
+                 (*current)[j - 1] + KEYBOARD_EDIT_COST,
+                 (*previous)[j - 1] +
+                     substitution_cost(from, Unit(word2[j - 1]))});
+            if (metric == DISTANCE_DAMERAU && i > 1 && j > 1 &&
+                word1[i - 1] == word2[j - 2] && word1[i - 2] == word2[j - 1]) {
+                distance = std::min(distance,
+                                    (*before)[j - 2] + KEYBOARD_ADJACENT_COST);
+            }
+            (*current)[j] = distance;
+        }
+
+        std::vector<int>* oldest = before;
+        before = previous;
+        previous = current;
+        current = oldest;
+    }
+
+    return (*previous)[word2.size()];
+}
+
+/**
+ * Weighted edit distance between two UTF-8 words using the keyboard
+ * substitution costs. ASCII words are compared byte by byte; others are
+ * decoded first.
+ *
+ * @param word1 The first word.
+ * @param word2 The second word.
+ * @param metric The distance metric the weights apply to.
+ * @return The weighted distance, in the units of KEYBOARD_EDIT_COST.
+ */
+int keyboard_distance(std::string_view word1, std::string_view word2,
+                      DistanceMetric metric) {
+    if (is_ascii(word1) && is_ascii(word2)) {
+        return metric == DISTANCE_DAMERAU
+                   ? keyboard_distance<DISTANCE_DAMERAU>(word1, word2)
+                   : keyboard_distance<DISTANCE_LEVENSHTEIN>(word1, word2);
+    }
+
+    thread_local std::u32string code_points1, code_points2;
+    decode_utf8(word1, code_points1);
+    decode_utf8(word2, code_points2);
+    std::u32string_view view1(code_points1), view2(code_points2);
+    return metric == DISTANCE_DAMERAU
+               ? keyboard_distance<DISTANCE_DAMERAU>(view1, view2)
+               : keyboard_distance<DISTANCE_LEVENSHTEIN>(view1, view2);
+}
+
+/**
+ * Read a little-endian 32-bit unsigned integer from a binary stream.
+ *
+ * @param in The stream to read from.
+ * @param value Receives the decoded value.
+ * @return True if four bytes were available.
+ */
+bool read_u32(std::istream& in, uint32_t& value) {
+    unsigned char bytes[4];
+    if (!in.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) {
+        return false;
+    }
+    value = uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 |
+            uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+    return true;
+}
+
+/**
+ * Write a 32-bit unsigned integer to a binary stream in little-endian order.
+ *
+ * @param out The stream to write to.
+ * @param value The value to encode.
+ */
+void write_u32(std::ostream& out, uint32_t value) {
+    const unsigned char bytes[4] = {
+        static_cast<unsigned char>(value),
+        static_cast<unsigned char>(value >> 8),
+        static_cast<unsigned char>(value >> 16),
+        static_cast<unsigned char>(value >> 24)};
+    out.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+/**
+ * Load the body of a compiled dictionary into a hash table. The stream must
+ * be positioned just after the magic. A perfect hash index after the words
+ * is not needed and is left unread.
+ *
+ * @param file The stream containing the compiled dictionary.
+ * @param has_frequencies False for a version 1 image, which has no frequency
+ * table.
+ * @param dictionary The hash table to fill.
+ * @return True if the image was well formed.
+ */
+bool load_compiled_dictionary(
+    std::istream& file, bool has_frequencies,
+    std::unordered_map<std::string, uint8_t>& dictionary) {
+    uint32_t word_count = 0;
+    uint32_t blob_size = 0;
+    if (!read_u32(file, word_count) || !read_u32(file, blob_size)) {
+        return false;
+    }
+
+    std::vector<uint32_t> offsets(size_t(word_count) + 1);
+    for (auto& offset : offsets) {
+        if (!read_u32(file, offset)) {
+            return false;
+        }
+    }
+
+    std::string frequencies(has_frequencies ? word_count : 0, '\0');
+    std::string blob(blob_size, '\0');
+    if (!file.read(&frequencies[0], frequencies.size()) ||
+        !file.read(&blob[0], blob_size)) {
+        return false;
+    }
+
+    dictionary.reserve(word_count);
+    for (uint32_t i = 0; i < word_count; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > blob_size) {
+            return false;
+        }
+        uint8_t frequency =
+            has_frequencies ? static_cast<uint8_t>(frequencies[i]) : 0;
+        dictionary.emplace(blob.substr(offsets[i], offsets[i + 1] - offsets[i]),
+                           frequency);
+    }
+
+    return true;
+}
+
+/**
+ * A minimal perfect hash over a list of distinct words, laid out as in an
+ * indexed compiled dictionary.
+ */
+struct PerfectHashIndex {
+    // First key, first bucket, first remap entry and seed of each partition,
+    // followed by a terminating entry.
+    std::vector<uint32_t> partitions;
+    std::vector<uint16_t> pilots;
+    std::vector<uint32_t> remap;
+    // The word at each position.
+    std::vector<uint32_t> order;
+};
+
+/**
+ * Build one partition of a perfect hash index, retrying with new seeds
+ * until every bucket finds a pilot.
+ *
+ * @param hashes The hashes of every word.
+ * @param keys The words of the partition, as indices into hashes.
+ * @param pilots Receives a pilot for each bucket of the partition.
+ * @param buckets The number of buckets in the partition.
+ * @param remap Receives the remap entries of the partition.
+ * @param remaps The number of remap entries in the partition.
+ * @param order Receives the word at each position of the partition.
+ * @param seed Receives the seed that worked.
+ * @return False if no seed worked.
+ */
+bool build_perfect_hash_partition(const std::vector<uint64_t>& hashes,
+                                  const std::vector<uint32_t>& keys,
+                                  uint16_t* pilots, size_t buckets,
+                                  uint32_t* remap, size_t remaps,
+                                  uint32_t* order, uint32_t& seed) {
+    size_t count = keys.size();
+    uint32_t size = count + remaps;
+    std::vector<uint64_t> partition_keys(count);
+    std::vector<uint32_t> bucket_starts(buckets + 1);
+    std::vector<uint32_t> members(count);
+    std::vector<uint32_t> by_size(buckets);
+    std::vector<uint32_t> positions(count);
+    std::vector<uint8_t> taken(size);
+    std::vector<uint32_t> trial;
+
+    for (seed = 0; seed < PERFECT_HASH_MAX_SEEDS; seed++) {
+        // Group the words by bucket.
+        std::fill(bucket_starts.begin(), bucket_starts.end(), 0);
+        for (size_t i = 0; i < count; i++) {
+            partition_keys[i] = perfect_hash_key(hashes[keys[i]], seed);
+            bucket_starts[perfect_hash_bucket(partition_keys[i], buckets) +
+                          1]++;
+        }
+        for (size_t b = 0; b < buckets; b++) {
+            bucket_starts[b + 1] += bucket_starts[b];
+        }
+        std::vector<uint32_t> next(bucket_starts.begin(),
+                                   bucket_starts.end() - 1);
+        for (size_t i = 0; i < count; i++) {
+            members[next[perfect_hash_bucket(partition_keys[i], buckets)]++] =
+                i;
+        }
+
+        // Place the largest buckets first, while the table is emptiest.
+        for (size_t b = 0; b < buckets; b++) {
+            by_size[b] = b;
+        }
+        std::stable_sort(by_size.begin(), by_size.end(),
+                         [&](uint32_t left, uint32_t right) {
+                             return bucket_starts[left + 1] -
+                                        bucket_starts[left] >
+                                    bucket_starts[right + 1] -
+                                        bucket_starts[right];
+                         });
+
+        std::fill(taken.begin(), taken.end(), 0);
+        std::fill(pilots, pilots + buckets, 0);
+        bool placed = true;
+        for (uint32_t bucket : by_size) {
+            uint32_t first = bucket_starts[bucket];
+            uint32_t last = bucket_starts[bucket + 1];
+            if (first == last) {
+                break;
+            }
+
+            placed = false;
+            for (uint32_t pilot = 0; pilot <= 0xffff && !placed; pilot++) {
+                trial.clear();
+                for (uint32_t i = first; i < last; i++) {
+                    uint32_t position = perfect_hash_position(
+                        partition_keys[members[i]], pilot, size);
+                    if (taken[position] ||
+                        std::find(trial.begin(), trial.end(), position) !=
+                            trial.end()) {
+                        break;
+                    }
+                    trial.push_back(position);
+                }
+                if (trial.size() == last - first) {
+                    for (uint32_t i = first; i < last; i++) {
+                        taken[trial[i - first]] = 1;
+                        positions[members[i]] = trial[i - first];
+                    }
+                    pilots[bucket] = pilot;
+                    placed = true;
+                }
+            }
+            if (!placed) {
+                break;
+            }
+        }
+        if (!placed) {
+            continue;
+        }
+
+        // Move the words past the end of the partition into its holes.
+        uint32_t hole = 0;
+        for (uint32_t position = count; position < size; position++) {
+            remap[position - count] = 0;
+            if (taken[position]) {
+                while (taken[hole]) {
+                    hole++;
+                }
+                remap[position - count] = hole++;
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t position = positions[i];
+            if (position >= count) {
+                position = remap[position - count];
+            }
+            order[position] = keys[i];
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Build a minimal perfect hash over a list of distinct words, building the
+ * partitions on every core.
+ *
+ * @param words The words to index.
+ * @param index Receives the index.
+ * @return False if some partition could not be built.
+ */
+bool build_perfect_hash(const std::vector<std::string_view>& words,
+                        PerfectHashIndex& index) {
+    size_t partition_count = std::max<size_t>(
+        1, (words.size() + PERFECT_HASH_PARTITION_KEYS - 1) /
+               PERFECT_HASH_PARTITION_KEYS);
+    std::vector<uint64_t> hashes(words.size());
+    std::vector<std::vector<uint32_t>> partition_keys(partition_count);
+    for (size_t i = 0; i < words.size(); i++) {
+        hashes[i] = hash_word(words[i]);
+        partition_keys[(hashes[i] >> 32) * partition_count >> 32].push_back(i);
+    }
+
+    // Lay out every partition's share of the arrays up front, so the
+    // partitions can be built independently.
+    index.partitions.assign(4 * (partition_count + 1), 0);
+    size_t keys = 0, buckets = 0, remaps = 0;
+    for (size_t p = 0; p <= partition_count; p++) {
+        index.partitions[4 * p] = keys;
+        index.partitions[4 * p + 1] = buckets;
+        index.partitions[4 * p + 2] = remaps;
+        if (p == partition_count || partition_keys[p].empty()) {
+            continue;
+        }
+        size_t count = partition_keys[p].size();
+        double bits = std::max(1.0, std::log2(double(count)));
+        keys += count;
+        buckets += size_t(std::ceil(PERFECT_HASH_BUCKET_FACTOR * count / bits));
+        remaps += size_t(std::ceil(count / PERFECT_HASH_LOAD_FACTOR)) - count;
+    }
+    index.pilots.assign(buckets, 0);
+    index.remap.assign(remaps, 0);
+    index.order.assign(keys, 0);
+
+    std::atomic<size_t> next_partition{0};
+    std::atomic<bool> failed{false};
+    auto build = [&] {
+        for (size_t p = next_partition++; p < partition_count;
+             p = next_partition++) {
+            const uint32_t* entry = &index.partitions[4 * p];
+            uint32_t seed = 0;
+            if (!partition_keys[p].empty() &&
+                !build_perfect_hash_partition(
+                    hashes, partition_keys[p], &index.pilots[entry[1]],
+                    entry[5] - entry[1], &index.remap[entry[2]],
+                    entry[6] - entry[2], &index.order[entry[0]], seed)) {
+                failed = true;
+            }
+            index.partitions[4 * p + 3] = seed;
+        }
+    };
+
+    size_t thread_count = std::min<size_t>(
+        partition_count, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(build);
+    }
+    build();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed;
+}
+
+/**
+ * Write sorted or perfect hash ordered words in the compiled image format.
+ *
+ * @param out The stream to write to.
+ * @param entries The words and their frequencies, in the order to write.
+ * @param index The perfect hash the words are ordered by, or null.
+ */
+void write_compiled_words(
+    std::ostream& out,
+    const std::vector<std::pair<std::string, uint8_t>>& entries,
+    const PerfectHashIndex* index) {
+    uint32_t blob_size = 0;
+    for (const auto& entry : entries) {
+        blob_size += entry.first.size();
+    }
+
+    out.write(index ? COMPILED_DICTIONARY_MAGIC_INDEXED
+                    : COMPILED_DICTIONARY_MAGIC,
+              COMPILED_DICTIONARY_MAGIC_SIZE);
+    write_u32(out, entries.size());
+    write_u32(out, blob_size);
+
+    uint32_t offset = 0;
+    for (const auto& entry : entries) {
+        write_u32(out, offset);
+        offset += entry.first.size();
+    }
+    write_u32(out, offset);
+
+    for (const auto& entry : entries) {
+        out.put(static_cast<char>(entry.second));
+    }
+    for (const auto& entry : entries) {
+        out.write(entry.first.data(), entry.first.size());
+    }
+
+    if (index) {
+        write_u32(out, index->partitions.size() / 4 - 1);
+        write_u32(out, index->pilots.size());
+        write_u32(out, index->remap.size());
+        for (uint32_t value : index->partitions) {
+            write_u32(out, value);
+        }
+        for (uint16_t pilot : index->pilots) {
+            out.put(static_cast<char>(pilot));
+            out.put(static_cast<char>(pilot >> 8));
+        }
+        for (uint32_t value : index->remap) {
+            write_u32(out, value);
+        }
+        for (const auto& entry : entries) {
+            out.put(static_cast<char>(hash_word(entry.first)));
+        }
+    }
+}
+
+/**
+ * Write words in the compiled trie format. The trie is built one level at a
+ * time: every node is a range of sorted words sharing the path to it, and
+ * splits into one edge per distinct next byte.
+ *
+ * @param out The stream to write to.
+ * @param entries The words and their frequencies, sorted and distinct.
+ */
+void write_compiled_trie(
+    std::ostream& out,
+    const std::vector<std::pair<std::string, uint8_t>>& entries) {
+    std::string labels;
+    std::string frequencies;
+    std::vector<uint64_t> children, nodes, ends;
+    auto set = [](std::vector<uint64_t>& bits, size_t index) {
+        if (bits.size() <= index / 64) {
+            bits.resize(index / 64 + 1);
+        }
+        bits[index / 64] |= uint64_t(1) << (index % 64);
+    };
+
+    // The ranges of words below each node of the current level. Every word
+    // in a range is longer than the path to the node.
+    std::vector<std::pair<size_t, size_t>> level, next;
+    size_t first_word = !entries.empty() && entries[0].first.empty();
+    if (first_word < entries.size()) {
+        level.emplace_back(first_word, entries.size());
+    }
+    for (size_t depth = 0; !level.empty(); depth++) {
+        next.clear();
+        for (const auto& range : level) {
+            set(nodes, labels.size());
+            for (size_t i = range.first; i < range.second;) {
+                char label = entries[i].first[depth];
+                size_t end = i + 1;
+                while (end < range.second &&
+                       entries[end].first[depth] == label) {
+                    end++;
+                }
+
+                // The sorted order puts a word ending here first.
+                size_t edge = labels.size();
+                labels += label;
+                bool word_ends = entries[i].first.size() == depth + 1;
+                if (word_ends) {
+                    set(ends, edge);
+                    frequencies += static_cast<char>(entries[i].second);
+                }
+                if (end - i > size_t(word_ends)) {
+                    set(children, edge);
+                    next.emplace_back(i + word_ends, end);
+                }
+                i = end;
+            }
+        }
+        std::swap(level, next);
+    }
+
+    out.write(COMPILED_TRIE_MAGIC, COMPILED_DICTIONARY_MAGIC_SIZE);
+    write_u32(out, frequencies.size());
+    write_u32(out, labels.size());
+    out.write(labels.data(), labels.size());
+    out.write("\0\0\0\0\0\0\0", (8 - labels.size() % 8) % 8);
+    for (std::vector<uint64_t>* bits : {&children, &nodes, &ends}) {
+        bits->resize((labels.size() + 63) / 64);
+        for (uint64_t word : *bits) {
+            for (int i = 0; i < 8; i++) {
+                out.put(static_cast<char>(word >> (8 * i)));
+            }
+        }
+    }
+    out.write(frequencies.data(), frequencies.size());
+}
+
+/**
+ * Write a dictionary to disk in the compiled format so later runs can load it
+ * without tokenizing a text file. Words are written in sorted order, in the
+ * order of a perfect hash index, or as a trie, so the output is
+ * reproducible. The image is written beside the target and renamed over it,
+ * so a process that has the old file mapped keeps a valid image.
+ *
+ * @param dictionary The dictionary snapshot to write.
+ * @param filename The name of the file to write.
+ * @param format The layout to write.
+ * @return True if the file was written successfully.
+ */
+bool save_compiled_dictionary(const DictionarySnapshot& dictionary,
+                              const std::string& filename,
+                              CompiledFormat format) {
+    // Sort by word and, within a word found in several layers, by falling
+    // frequency, so the most frequent copy is the one kept.
+    std::vector<std::pair<std::string, uint8_t>> entries;
+    entries.reserve(dictionary.size());
+    dictionary.for_each_word([&](std::string_view word, uint8_t frequency) {
+        entries.emplace_back(word, frequency);
+        return true;
+    });
+    std::sort(entries.begin(), entries.end(),
+              [](const auto& left, const auto& right) {
+                  return left.first != right.first ? left.first < right.first
+                                                   : left.second > right.second;
+              });
+    entries.erase(std::unique(entries.begin(), entries.end(),
+                              [](const auto& left, const auto& right) {
+                                  return left.first == right.first;
+                              }),
+                  entries.end());
+
+    PerfectHashIndex index;
+    if (format == COMPILED_PERFECT_HASH) {
+        std::vector<std::string_view> words;
+        words.reserve(entries.size());
+        for (const auto& entry : entries) {
+            words.push_back(entry.first);
+        }
+        if (!build_perfect_hash(words, index)) {
+            std::cerr << "Error: could not build a perfect hash for "
+                      << filename << std::endl;
+            return false;
+        }
+
+        std::vector<std::pair<std::string, uint8_t>> ordered;
+        ordered.reserve(entries.size());
+        for (uint32_t word : index.order) {
+            ordered.push_back(std::move(entries[word]));
+        }
+        entries = std::move(ordered);
+    }
+
+    std::string temporary = filename + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out) {
+        std::cerr << "Error: could not open " << temporary << std::endl;
+        return false;
+    }
+
+    if (format == COMPILED_TRIE) {
+        write_compiled_trie(out, entries);
+    } else {
+        write_compiled_words(out, entries,
+                             format == COMPILED_PERFECT_HASH ? &index
+                                                             : nullptr);
+    }
+
+    out.close();
+    if (!out || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Error: could not write " << filename << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Quantize a corpus count to a frequency byte.
+ *
+ * @param count The number of times the word was seen.
+ * @return The count on a log scale, saturating at 255.
+ */
+uint8_t quantize_frequency(uint64_t count) {
+    double steps = std::log2(double(count) + 1) * FREQUENCY_STEPS_PER_DOUBLING;
+    return static_cast<uint8_t>(std::min(255.0, std::round(steps)));
+}
+
+/**
+ * Load a dictionary of words from a file into a hash table. The file may be
+ * either a plain text word list or a dictionary produced by `compile-dict`.
+ * A line of a word list holding a tab gives a single word and its corpus
+ * count as `word<TAB>count`; any other line is a list of words with
+ * frequency 0. Words from a list are normalized the way text is before
+ * lookup, so capitals and decomposed accents in the list still match.
+ *
+ * @param filename The name of the file containing the dictionary.
+ * @return A hash table mapping the words from the dictionary to their
+ * frequencies.
+ */
+std::unordered_map<std::string, uint8_t> load_dictionary(
+    const std::string& filename) {
+    METRIC_TIMER(PHASE_LOAD);
+    std::unordered_map<std::string, uint8_t> dictionary(100);
+    std::ifstream file;
+
+    file.open(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: could not open " << filename << std::endl;
+        return dictionary;
+    }
+
+    // Compiled dictionaries are recognized by their magic and skip the text
+    // parser entirely.
+    char magic[COMPILED_DICTIONARY_MAGIC_SIZE] = {};
+    file.read(magic, COMPILED_DICTIONARY_MAGIC_SIZE);
+    bool has_frequencies =
+        std::memcmp(magic, COMPILED_DICTIONARY_MAGIC,
+                    COMPILED_DICTIONARY_MAGIC_SIZE) == 0 ||
+        std::memcmp(magic, COMPILED_DICTIONARY_MAGIC_INDEXED,
+                    COMPILED_DICTIONARY_MAGIC_SIZE) == 0;
+    if (file.gcount() == COMPILED_DICTIONARY_MAGIC_SIZE &&
+        (has_frequencies ||
+         std::memcmp(magic, COMPILED_DICTIONARY_MAGIC_V1,
+                     COMPILED_DICTIONARY_MAGIC_SIZE) == 0)) {
+        if (!load_compiled_dictionary(file, has_frequencies, dictionary)) {
+            std::cerr << "Error: " << filename
+                      << " is not a valid compiled dictionary" << std::endl;
+            dictionary.clear();
+        }
+        METRIC_COUNT(COUNTER_WORDS_LOADED, dictionary.size());
+        return dictionary;
+    }
+    if (file.gcount() == COMPILED_DICTIONARY_MAGIC_SIZE &&
+        std::memcmp(magic, COMPILED_TRIE_MAGIC,
+                    COMPILED_DICTIONARY_MAGIC_SIZE) == 0) {
+        std::shared_ptr<const MappedTrie> trie = MappedTrie::open(filename);
+        if (!trie) {
+            std::cerr << "Error: " << filename
+                      << " is not a valid compiled trie" << std::endl;
+            return dictionary;
+        }
+        dictionary.reserve(trie->size());
+        auto insert = [&](std::string_view word, uint8_t frequency) {
+            dictionary.emplace(word, frequency);
+            return true;
+        };
+        trie->for_each_word(insert);
+        METRIC_COUNT(COUNTER_WORDS_LOADED, dictionary.size());
+        return dictionary;
+    }
+    file.clear();
+    file.seekg(0);
+
+    std::string line;
+    std::string word;
+    while (std::getline(file, line)) {
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos) {
+            normalize_word(std::string_view(line).substr(0, tab), word);
+            if (!word.empty()) {
+                uint8_t frequency = quantize_frequency(
+                    std::strtoull(line.c_str() + tab + 1, nullptr, 10));
+                uint8_t& stored = dictionary[word];
+                stored = std::max(stored, frequency);
+            }
+            continue;
+        }
+
+        size_t pos = 0;
+        while (pos < line.size()) {
+            while (pos < line.size() &&
+                   std::isspace(static_cast<unsigned char>(line[pos]))) {
+                pos++;
+            }
+            size_t start = pos;
+            while (pos < line.size() &&
+                   !std::isspace(static_cast<unsigned char>(line[pos]))) {
+                pos++;
+            }
+            normalize_word(
+                std::string_view(line).substr(start, pos - start), word);
+            if (!word.empty()) {
+                dictionary.emplace(word, 0);
+            }
+        }
+    }
+
+    file.close();
+    METRIC_COUNT(COUNTER_WORDS_LOADED, dictionary.size());
+
+    return dictionary;
+}
+
+/**
+ * Load a dictionary file as a layer of the dictionary stack. Compiled
+ * dictionaries are mapped rather than read, so their words stay in the page
+ * cache instead of being copied onto the heap; word lists are loaded into a
+ * hash table as before.
+ *
+ * @param filename The name of the file containing the dictionary.
+ * @param layer Receives the layer, named after the file.
+ * @return True if the layer holds at least one word.
+ */
+bool load_dictionary_layer(const std::string& filename,
+                           DictionaryLayer& layer) {
+    std::shared_ptr<const MappedDictionary> image =
+        MappedDictionary::open(filename);
+    std::shared_ptr<const MappedTrie> trie =
+        image ? nullptr : MappedTrie::open(filename);
+    if (!image && !trie) {
+        layer = make_dictionary_layer(filename, load_dictionary(filename));
+        return layer.size() > 0;
+    }
+
+    layer = DictionaryLayer();
+    layer.name = filename;
+    layer.ascii = image ? image->ascii() : trie->ascii();
+    layer.image = std::move(image);
+    layer.trie = std::move(trie);
+    build_membership_filter(layer);
+    build_suggestion_indexes(layer);
+    METRIC_COUNT(COUNTER_WORDS_LOADED, layer.size());
+    return layer.size() > 0;
+}
+
+// Word Journal
+//
+// Words added to a dictionary are appended to a journal file beside it, one
+// word per line, and replayed into an overlay whenever the dictionary is
+// loaded. Only complete lines are replayed, so a write torn by a crash loses
+// at most the word being written. A background thread periodically compacts
+// the journal into a compiled base image and empties it.
+const char JOURNAL_SUFFIX[] = ".journal";
+
+// Compact once this many words are waiting in the journal.
+const size_t JOURNAL_COMPACT_THRESHOLD = 256;
+
+// Compact a journal holding fewer words after this long.
+const int JOURNAL_COMPACT_INTERVAL_MS = 60 * 1000;
+
+/**
+ * @param dictionary_filename The name of a dictionary file.
+ * @return The name of the journal of words added to that dictionary.
+ */
+std::string journal_filename(const std::string& dictionary_filename) {
+    return dictionary_filename + JOURNAL_SUFFIX;
+}
+
+/**
+ * Replay the journal of a dictionary into an overlay layer. Words are
+ * normalized again, so journals written before words were normalized on
+ * the way in still match.
+ *
+ * @param dictionary_filename The name of the dictionary file.
+ * @return The journal's layer, empty if there is no journal yet.
+ */
+DictionaryLayer load_journal_layer(const std::string& dictionary_filename) {
+    std::string filename = journal_filename(dictionary_filename);
+    std::ifstream file(filename, std::ios::binary);
+    std::unordered_map<std::string, uint8_t> words;
+    std::string line;
+    std::string word;
+
+    while (std::getline(file, line)) {
+        // A final line without a newline is a torn write.
+        if (file.eof()) {
+            break;
+        }
+        normalize_word(line, word);
+        if (!word.empty()) {
+            words.emplace(word, 0);
+        }
+    }
+    METRIC_COUNT(COUNTER_WORDS_LOADED, words.size());
+
+    return make_dictionary_layer(filename, words);
+}
+
+/**
+ * The journal of words added to a dictionary loaded from a file. Adding a
+ * word through the journal publishes it to the journal's overlay, which must
+ * be the top layer of the dictionary, and appends it to the journal file.
+ */
+class DictionaryJournal {
+   public:
+    /**
+     * @param dictionary The dictionary words are added to; must outlive the
+     * journal.
+     * @param dictionary_filename The file the dictionary's base was loaded
+     * from.
+     */
+    DictionaryJournal(SharedDictionary& dictionary,
+                      const std::string& dictionary_filename)
+        : dictionary_(dictionary),
+          dictionary_filename_(dictionary_filename),
+          filename_(journal_filename(dictionary_filename)) {}
+
+    DictionaryJournal(const DictionaryJournal&) = delete;
+    DictionaryJournal& operator=(const DictionaryJournal&) = delete;
+
+    ~DictionaryJournal() {
+        stop();
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    /**
+     * Open the journal file for appending, creating it if needed and
+     * cutting off a torn final line so the next word starts a fresh line.
+     *
+     * @return True if the journal could be opened.
+     */
+    bool open() {
+        fd_ = ::open(filename_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0644);
+        if (fd_ < 0) {
+            std::cerr << "Error: could not open " << filename_ << ": "
+                      << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        std::ifstream file(filename_, std::ios::binary);
+        std::string line;
+        off_t complete = 0;
+        while (std::getline(file, line) && !file.eof()) {
+            complete += line.size() + 1;
+            pending_++;
+        }
+        if (ftruncate(fd_, complete) < 0) {
+            std::cerr << "Error: could not repair " << filename_ << ": "
+                      << std::strerror(errno) << std::endl;
+        }
+        return true;
+    }
+
+    /**
+     * Add a word to the dictionary and record it in the journal.
+     *
+     * @param word The word to add.
+     * @return True if the word was added, false if it was already present.
+     */
+    bool add_word(const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (word.find('\n') != std::string::npos ||
+            !dictionary_.add_word(word)) {
+            return false;
+        }
+
+        std::string line = word + "\n";
+        if (write(fd_, line.data(), line.size()) !=
+                static_cast<ssize_t>(line.size()) ||
+            fdatasync(fd_) < 0) {
+            std::cerr << "Error: could not record " << word << " in "
+                      << filename_ << "; it will be lost on exit."
+                      << std::endl;
+        }
+
+        if (++pending_ >= JOURNAL_COMPACT_THRESHOLD) {
+            wake_.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * Start compacting the journal on a background thread.
+     */
+    void start() { thread_ = std::thread(&DictionaryJournal::run, this); }
+
+    /**
+     * Stop the background thread, waiting for a compaction in progress.
+     */
+    void stop() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            thread_.join();
+        }
+    }
+
+    /**
+     * Merge the journaled words into the compiled base image and empty the
+     * journal. The new image is renamed over the old one before the journal
+     * is truncated, so a crash in between only leaves words that are
+     * replayed twice. Only compiled bases are compacted; a text base keeps
+     * its journal. The base is rewritten in the layout it had.
+     *
+     * @return True if the journal was compacted.
+     */
+    bool compact() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto start = std::chrono::steady_clock::now();
+
+        DictionarySnapshot merged;
+        {
+            DictionaryReader snapshot(dictionary_);
+            size_t journal = find_layer(snapshot->layers);
+            if (journal == snapshot->layers.size() ||
+                snapshot->layers[journal].size() == 0 ||
+                !(snapshot->layers[0].image || snapshot->layers[0].trie)) {
+                return false;
+            }
+            merged.layers = {snapshot->layers[0], snapshot->layers[journal]};
+        }
+
+        size_t count = merged.layers[1].size();
+        DictionaryLayer base;
+        const DictionaryLayer& compiled = merged.layers[0];
+        CompiledFormat format =
+            compiled.trie                ? COMPILED_TRIE
+            : compiled.image->indexed() ? COMPILED_PERFECT_HASH
+                                        : COMPILED_SORTED;
+        if (!save_compiled_dictionary(merged, dictionary_filename_, format) ||
+            !load_dictionary_layer(dictionary_filename_, base)) {
+            std::cerr << "Compaction of " << filename_ << " failed."
+                      << std::endl;
+            return false;
+        }
+        if (ftruncate(fd_, 0) < 0) {
+            std::cerr << "Error: could not truncate " << filename_ << ": "
+                      << std::strerror(errno) << std::endl;
+        }
+
+        dictionary_.update([&](std::vector<DictionaryLayer>& layers) {
+            base.counters = layers[0].counters;
+            layers[0] = std::move(base);
+            size_t journal = find_layer(layers);
+            if (journal < layers.size()) {
+                DictionaryLayer empty = make_dictionary_layer(filename_, {});
+                empty.counters = layers[journal].counters;
+                layers[journal] = std::move(empty);
+            }
+        });
+        pending_ = 0;
+
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::cerr << "Compacted " << count << " journaled words into "
+                  << dictionary_filename_ << " in " << elapsed << " ms"
+                  << std::endl;
+        return true;
+    }
+
+   private:
+    /**
+     * Compact whenever enough words are waiting, or on a timer while any
+     * are.
+     */
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            wake_.wait_for(
+                lock, std::chrono::milliseconds(JOURNAL_COMPACT_INTERVAL_MS),
+                [&] {
+                    return stopping_ || pending_ >= JOURNAL_COMPACT_THRESHOLD;
+                });
+            if (!stopping_ && pending_ > 0) {
+                lock.unlock();
+                compact();
+                lock.lock();
+            }
+        }
+    }
+
+    /**
+     * Find the journal's overlay in a layer stack.
+     *
+     * @param layers The layers to search.
+     * @return The index of the journal's layer, or the number of layers if
+     * the stack has none.
+     */
+    size_t find_layer(const std::vector<DictionaryLayer>& layers) const {
+        size_t index = 0;
+        while (index < layers.size() && layers[index].name != filename_) {
+            index++;
+        }
+        return index;
+    }
+
+    SharedDictionary& dictionary_;
+    std::string dictionary_filename_;
+    std::string filename_;
+    int fd_ = -1;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread thread_;
+};
+
+/**
+ * Add a word entered by the user to the dictionary. The word is
+ * published as a new dictionary snapshot, so threads that are reading the
+ * dictionary are never blocked or disturbed, and recorded in the journal so
+ * it is still there the next time the dictionary is loaded.
+ *
+ * @param dictionary The shared dictionary to add the word to.
+ * @param journal The dictionary's journal, or null to add the word for this
+ * session only.
+ */
+void add_word_to_dictionary(SharedDictionary& dictionary,
+                            DictionaryJournal* journal) {
+    std::string new_word;
+
+    std::cout << "Enter the word to add to the dictionary: ";
+    std::getline(std::cin, new_word);
+
+    // Store the word as text is looked up: case folded, in NFC, and without
+    // punctuation.
+    new_word = normalize_word(new_word);
+    if (new_word.empty()) {
+        std::cout << "That is not a word." << std::endl;
+        return;
+    }
+
+    bool added =
+        journal ? journal->add_word(new_word) : dictionary.add_word(new_word);
+    if (added) {
+        std::cout << "Word added successfully." << std::endl;
+    } else {
+        std::cout << "Word already exists in the dictionary." << std::endl;
+    }
+}
+
+/**
+ * Take a string of text as input and check each word in the text against the
+ * words in the dictionary snapshot. Identify any words that
+ * are not found in the dictionary and display them as "mispelled".
+ *
+ * @param text The string of text to check.
+ * @param dictionary The dictionary snapshot to check against.
+ * @param memory Where to allocate the result, such as a request arena.
+ * @return A vector of misspelled words.
+ */
+std::pmr::vector<std::pmr::string> spell_check(
+    const std::string& text, const DictionarySnapshot& dictionary,
+    std::pmr::memory_resource* memory) {
+    METRIC_TIMER(PHASE_LOOKUP);
+    std::pmr::vector<std::pmr::string> misspelled(memory);
+    size_t lookups = 0;
+    size_t i = 0;
+
+    while (i < text.size()) {
+        if (std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < text.size() &&
+               !std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+        }
+
+        std::string_view word(text.data() + start, i - start);
+        lookups++;
+        if (!dictionary.contains(word)) {
+            misspelled.emplace_back(word);
+        }
+    }
+
+    METRIC_COUNT(COUNTER_TOKENS, lookups);
+    METRIC_COUNT(COUNTER_LOOKUPS, lookups);
+    METRIC_COUNT(COUNTER_LOOKUP_MISSES, misspelled.size());
+    return misspelled;
+}
+
+/**
+ * Split a misspelling into dictionary words, choosing the cheapest split
+ * with one pass over the word that extends every split found so far by the
+ * dictionary words starting where it ends. See "Word Segmentation" above.
+ *
+ * @param word The misspelled word.
+ * @param dictionary The dictionary to split it into.
+ * @return The words separated by spaces, or an empty string if the word
+ * does not split into at least two words.
+ */
+std::string segment_word(const std::string& word,
+                         const DictionarySnapshot& dictionary) {
+    if (utf8_length(word) < SEGMENT_MIN_LENGTH) {
+        return "";
+    }
+
+    // The cheapest split of the first i bytes and where its last word
+    // starts.
+    const int unreachable = std::numeric_limits<int>::max();
+    std::vector<int> costs(word.size() + 1, unreachable);
+    std::vector<size_t> starts(word.size() + 1, 0);
+    costs[0] = 0;
+    std::string_view text(word);
+    for (size_t start = 0; start < word.size(); start++) {
+        if (costs[start] == unreachable) {
+            continue;
+        }
+        auto extend = [&](size_t length, uint8_t frequency) {
+            size_t end = start + length;
+            int cost = costs[start] + SEGMENT_WORD_COST - frequency;
+            if (cost < costs[end] &&
+                utf8_length(text.substr(start, length)) >=
+                    SEGMENT_MIN_PIECE) {
+                costs[end] = cost;
+                starts[end] = start;
+            }
+        };
+        for (const auto& layer : dictionary.layers) {
+            layer.for_each_prefix(text.substr(start), extend);
+        }
+    }
+    if (costs[word.size()] == unreachable || starts[word.size()] == 0) {
+        return "";
+    }
+
+    std::vector<std::string_view> pieces;
+    for (size_t end = word.size(); end > 0; end = starts[end]) {
+        pieces.push_back(text.substr(starts[end], end - starts[end]));
+    }
+    std::string split;
+    for (auto it = pieces.rbegin(); it != pieces.rend(); ++it) {
+        if (!split.empty()) {
+            split += ' ';
+        }
+        split += *it;
+    }
+    return split;
+}
+
+/**
+ * @param length The length of a misspelled word in code points.
+ * @return The largest edit distance a suggestion for it may be at.
+ */
+int max_suggestion_distance(size_t length) {
+    return std::clamp(int(length / SUGGESTION_LETTERS_PER_EDIT),
+                      MIN_SUGGESTION_DISTANCE, MAX_SUGGESTION_DISTANCE);
+}
+
+/**
+ * Find the best correction for a misspelled word: the closest dictionary
+ * word within an edit distance of 2 under the selected distance metric,
+ * unless segment_word splits the word with fewer spaces than that word has
+ * edits, and failing both, a word further away for long words as
+ * max_suggestion_distance allows.
+ * Words the same number of edits away are reranked by keyboard_distance, so
+ * slips onto neighbouring keys win; the weighted distance is only computed
+ * for words the unit-cost bound has already admitted. After that the most
+ * frequent word wins, and among equally frequent ones the alphabetically
+ * first, so the result never depends on hash order. The search stops early
+ * at a word 1 edit away whose weighted distance is as low as one edit can be
+ * and whose frequency is at least EARLY_STOP_FREQUENCY.
+ *
+ * Packed tables are searched by length, nearest lengths first, comparing
+ * symbols without decoding. ASCII tries are searched depth first with a row
+ * of the distance table per depth, skipping every subtree whose row is
+ * already past the bound. Mapped images and deltas are scanned in full.
+ * Only if nothing is within 2 edits and the word does not split is a long
+ * word searched again further out, through the gram index of each layer
+ * that has one. Only if nothing is
+ * within that either are the words with the same phonetic key ranked, from
+ * the phonetic indexes of the layers that have them.
+ *
+ * @param word The misspelled word.
+ * @param dictionary The dictionary to search.
+ * @return The best correction, or an empty string if there is none.
+ */
+std::string best_suggestion(const std::string& word,
+                            const DictionarySnapshot& dictionary) {
+    std::string best_match;
+    DistanceMetric metric = distance_metric.load();
+    int best_distance = MIN_SUGGESTION_DISTANCE;
+    int best_cost = std::numeric_limits<int>::max();
+    uint8_t best_frequency = 0;
+
+    // Rank a word the unit-cost bound has admitted. Returns false to stop
+    // the search.
+    auto consider = [&](std::string_view entry, uint8_t frequency,
+                        int distance) {
+        int cost = keyboard_distance(word, entry, metric);
+        if (distance == best_distance &&
+            (cost > best_cost ||
+             (cost == best_cost &&
+              (frequency < best_frequency ||
+               (frequency == best_frequency && entry >= best_match))))) {
+            return true;
+        }
+
+        best_match = entry;
+        best_distance = distance;
+        best_cost = cost;
+        best_frequency = frequency;
+        return distance > 1 || cost > KEYBOARD_ADJACENT_COST ||
+               frequency < EARLY_STOP_FREQUENCY;
+    };
+
+    DistancePattern pattern(word, metric);
+    bool ascii = dictionary.ascii();
+    auto visit = [&](std::string_view entry, uint8_t frequency) {
+        // Words whose lengths differ by more than the best distance so far
+        // cannot be any closer. A word has at most as many code points as
+        // bytes, so they only need counting when the bytes alone say the
+        // word is too long and the dictionary is not all ASCII.
+        size_t length = entry.size();
+        if (!ascii && length > pattern.length() + best_distance) {
+            length = utf8_length(entry);
+        }
+        if (length > pattern.length() + best_distance ||
+            length + best_distance < pattern.length()) {
+            return true;
+        }
+
+        int distance = pattern.distance(entry, best_distance);
+        return distance > best_distance ||
+               consider(entry, frequency, distance);
+    };
+
+    // Row i of the table at depth d is the distance from the first i bytes
+    // of the word to the first d bytes of the trie path.
+    size_t columns = word.size() + 1;
+    std::vector<int> rows(columns);
+    auto step = [&](std::string_view path, const uint8_t* frequency) {
+        size_t depth = path.size();
+        if (rows.size() < (depth + 1) * columns) {
+            rows.resize((depth + 1) * columns);
+        }
+        int* row = &rows[depth * columns];
+        const int* above = row - columns;
+        char label = path[depth - 1];
+
+        row[0] = depth;
+        int lowest = row[0];
+        for (size_t i = 1; i < columns; i++) {
+            row[i] = std::min({above[i] + 1, row[i - 1] + 1,
+                               above[i - 1] + (word[i - 1] != label)});
+            if (metric == DISTANCE_DAMERAU && depth > 1 && i > 1 &&
+                word[i - 1] == path[depth - 2] && word[i - 2] == label) {
+                row[i] = std::min(row[i], above[i - 2 - columns] + 1);
+            }
+            lowest = std::min(lowest, row[i]);
+        }
+
+        int distance = row[columns - 1];
+        if (frequency && distance <= best_distance &&
+            !consider(path, *frequency, distance)) {
+            return WALK_STOP;
+        }
+        return lowest <= best_distance ? WALK_DESCEND : WALK_SKIP;
+    };
+    auto search_trie = [&](const MappedTrie& trie) {
+        if (!trie.ascii() || !is_ascii(word)) {
+            return trie.for_each_word(visit);
+        }
+        for (size_t i = 0; i < columns; i++) {
+            rows[i] = i;
+        }
+        return trie.walk("", step);
+    };
+
+    auto search_layer = [&](const DictionaryLayer& layer) {
+        if (layer.words) {
+            const PackedWords& words = *layer.words;
+            SymbolPattern symbols(word, words, metric);
+            std::string entry;
+            bool more = words.for_each_near(
+                symbols.length(), best_distance, [&](size_t index) {
+                    int distance = symbols.distance(index, best_distance);
+                    if (distance > best_distance) {
+                        return true;
+                    }
+                    words.decode(index, entry);
+                    return consider(entry, words.frequency(index), distance);
+                });
+            if (!more) {
+                return false;
+            }
+        }
+        if (layer.trie && !search_trie(*layer.trie)) {
+            return false;
+        }
+        return layer.for_each_unpacked_word(visit);
+    };
+
+    // Verify the words a gram or phonetic index found against the word.
+    // Neither index covers the layer's delta.
+    std::vector<uint32_t> candidates;
+    auto search_candidates = [&](const DictionaryLayer& layer) {
+        std::string entry;
+        if (layer.words) {
+            const PackedWords& words = *layer.words;
+            SymbolPattern symbols(word, words, metric);
+            for (uint32_t index : candidates) {
+                size_t length = words.length(index);
+                if (length > symbols.length() + best_distance ||
+                    length + best_distance < symbols.length()) {
+                    continue;
+                }
+                int distance = symbols.distance(index, best_distance);
+                if (distance > best_distance) {
+                    continue;
+                }
+                words.decode(index, entry);
+                if (!consider(entry, words.frequency(index), distance)) {
+                    return false;
+                }
+            }
+        }
+        for (uint32_t id : candidates) {
+            if (layer.image &&
+                !visit(layer.image->word(id), layer.image->frequency(id))) {
+                return false;
+            }
+            if (layer.trie) {
+                uint8_t frequency = layer.trie->word_at(id, entry);
+                if (!visit(std::string_view(entry), frequency)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    auto search_delta = [&](const DictionaryLayer& layer) {
+        for (const auto& added : layer.delta) {
+            if (!visit(std::string_view(added), uint8_t(0))) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (const auto& layer : dictionary.layers) {
+        if (!search_layer(layer)) {
+            return best_match;
+        }
+    }
+
+    // Each space of a split counts as an edit, so a split only beats a near
+    // word that is further away.
+    std::string split = segment_word(word, dictionary);
+    if (!split.empty() &&
+        (best_match.empty() ||
+         std::count(split.begin(), split.end(), ' ') < best_distance)) {
+        METRIC_COUNT(COUNTER_SEGMENTATIONS, 1);
+        return split;
+    }
+
+    int limit = max_suggestion_distance(pattern.length());
+    if (best_match.empty() && limit > best_distance) {
+        best_distance = limit;
+        for (const auto& layer : dictionary.layers) {
+            candidates.clear();
+            bool indexed = layer.grams &&
+                           layer.grams->candidates(word, limit, metric,
+                                                   candidates);
+            if (!(indexed ? search_candidates(layer) && search_delta(layer)
+                          : search_layer(layer))) {
+                return best_match;
+            }
+        }
+    }
+
+    // Nothing is within edit distance; try the words that sound alike.
+    if (best_match.empty()) {
+        std::string key = phonetic_key(word);
+        best_distance = std::max(
+            limit,
+            int(std::ceil(pattern.length() * PHONETIC_EDITS_PER_LETTER)));
+        for (const auto& layer : dictionary.layers) {
+            if (!layer.phonetic || key.empty()) {
+                continue;
+            }
+            candidates.clear();
+            layer.phonetic->candidates(key, candidates);
+            bool more = search_candidates(layer);
+            for (size_t i = 0; more && i < layer.delta.size(); i++) {
+                const std::string& added = layer.delta[i];
+                more = phonetic_key(added) != key ||
+                       visit(std::string_view(added), uint8_t(0));
+            }
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    return best_match;
+}
+
+/**
+ * ----------------------------------------------------------------------------
+ * DEPRECATED: Replaced by suggest_corrections_cached.
+ * ----------------------------------------------------------------------------
+ *
+ * Based off of a vector of mispelled words and a dictionary stored in a
+ * hash table, suggest a correction for each misspelled word using the
+ * selected edit distance. Only include words that are likely
+ * to be mispelled and have a distance that is related to the size
+ * of the word.
+ *
+ * @param misspelled A vector of misspelled words.
+ * @param dictionary The dictionary snapshot to suggest from.
+ * @return A vector of pairs, where each pair contains a misspelled word and
+ *         its suggested correction.
+ */
+std::vector<std::pair<std::string, std::string>> suggest_corrections(
+    const std::vector<std::string>& misspelled,
+    const DictionarySnapshot& dictionary) {
+    std::vector<std::pair<std::string, std::string>> corrections;
+
+    for (const auto& word : misspelled) {
+        METRIC_TIMER(PHASE_SUGGEST);
+        std::string best_match = best_suggestion(word, dictionary);
+
+        if (!best_match.empty()) {
+            METRIC_COUNT(COUNTER_SUGGESTIONS, 1);
+            corrections.push_back({word, best_match});
+        }
+    }
+
+    return corrections;
+}
+
+/**
+ * Get the calling thread's suggestion cache, dropping its entries first if
+ * the cache has been purged since the thread last used it or was filled from
+ * a different version of the dictionary.
+ *
+ * @param dictionary The dictionary snapshot suggestions will come from.
+ * @return The calling thread's cache.
+ */
+SuggestionCache& suggestion_cache(const DictionarySnapshot& dictionary) {
+    uint64_t generation = cache_generation.load(std::memory_order_acquire);
+    if (cache.generation != generation ||
+        cache.dictionary_generation != dictionary.generation) {
+        cache.entries.clear();
+        cache.phrases.clear();
+        cache.generation = generation;
+        cache.dictionary_generation = dictionary.generation;
+    }
+    return cache;
+}
+
+/**
+ * Purge the suggestion caches of every thread.
+ */
+void purge_cache() { cache_generation.fetch_add(1); }
+
+/**
+ * Select the edit distance used to rank suggestions.
+ *
+ * @param metric The distance metric to use from now on.
+ */
+void set_distance_metric(DistanceMetric metric) {
+    if (distance_metric.exchange(metric) != metric) {
+        purge_cache();
+    }
+}
+
+/**
+ * Turn a suggestion into an ID, adding a phrase to the cache's phrase list
+ * when the suggestion is several words.
+ *
+ * @param suggestion The suggestion, one word or words separated by spaces.
+ * @param dictionary The dictionary snapshot the suggestion came from.
+ * @param entries The calling thread's cache.
+ * @return The suggestion's ID, or NO_WORD if a word of it is not in the
+ * dictionary.
+ */
+WordId suggestion_id(std::string_view suggestion,
+                     const DictionarySnapshot& dictionary,
+                     SuggestionCache& entries) {
+    if (suggestion.find(' ') == std::string_view::npos) {
+        return dictionary.find_id(suggestion);
+    }
+
+    std::vector<WordId> phrase;
+    for (size_t start = 0; start <= suggestion.size();) {
+        size_t end = std::min(suggestion.find(' ', start), suggestion.size());
+        phrase.push_back(
+            dictionary.find_id(suggestion.substr(start, end - start)));
+        if (phrase.back() == NO_WORD) {
+            return NO_WORD;
+        }
+        start = end + 1;
+    }
+    entries.phrases.push_back(std::move(phrase));
+    return PHRASE_ID | WordId(entries.phrases.size() - 1);
+}
+
+/**
+ * Suggest a correction for one misspelled word through the calling thread's
+ * suggestion cache, without building the vectors suggest_corrections_cached
+ * takes and returns.
+ *
+ * @param word The misspelled word, already stripped of punctuation.
+ * @param dictionary The dictionary snapshot to suggest from.
+ * @return The ID of the suggested correction, or NO_WORD if there is none.
+ * The ID stays valid until the calling thread next suggests from another
+ * snapshot or after a purge; pass it to suggestion_text for the text. Words
+ * without a suggestion are cached as NO_WORD, so they are searched once.
+ */
+WordId cached_suggestion(std::string_view word,
+                         const DictionarySnapshot& dictionary) {
+    SuggestionCache& entries = suggestion_cache(dictionary);
+    // The key is copied into a buffer the thread reuses, so a cache hit
+    // does not allocate.
+    thread_local std::string key;
+    key.assign(word);
+
+    // Check if the word is already in the cache.
+    auto cached = entries.entries.find(key);
+    if (cached != entries.entries.end()) {
+        METRIC_COUNT(COUNTER_CACHE_HITS, 1);
+        return cached->second;
+    }
+    METRIC_COUNT(COUNTER_CACHE_MISSES, 1);
+    METRIC_TIMER(PHASE_SUGGEST);
+
+    // If the word is not in the cache, find the best match in the dictionary
+    // and add it to the cache.
+    std::string best_match = best_suggestion(key, dictionary);
+    WordId id = best_match.empty()
+                    ? NO_WORD
+                    : suggestion_id(best_match, dictionary, entries);
+    if (id != NO_WORD) {
+        METRIC_COUNT(COUNTER_SUGGESTIONS, 1);
+    }
+    entries.entries.emplace(key, id);
+    return id;
+}
+
+/**
+ * Write out the text of a suggestion.
+ *
+ * @param id A suggestion ID the calling thread got from cached_suggestion,
+ * or NO_WORD.
+ * @param dictionary The dictionary snapshot the suggestion came from.
+ * @param text Receives the suggestion, with the words of a phrase separated
+ * by spaces, or an empty string for NO_WORD.
+ */
+void suggestion_text(WordId id, const DictionarySnapshot& dictionary,
+                     std::string& text) {
+    text.clear();
+    if (id == NO_WORD) {
+        return;
+    }
+    if (!(id & PHRASE_ID)) {
+        dictionary.word_at(id, text);
+        return;
+    }
+
+    std::string word;
+    for (WordId word_id : cache.phrases[id & ~PHRASE_ID]) {
+        dictionary.word_at(word_id, word);
+        if (!text.empty()) {
+            text += ' ';
+        }
+        text += word;
+    }
+}
+
+std::vector<std::pair<std::string, WordId>> suggest_corrections_cached(
+    const std::vector<std::string>& misspelled,
+    const DictionarySnapshot& dictionary) {
+    std::vector<std::pair<std::string, WordId>> corrections;
+
+    for (const auto& word : misspelled) {
+        WordId id = cached_suggestion(word, dictionary);
+        if (id != NO_WORD) {
+            corrections.push_back({word, id});
+        }
+    }
+
+    return corrections;
+}
+
+/**
+ * Print the results of the spell check, including the misspelled words and
+ * their suggested corrections.
+ *
+ * @param misspelled A vector of misspelled words.
+ * @param corrections A vector of pairs, where each pair contains a
+ * misspelled word and the ID of its suggested correction.
+ * @param dictionary The dictionary snapshot the corrections came from.
+ */
+void print_results(
+    const std::vector<std::string>& misspelled,
+    const std::vector<std::pair<std::string, WordId>>& corrections,
+    const DictionarySnapshot& dictionary) {
+    std::cout << "\n";
+
+    if (misspelled.empty()) {
+        std::cout << "No misspelled words found.\n";
+    } else {
+        std::cout << "Misspelled words:\n";
+        for (const auto& word : misspelled) {
+            std::cout << word << "\n";
+        }
+    }
+
+    if (!corrections.empty()) {
+        std::cout << "Corrections:\n";
+        std::string suggestion;
+        for (const auto& correction : corrections) {
+            suggestion_text(correction.second, dictionary, suggestion);
+            std::cout << correction.first << " -> " << suggestion << "\n";
+        }
+    }
+    std::cout << std::flush;
+}
+
+/**
+ * Removes punctuation from a given word and converts it to lowercase.
+ * Letters are kept, including accented letters and letters of other
+ * scripts in UTF-8, and are case folded and composed to NFC by
+ * normalize_word. ASCII words take a plain byte loop.
+ *
+ * @param word The word from which to strip punctuation and convert to
+ * lowercase.
+ * @return A new string that is the lowercase version of the input word without
+ * any punctuation.
+ */
+std::string strip_punctuation(std::string_view word) {
+    return normalize_word(word);
+}
+
+/**
+ * Strip a word into a caller's string, so the result can come from a
+ * request arena and the string's memory is reused from word to word.
+ *
+ * @param word The word to strip.
+ * @param stripped Receives the lowercase word without punctuation.
+ */
+void strip_punctuation(std::string_view word, std::pmr::string& stripped) {
+    normalize_word(word, stripped);
+}
+
+/**
+ * Tokenizes a given string of text into individual words. This function
+ * scans the text for whitespace-delimited words and stores them in a
+ * vector. It handles standard whitespace-delimited words but does not strip
+ * punctuation or alter case; use `strip_punctuation` for that purpose if
+ * needed.
+ *
+ * @param text The string of text to tokenize.
+ * @param memory Where to allocate the tokens, such as a request arena.
+ * @return A vector of strings, where each string is a word from the input text.
+ */
+std::pmr::vector<std::pmr::string> tokenize(
+    const std::string& text,
+    std::pmr::memory_resource* memory = std::pmr::get_default_resource()) {
+    METRIC_TIMER(PHASE_TOKENIZE);
+    std::pmr::vector<std::pmr::string> tokens(memory);
+    size_t i = 0;
+
+    while (i < text.size()) {
+        if (std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < text.size() &&
+               !std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+        }
+        std::string_view token(text.data() + start, i - start);
+
+        // Check for trailing punctuation
+        if (ispunct(static_cast<unsigned char>(token.back()))) {
+            // Separate word from trailing punctuation
+            tokens.emplace_back(token.substr(0, token.size() - 1));
+            tokens.emplace_back(token.substr(token.size() - 1));
+        } else {
+            tokens.emplace_back(token);
+        }
+    }
+
+    METRIC_COUNT(COUNTER_TOKENS, tokens.size());
+    return tokens;
+}
+
+/**
+ * Replaces the first occurrence of a specified word in a given text with
+ * a new word. This function searches for the old word within the original
+ * text and replaces it with the new word if found. Note that this function
+ * only replaces the first occurrence of the old word.
+ *
+ * @param original_text The original text in which to replace a word.
+ * @param old_word The word in the original text that needs to be replaced.
+ * @param new_word The word that will replace the old word in the text.
+ * @return A new string with the first occurrence of the old word replaced by
+ * the new word.
+ */
+std::string replace_word(const std::string& original_text,
+                         const std::string& old_word,
+                         const std::string& new_word) {
+    std::string corrected_text = original_text;
+    size_t pos = corrected_text.find(old_word);
+
+    if (pos != std::string::npos) {
+        corrected_text.replace(pos, old_word.length(), new_word);
+    }
+
+    return corrected_text;
+}
+
+/**
+ * Write corrected text back over a file.
+ *
+ * @param filename The name of the file to overwrite.
+ * @param text The text to write.
+ * @return True if the file was written successfully.
+ */
+bool write_back(const std::string& filename, const std::string& text) {
+    METRIC_TIMER(PHASE_WRITE_BACK);
+    METRIC_COUNT(COUNTER_BYTES_WRITTEN, text.size());
+
+    std::ofstream out_file(filename, std::ios::binary);
+    out_file << text;
+    out_file.close();
+
+    return bool(out_file);
+}
+
+/**
+ * Reads a text file, identifies misspelled words, offers suggestions for
+ * corrections, allows the user to choose corrections interactively, and
+ * rewrites the file with the selected corrections applied. Ignores punctuation
+ * when identifying words.
+ *
+ * @param filename The name of the file to spell check and correct.
+ * @param dictionary The dictionary snapshot to check against.
+ */
+void spell_check_and_correct_file(const std::string& filename,
+                                  const DictionarySnapshot& dictionary) {
+    std::ifstream file(filename);
+    std::string text((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    file.close();
+
+    ScopedArena arena;
+    auto tokens = tokenize(text, arena.resource());
+    bool made_corrections = false;
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        std::string strippedWord = strip_punctuation(tokens[i]);
+        METRIC_COUNT(COUNTER_LOOKUPS, !strippedWord.empty());
+        if (!strippedWord.empty() && !dictionary.contains(strippedWord)) {
+            // Misspelled word found
+            METRIC_COUNT(COUNTER_LOOKUP_MISSES, 1);
+            std::cout << "\nMisspelled word: " << tokens[i] << std::endl;
+            auto suggestions =
+                suggest_corrections_cached({strippedWord}, dictionary);
+
+            if (!suggestions.empty()) {
+                // Display suggestions
+                std::cout << "Suggestions for \"" << tokens[i]
+                          << "\":" << std::endl;
+                std::string suggestion;
+                for (size_t j = 0; j < suggestions.size(); ++j) {
+                    suggestion_text(suggestions[j].second, dictionary,
+                                    suggestion);
+                    std::cout << j + 1 << ": " << suggestion << std::endl;
+                }
+                std::cout << "0: Skip (make no change)\n";
+                std::cout << "Choose a correction (number): ";
+                int choice;
+                std::cin >> choice;
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(),
+                                '\n');  // Clears the input buffer
+
+                if (choice > 0 && choice <= suggestions.size()) {
+                    // Replace the misspelled word with the chosen correction
+                    suggestion_text(suggestions[choice - 1].second,
+                                    dictionary, suggestion);
+                    tokens[i] = suggestion;
+                    made_corrections = true;
+                    std::cout << "Applying correction..." << std::endl;
+                }
+            }
+        }
+    }
+
+    if (made_corrections) {
+        // Reconstruct the text from tokens and write it back to the file,
+        // handling spaces correctly
+        std::string corrected_text;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (i > 0 && !ispunct(tokens[i][0])) {
+                corrected_text += " ";
+            }
+            corrected_text += tokens[i];
+        }
+
+        write_back(filename, corrected_text);
+        std::cout << "All corrections have been applied and saved back to \""
+                  << filename << "\".\n";
+    } else {
+        std::cout << "No corrections were made to the file.\n";
+    }
+}
+
+/**
+ * A misspelled word found by the batch checker, along with where it occurs in
+ * the text. The offset and length cover the token with any leading or
+ * trailing punctuation trimmed off.
+ */
+struct Misspelling {
+    std::pmr::string word;
+    size_t offset;
+    size_t length;
+    size_t line;
+    size_t column;
+};
+
+/**
+ * The formats `check` can write its results in: one "file:line:column: word"
+ * line per misspelling, one JSON object per line, or a SARIF 2.1.0 log.
+ */
+enum ResultFormat { RESULTS_TEXT, RESULTS_NDJSON, RESULTS_SARIF };
+
+/**
+ * When a ResultWriter hands its buffer to the stream: once the buffer is
+ * full, or after every result.
+ */
+enum FlushPolicy { FLUSH_BATCH, FLUSH_RESULT };
+
+/**
+ * Writes the misspellings found by `check` in one of the result formats.
+ * Results are formatted into a buffer that is written out according to the
+ * flush policy, and always when the writer is finished.
+ */
+class ResultWriter {
+   public:
+    /**
+     * @param out The stream to write to.
+     * @param format The format to write.
+     * @param flush When to write the buffer out.
+     */
+    ResultWriter(std::ostream& out, ResultFormat format, FlushPolicy flush)
+        : out_(out), format_(format), flush_(flush) {
+        buffer_.reserve(RESULT_BUFFER_SIZE);
+        if (format_ == RESULTS_SARIF) {
+            buffer_ +=
+                "{\"version\":\"2.1.0\",\"$schema\":"
+                "\"https://json.schemastore.org/sarif-2.1.0.json\","
+                "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"SpellChecker\","
+                "\"rules\":[{\"id\":\"misspelling\",\"shortDescription\":"
+                "{\"text\":\"Misspelled word\"}}]}},"
+                "\"columnKind\":\"unicodeCodePoints\",\"results\":[";
+        }
+    }
+
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+
+    ~ResultWriter() {
+        finish();
+    }
+
+    /**
+     * Write one misspelling.
+     *
+     * @param file The name of the file it was found in.
+     * @param text The text of the file.
+     * @param misspelling The misspelling.
+     */
+    void write(const std::string& file, std::string_view text,
+               const Misspelling& misspelling) {
+        std::string_view word =
+            text.substr(misspelling.offset, misspelling.length);
+        if (format_ == RESULTS_TEXT) {
+            buffer_ += file;
+            buffer_ += ':';
+            buffer_ += std::to_string(misspelling.line);
+            buffer_ += ':';
+            buffer_ += std::to_string(misspelling.column);
+            buffer_ += ": ";
+            buffer_ += word;
+            buffer_ += '\n';
+        } else if (format_ == RESULTS_NDJSON) {
+            buffer_ += "{\"file\":";
+            append_json_string(buffer_, file);
+            append_field("line", misspelling.line);
+            append_field("column", misspelling.column);
+            append_field("offset", misspelling.offset);
+            append_field("length", misspelling.length);
+            buffer_ += ",\"word\":";
+            append_json_string(buffer_, std::string(word));
+            buffer_ += "}\n";
+        } else {
+            // SARIF counts columns in code points, not bytes.
+            size_t line_start = misspelling.offset - (misspelling.column - 1);
+            size_t column = utf8_length(text.substr(
+                                line_start, misspelling.column - 1)) + 1;
+            buffer_ += results_ ? "," : "";
+            buffer_ += "{\"ruleId\":\"misspelling\",\"level\":\"warning\","
+                       "\"message\":{\"text\":";
+            append_json_string(buffer_,
+                               "Unknown word \"" + std::string(word) + "\".");
+            buffer_ += "},\"locations\":[{\"physicalLocation\":{"
+                       "\"artifactLocation\":{\"uri\":";
+            append_json_string(buffer_, path_to_uri(file));
+            buffer_ += "},\"region\":{\"startLine\":";
+            buffer_ += std::to_string(misspelling.line);
+            append_field("startColumn", column);
+            append_field("endColumn", column + utf8_length(word));
+            append_field("byteOffset", misspelling.offset);
+            append_field("byteLength", misspelling.length);
+            buffer_ += "}}}]}";
+        }
+        results_++;
+
+        if (flush_ == FLUSH_RESULT || buffer_.size() >= RESULT_BUFFER_SIZE) {
+            write_buffer();
+        }
+    }
+
+    /**
+     * Close the output, writing out and flushing whatever is buffered. Later
+     * calls do nothing.
+     *
+     * @return True if everything was written.
+     */
+    bool finish() {
+        if (!finished_) {
+            finished_ = true;
+            if (format_ == RESULTS_SARIF) {
+                buffer_ += "]}]}\n";
+            }
+            write_buffer();
+            out_.flush();
+        }
+        return bool(out_);
+    }
+
+   private:
+    void append_field(const char* name, size_t value) {
+        buffer_ += ",\"";
+        buffer_ += name;
+        buffer_ += "\":";
+        buffer_ += std::to_string(value);
+    }
+
+    void write_buffer() {
+        METRIC_COUNT(COUNTER_BYTES_WRITTEN, buffer_.size());
+        out_.write(buffer_.data(), buffer_.size());
+        if (flush_ == FLUSH_RESULT) {
+            out_.flush();
+        }
+        buffer_.clear();
+    }
+
+    std::ostream& out_;
+    ResultFormat format_;
+    FlushPolicy flush_;
+    std::string buffer_;
+    size_t results_ = 0;
+    bool finished_ = false;
+};
+
+/**
+ * Options shared by the command-line subcommands.
+ */
+struct CommandOptions {
+    std::string command;
+    std::string dictionary_filename = "dictionary.txt";
+    std::string output_filename;
+    bool in_place = false;
+    int repeat = 5;
+    int warmup = 1;
+    std::vector<size_t> bench_sizes = {10000, 100000, 1000000};
+    size_t text_words = 100000;
+    size_t suggest_words = 10;
+    double misspell_rate = 0.05;
+    unsigned seed = 42;
+    std::string json_filename;
+    bool metrics = false;
+    bool json_format = false;
+    ResultFormat results = RESULTS_TEXT;
+    FlushPolicy flush = FLUSH_BATCH;
+    std::vector<std::string> ignore_patterns;
+    std::vector<std::string> extensions;
+    std::string socket_path = spell_protocol::DEFAULT_SOCKET_PATH;
+    bool watch = false;
+    std::vector<std::string> overlay_filenames;
+    DistanceMetric distance = DISTANCE_DAMERAU;
+    bool filter = false;
+    bool grams = false;
+    bool phonetic = false;
+    CompiledFormat format = COMPILED_SORTED;
+    size_t completions = DEFAULT_COMPLETIONS;
+    std::vector<std::string> inputs;
+};
+
+/**
+ * Read an entire file into a string. The name "-" reads standard input
+ * instead, so every subcommand can be used in a pipeline.
+ *
+ * @param filename The name of the file to read, or "-" for standard input.
+ * @param text Receives the contents of the file.
+ * @return True if the file could be read.
+ */
+bool read_text(const std::string& filename, std::string& text) {
+    if (filename == "-") {
+        text.assign(std::istreambuf_iterator<char>(std::cin),
+                    std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: could not open " << filename << std::endl;
+        return false;
+    }
+
+    text.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+    return true;
+}
+
+/**
+ * Scan a string of text for whitespace-delimited words that are not in the
+ * dictionary. Words are compared with punctuation stripped and in lowercase,
+ * the same way the file correction flow compares them, and the position of
+ * each misspelling is recorded so it can be reported or rewritten in place.
+ *
+ * @param text The string of text to check.
+ * @param dictionary The dictionary snapshot to check against.
+ * @param memory Where to allocate the misspellings and the scratch word,
+ * such as a request arena.
+ * @return The misspelled words in the order they occur in the text.
+ */
+std::pmr::vector<Misspelling> find_misspellings(
+    const std::string& text, const DictionarySnapshot& dictionary,
+    std::pmr::memory_resource* memory = std::pmr::get_default_resource()) {
+    // Splitting the text into words and looking each one up are timed as
+    // separate phases, although they are interleaved word by word.
+    METRIC_LAP_TIMER(timer);
+    std::pmr::vector<Misspelling> misspellings(memory);
+    std::pmr::string word(memory);
+    size_t lookups = 0;
+    size_t line = 1;
+    size_t line_start = 0;
+    size_t i = 0;
+
+    while (i < text.size()) {
+        if (std::isspace(static_cast<unsigned char>(text[i]))) {
+            if (text[i] == '\n') {
+                line++;
+                line_start = i + 1;
+            }
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < text.size() &&
+               !std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+        }
+
+        // Trim punctuation from both ends of the token so the reported span
+        // covers only the word itself.
+        size_t first = start;
+        size_t last = i;
+        trim_to_letters(text, first, last);
+
+        strip_punctuation(
+            std::string_view(text).substr(first, last - first), word);
+        METRIC_LAP(timer, PHASE_TOKENIZE);
+        lookups += !word.empty();
+        if (!word.empty() && !dictionary.contains(word)) {
+            misspellings.push_back({std::pmr::string(word, memory), first,
+                                    last - first, line,
+                                    first - line_start + 1});
+        }
+        METRIC_LAP(timer, PHASE_LOOKUP);
+    }
+
+    METRIC_COUNT(COUNTER_TOKENS, lookups);
+    METRIC_COUNT(COUNTER_LOOKUPS, lookups);
+    METRIC_COUNT(COUNTER_LOOKUP_MISSES, misspellings.size());
+    return misspellings;
+}
+
+/**
+ * Give a suggested correction the capitalization of the word it replaces.
+ * Suggestions come from the dictionary in lowercase, so a capitalized or
+ * all-caps word in the text keeps its case when corrected. Case is read and
+ * applied per code point, so accented capitals are handled like ASCII ones.
+ *
+ * @param original The word as it appears in the text.
+ * @param suggestion The suggested correction.
+ * @return The suggestion with the case of the original applied.
+ */
+std::string match_case(std::string_view original,
+                       const std::string& suggestion) {
+    size_t letters = 0;
+    bool first_upper = false;
+    bool has_lower = false;
+    size_t pos = 0;
+    while (pos < original.size() && !has_lower) {
+        uint32_t code_point;
+        if (!decode_utf8(original, pos, code_point)) {
+            continue;
+        }
+        bool upper = fold_case(code_point) != code_point;
+        if (letters++ == 0) {
+            first_upper = upper;
+        }
+        has_lower = !upper && upper_case(code_point) != code_point;
+    }
+
+    bool all_upper = !has_lower && letters > 1;
+    if (!all_upper && !first_upper) {
+        return suggestion;
+    }
+
+    std::string result;
+    result.reserve(suggestion.size());
+    pos = 0;
+    while (pos < suggestion.size()) {
+        size_t start = pos;
+        uint32_t code_point;
+        if (!decode_utf8(suggestion, pos, code_point)) {
+            result.append(suggestion, start, pos - start);
+        } else {
+            append_utf8(result, upper_case(code_point));
+        }
+        if (!all_upper) {
+            result.append(suggestion, pos, std::string::npos);
+            break;
+        }
+    }
+    return result;
+}
+
+/**
+ * Replace every misspelled word in a string of text with its suggested
+ * correction. Unlike the interactive file flow, the text is rewritten in
+ * place so whitespace and punctuation are preserved exactly.
+ *
+ * @param text The string of text to correct.
+ * @param dictionary The dictionary snapshot to check and correct against.
+ * @param uncorrected Receives the number of misspelled words that had no
+ * suggestion and were left unchanged.
+ * @return The corrected text.
+ */
+std::string correct_text(const std::string& text,
+                         const DictionarySnapshot& dictionary,
+                         size_t& uncorrected) {
+    ScopedArena arena;
+    std::string corrected_text;
+    std::string suggestion;
+    size_t copied = 0;
+    uncorrected = 0;
+
+    for (const auto& misspelling :
+         find_misspellings(text, dictionary, arena.resource())) {
+        WordId id = cached_suggestion(misspelling.word, dictionary);
+        if (id == NO_WORD) {
+            uncorrected++;
+            continue;
+        }
+        suggestion_text(id, dictionary, suggestion);
+
+        corrected_text.append(text, copied, misspelling.offset - copied);
+        corrected_text += match_case(
+            std::string_view(text).substr(misspelling.offset,
+                                          misspelling.length),
+            suggestion);
+        copied = misspelling.offset + misspelling.length;
+    }
+    corrected_text.append(text, copied, std::string::npos);
+
+    return corrected_text;
+}
+
+/**
+ * Print the command-line usage summary.
+ *
+ * @param out The stream to print to.
+ */
+void print_usage(std::ostream& out) {
+    out << "Usage: SpellChecker [command] [options] [files...]\n"
+        << "\n"
+        << "Run without a command to start the interactive menu.\n"
+        << "\n"
+        << "Commands:\n"
+        << "  check         Report misspelled words in files, directories or "
+           "stdin\n"
+        << "  suggest       Suggest corrections for words given as arguments "
+           "or on stdin\n"
+        << "  correct       Replace misspelled words with their suggested "
+           "corrections\n"
+        << "  complete      List the most frequent words that start with "
+           "each prefix\n"
+        << "  compile-dict  Compile a text dictionary into a binary image\n"
+        << "  bench         Benchmark the load, check and suggest phases\n"
+        << "  serve         Run as a daemon answering requests on a Unix "
+           "socket\n"
+        << "  lsp           Run as a Language Server Protocol server on "
+           "stdio\n"
+        << "  stats         Print the metrics of a running daemon\n"
+        << "\n"
+        << "Options:\n"
+        << "  -d, --dictionary FILE  Dictionary to load (default: "
+           "dictionary.txt)\n"
+        << "  -o, --output FILE      Write output to FILE\n"
+        << "  -i, --in-place         correct: rewrite the input files\n"
+        << "  -k, --limit N          complete: completions per prefix "
+           "(default: "
+        << DEFAULT_COMPLETIONS << ")\n"
+        << "  --perfect-hash         compile-dict: index the words with a "
+           "minimal\n"
+        << "                         perfect hash for one-probe lookups\n"
+        << "  --trie                 compile-dict: store the words as a "
+           "succinct trie\n"
+        << "  -n, --repeat N         bench: repetitions per phase (default: "
+           "5)\n"
+        << "  --warmup N             bench: untimed runs per phase (default: "
+           "1)\n"
+        << "  --sizes N,N,...        bench: generated dictionary sizes "
+           "(default:\n"
+        << "                         10000,100000,1000000)\n"
+        << "  --text-words N         bench: words in the generated text "
+           "(default:\n"
+        << "                         100000)\n"
+        << "  --misspell-rate R      bench: fraction of misspelled words "
+           "(default:\n"
+        << "                         0.05)\n"
+        << "  --suggest-words N      bench: misspelled words to suggest for "
+           "(default:\n"
+        << "                         10)\n"
+        << "  --seed N               bench: corpus generator seed (default: "
+           "42)\n"
+        << "  --json FILE            bench: also write results as JSON ('-' "
+           "for stdout)\n"
+        << "  -s, --socket PATH      serve: socket to listen on (default: "
+        << spell_protocol::DEFAULT_SOCKET_PATH << ")\n"
+        << "  --ignore PATTERN       check: skip files and directories "
+           "matching a\n"
+        << "                         gitignore-style pattern; may be repeated\n"
+        << "  --ext EXT,EXT,...      check: only check files in directories "
+           "with these\n"
+        << "                         extensions\n"
+        << "  --overlay FILE         Stack a dictionary of extra words on top "
+           "of the\n"
+        << "                         main one; may be repeated\n"
+        << "  -w, --watch            serve, lsp: reload the dictionary when "
+           "its file\n"
+        << "                         changes\n"
+        << "  --distance damerau|levenshtein\n"
+        << "                         Edit distance used to rank suggestions "
+           "(default:\n"
+        << "                         damerau)\n"
+        << "  --filter               Put a Bloom filter in front of each "
+           "dictionary\n"
+        << "                         layer to reject absent words quickly\n"
+        << "  --grams                Index the trigrams of each dictionary "
+           "layer to\n"
+        << "                         find suggestions for long words quickly\n"
+        << "  --phonetic             Index the phonetic keys of each "
+           "dictionary layer\n"
+        << "                         to suggest words that sound alike\n"
+        << "  --metrics              Print metrics to stderr when the command "
+           "ends\n"
+        << "  --format text|json|ndjson|sarif\n"
+        << "                         Format of check results, and of "
+           "--metrics and\n"
+        << "                         stats output, which are JSON unless "
+           "text\n"
+        << "                         (default: text)\n"
+        << "  --line-buffered        check: write each result as soon as it "
+           "is found\n"
+        << "  -h, --help             Show this message\n"
+        << "\n"
+        << "Exit status is 0 when no misspellings were found, 1 when some "
+           "were,\nand 2 on usage or I/O errors.\n";
+}
+
+/**
+ * Parse the command line into a set of options. The first argument names the
+ * subcommand; the remaining arguments are options and input files.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @param options Receives the parsed options.
+ * @return True if the command line was valid.
+ */
+bool parse_command_line(int argc, char* argv[], CommandOptions& options) {
+    options.command = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if ((arg == "-d" || arg == "--dictionary") && has_value) {
+            options.dictionary_filename = argv[++i];
+        } else if ((arg == "-o" || arg == "--output") && has_value) {
+            options.output_filename = argv[++i];
+        } else if (arg == "-i" || arg == "--in-place") {
+            options.in_place = true;
+        } else if ((arg == "-n" || arg == "--repeat") && has_value) {
+            options.repeat = std::atoi(argv[++i]);
+            if (options.repeat <= 0) {
+                std::cerr << "Error: --repeat must be positive" << std::endl;
+                return false;
+            }
+        } else if (arg == "--warmup" && has_value) {
+            options.warmup = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--sizes" && has_value) {
+            options.bench_sizes.clear();
+            std::istringstream sizes(argv[++i]);
+            std::string size;
+            while (std::getline(sizes, size, ',')) {
+                long value = std::atol(size.c_str());
+                if (value <= 0) {
+                    std::cerr << "Error: invalid size " << size << std::endl;
+                    return false;
+                }
+                options.bench_sizes.push_back(value);
+            }
+        } else if (arg == "--text-words" && has_value) {
+            options.text_words = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--misspell-rate" && has_value) {
+            options.misspell_rate = std::atof(argv[++i]);
+        } else if (arg == "--suggest-words" && has_value) {
+            options.suggest_words = std::max(0L, std::atol(argv[++i]));
+        } else if ((arg == "-k" || arg == "--limit") && has_value) {
+            options.completions = std::max(1L, std::atol(argv[++i]));
+        } else if (arg == "--seed" && has_value) {
+            options.seed = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--json" && has_value) {
+            options.json_filename = argv[++i];
+        } else if (arg == "--metrics") {
+            options.metrics = true;
+        } else if (arg == "--format" && has_value) {
+            std::string format = argv[++i];
+            if (format != "text" && format != "json" && format != "ndjson" &&
+                format != "sarif") {
+                std::cerr << "Error: unknown format " << format << std::endl;
+                return false;
+            }
+            options.json_format = format != "text";
+            options.results = format == "text"    ? RESULTS_TEXT
+                              : format == "sarif" ? RESULTS_SARIF
+                                                  : RESULTS_NDJSON;
+        } else if (arg == "--line-buffered") {
+            options.flush = FLUSH_RESULT;
+        } else if ((arg == "-s" || arg == "--socket") && has_value) {
+            options.socket_path = argv[++i];
+        } else if (arg == "--overlay" && has_value) {
+            options.overlay_filenames.push_back(argv[++i]);
+        } else if (arg == "--ignore" && has_value) {
+            options.ignore_patterns.push_back(argv[++i]);
+        } else if (arg == "--ext" && has_value) {
+            std::istringstream list(argv[++i]);
+            std::string extension;
+            while (std::getline(list, extension, ',')) {
+                if (!extension.empty() && extension[0] == '.') {
+                    extension.erase(0, 1);
+                }
+                if (!extension.empty()) {
+                    options.extensions.push_back(extension);
+                }
+            }
+        } else if (arg == "-w" || arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--distance" && has_value) {
+            std::string distance = argv[++i];
+            if (distance != "damerau" && distance != "levenshtein") {
+                std::cerr << "Error: unknown distance " << distance
+                          << std::endl;
+                return false;
+            }
+            options.distance = distance == "damerau" ? DISTANCE_DAMERAU
+                                                     : DISTANCE_LEVENSHTEIN;
+        } else if (arg == "--filter") {
+            options.filter = true;
+        } else if (arg == "--grams") {
+            options.grams = true;
+        } else if (arg == "--phonetic") {
+            options.phonetic = true;
+        } else if (arg == "--perfect-hash") {
+            options.format = COMPILED_PERFECT_HASH;
+        } else if (arg == "--trie") {
+            options.format = COMPILED_TRIE;
+        } else if (arg == "-" || arg.empty() || arg[0] != '-') {
+            options.inputs.push_back(arg);
+        } else {
+            std::cerr << "Error: unknown or incomplete option " << arg
+                      << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Load the dictionary named in the options, with any overlays stacked on top
+ * in the order given and the words journaled for it on top of those,
+ * reporting a failure the same way the interactive menu
+ * does.
+ *
+ * @param options The parsed command-line options.
+ * @param dictionary Receives the loaded dictionary.
+ * @return True if a non-empty dictionary and every overlay were loaded.
+ */
+bool load_command_dictionary(const CommandOptions& options,
+                             SharedDictionary& dictionary) {
+    DictionaryLayer base;
+    if (!load_dictionary_layer(options.dictionary_filename, base)) {
+        std::cerr << "Failed to load dictionary." << std::endl;
+        return false;
+    }
+    dictionary.replace(std::move(base));
+
+    for (const auto& filename : options.overlay_filenames) {
+        DictionaryLayer overlay;
+        if (!load_dictionary_layer(filename, overlay)) {
+            std::cerr << "Failed to load overlay " << filename << "."
+                      << std::endl;
+            return false;
+        }
+        dictionary.add_overlay(std::move(overlay));
+    }
+
+    DictionaryLayer journal = load_journal_layer(options.dictionary_filename);
+    if (journal.size() > 0) {
+        dictionary.add_overlay(std::move(journal));
+    }
+    return true;
+}
+
+// How long the dictionary file must stay quiet after a change before it is
+// reloaded, so a burst of writes causes a single reload.
+const int RELOAD_SETTLE_MS = 100;
+
+// How often the watcher wakes up to free dictionary snapshots that readers
+// were still using when they were replaced.
+const int RECLAIM_INTERVAL_MS = 1000;
+
+/**
+ * Watches a dictionary file and reloads it into a shared dictionary whenever
+ * it changes. The new dictionary is built on the watcher's own thread and
+ * published as a new snapshot, so readers carry on with the old version
+ * until the swap and never wait for the reload.
+ *
+ * The directory holding the file is watched rather than the file itself, so
+ * editors and tools that replace the file by renaming a new one over it are
+ * picked up as well as ones that rewrite it in place.
+ */
+class DictionaryWatcher {
+   public:
+    /**
+     * @param dictionary The dictionary to reload into; must outlive the
+     * watcher.
+     * @param filename The dictionary file to watch.
+     */
+    DictionaryWatcher(SharedDictionary& dictionary, const std::string& filename)
+        : dictionary_(dictionary), filename_(filename) {
+        size_t slash = filename.rfind('/');
+        if (slash == std::string::npos) {
+            directory_ = ".";
+            name_ = filename;
+        } else {
+            directory_ = slash == 0 ? "/" : filename.substr(0, slash);
+            name_ = filename.substr(slash + 1);
+        }
+    }
+
+    DictionaryWatcher(const DictionaryWatcher&) = delete;
+    DictionaryWatcher& operator=(const DictionaryWatcher&) = delete;
+
+    ~DictionaryWatcher() { stop(); }
+
+    /**
+     * Start watching on a background thread.
+     *
+     * @return True if the file's directory could be watched.
+     */
+    bool start() {
+        inotify_fd_ = inotify_init1(IN_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_CLOEXEC);
+        if (inotify_fd_ < 0 || wake_fd_ < 0 ||
+            inotify_add_watch(inotify_fd_, directory_.c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            std::cerr << "Error: could not watch " << filename_ << ": "
+                      << std::strerror(errno) << std::endl;
+            close_fds();
+            return false;
+        }
+
+        thread_ = std::thread(&DictionaryWatcher::run, this);
+        return true;
+    }
+
+    /**
+     * Signal an eventfd after each successful reload, so a caller that waits
+     * on other input as well can react to the new dictionary. Call before
+     * start.
+     *
+     * @param fd The eventfd to signal.
+     */
+    void notify(int fd) { notify_fd_ = fd; }
+
+    /**
+     * Stop watching and wait for any reload in progress to finish.
+     */
+    void stop() {
+        if (thread_.joinable()) {
+            uint64_t wake = 1;
+            ssize_t written = write(wake_fd_, &wake, sizeof(wake));
+            (void)written;
+            thread_.join();
+        }
+        close_fds();
+    }
+
+   private:
+    /**
+     * Wait for changes to the file and reload it after each one settles.
+     */
+    void run() {
+        bool changed = false;
+
+        while (true) {
+            pollfd fds[2] = {{wake_fd_, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+            int timeout = changed ? RELOAD_SETTLE_MS : RECLAIM_INTERVAL_MS;
+            int ready = poll(fds, 2, timeout);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error: dictionary watcher: "
+                          << std::strerror(errno) << std::endl;
+                return;
+            }
+            if (fds[0].revents) {
+                return;
+            }
+
+            if (ready == 0) {
+                if (changed) {
+                    reload();
+                    changed = false;
+                }
+                dictionary_.reclaim();
+                continue;
+            }
+
+            changed = read_events() || changed;
+        }
+    }
+
+    /**
+     * Drain pending inotify events.
+     *
+     * @return True if any of them concern the watched file.
+     */
+    bool read_events() {
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+        bool matched = false;
+
+        for (ssize_t pos = 0; pos < length;) {
+            const inotify_event* event =
+                reinterpret_cast<const inotify_event*>(buffer + pos);
+            if (event->len > 0 && name_ == event->name) {
+                matched = true;
+            }
+            pos += sizeof(inotify_event) + event->len;
+        }
+        return matched;
+    }
+
+    /**
+     * Load the file and publish it as the new dictionary, logging how long
+     * it took and the process's peak memory use. A file that fails to load
+     * leaves the current dictionary in place.
+     */
+    void reload() {
+        auto start = std::chrono::steady_clock::now();
+        DictionaryLayer base;
+        if (!load_dictionary_layer(filename_, base)) {
+            std::cerr << "Reload of " << filename_
+                      << " failed; keeping the current dictionary."
+                      << std::endl;
+            return;
+        }
+
+        size_t count = base.size();
+        dictionary_.replace(std::move(base));
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+        // ru_maxrss is reported in kilobytes on Linux.
+        rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+
+        std::cerr << "Reloaded " << count << " words from " << filename_
+                  << " in " << elapsed << " ms (generation "
+                  << DictionaryReader(dictionary_)->generation
+                  << ", peak RSS " << usage.ru_maxrss / 1024 << " MiB)"
+                  << std::endl;
+
+        if (notify_fd_ >= 0) {
+            uint64_t reloaded = 1;
+            ssize_t written = write(notify_fd_, &reloaded, sizeof(reloaded));
+            (void)written;
+        }
+    }
+
+    /**
+     * Close the inotify and wake-up descriptors, if open.
+     */
+    void close_fds() {
+        if (inotify_fd_ >= 0) {
+            close(inotify_fd_);
+            inotify_fd_ = -1;
+        }
+        if (wake_fd_ >= 0) {
+            close(wake_fd_);
+            wake_fd_ = -1;
+        }
+    }
+
+    SharedDictionary& dictionary_;
+    std::string filename_;
+    std::string directory_;
+    std::string name_;
+    int inotify_fd_ = -1;
+    int wake_fd_ = -1;
+    int notify_fd_ = -1;
+    std::thread thread_;
+};
+
+/**
+ * One pattern from an ignore file or --ignore, in gitignore syntax. A
+ * pattern with a slash is matched against the path below the directory it
+ * was found in; one without is matched against the name alone.
+ */
+struct IgnoreRule {
+    std::string pattern;
+    bool negated = false;
+    bool directory_only = false;
+    bool anchored = false;
+};
+
+/**
+ * The ignore rules found in one directory, chained to those of the
+ * directories above it. Later rules override earlier ones, and rules in a
+ * deeper directory override those above, as with .gitignore.
+ */
+struct IgnoreList {
+    std::shared_ptr<const IgnoreList> parent;
+    std::string base;
+    std::vector<IgnoreRule> rules;
+};
+
+/**
+ * Parse one line of an ignore file into a rule. Blank lines and comments
+ * are skipped.
+ *
+ * @param line The line.
+ * @param rules The list to add the rule to.
+ */
+void add_ignore_pattern(std::string line, IgnoreList& rules) {
+    while (!line.empty() &&
+           std::isspace(static_cast<unsigned char>(line.back()))) {
+        line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+        return;
+    }
+
+    IgnoreRule rule;
+    if (line[0] == '!') {
+        rule.negated = true;
+        line.erase(0, 1);
+    }
+    if (line.size() >= 3 && line.compare(line.size() - 3, 3, "/**") == 0) {
+        line.resize(line.size() - 3);
+        rule.directory_only = true;
+    }
+    if (!line.empty() && line.back() == '/') {
+        line.pop_back();
+        rule.directory_only = true;
+    }
+    // A leading "**/" before a bare name is the same as the bare name.
+    if (line.compare(0, 3, "**/") == 0 &&
+        line.find('/', 3) == std::string::npos) {
+        line.erase(0, 3);
+    } else if (!line.empty() && line[0] == '/') {
+        line.erase(0, 1);
+        rule.anchored = true;
+    }
+    rule.anchored = rule.anchored || line.find('/') != std::string::npos;
+    if (!line.empty()) {
+        rule.pattern = std::move(line);
+        rules.rules.push_back(std::move(rule));
+    }
+}
+
+/**
+ * Match a path against a pattern with slashes, in which "**" as a whole
+ * path segment matches any number of directories, including none, and
+ * everything else is matched by fnmatch with FNM_PATHNAME.
+ *
+ * @param pattern The pattern.
+ * @param path The path, relative to the directory the pattern came from.
+ * @return True if the pattern matches the path.
+ */
+bool match_ignore_pattern(std::string_view pattern, std::string_view path) {
+    if (pattern.substr(0, 3) == "**/") {
+        std::string_view rest = pattern.substr(3);
+        for (size_t pos = 0;; pos++) {
+            if (match_ignore_pattern(rest, path.substr(pos))) {
+                return true;
+            }
+            pos = path.find('/', pos);
+            if (pos == std::string_view::npos) {
+                return false;
+            }
+        }
+    }
+
+    size_t any = pattern.find("/**/");
+    if (any == std::string_view::npos) {
+        return fnmatch(std::string(pattern).c_str(), std::string(path).c_str(),
+                       FNM_PATHNAME) == 0;
+    }
+    std::string head(pattern.substr(0, any));
+    for (size_t slash = path.find('/'); slash != std::string_view::npos;
+         slash = path.find('/', slash + 1)) {
+        if (fnmatch(head.c_str(), std::string(path.substr(0, slash)).c_str(),
+                    FNM_PATHNAME) == 0 &&
+            match_ignore_pattern(pattern.substr(any + 1),
+                                 path.substr(slash + 1))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decide whether the rules of a directory and those above it ignore a path.
+ *
+ * @param rules The innermost ignore list.
+ * @param path The path, relative to the directory being walked.
+ * @param directory Whether the path is a directory.
+ * @return 1 if the last matching rule ignores the path, 0 if it re-includes
+ * it, and -1 if no rule matches.
+ */
+int match_ignore_rules(const IgnoreList& rules, const std::string& path,
+                       bool directory) {
+    int result = rules.parent
+                     ? match_ignore_rules(*rules.parent, path, directory)
+                     : -1;
+    std::string below =
+        rules.base.empty() ? path : path.substr(rules.base.size() + 1);
+    const char* name = std::strrchr(path.c_str(), '/');
+    name = name ? name + 1 : path.c_str();
+
+    for (const auto& rule : rules.rules) {
+        if (rule.directory_only && !directory) {
+            continue;
+        }
+        if (rule.anchored ? match_ignore_pattern(rule.pattern, below)
+                          : fnmatch(rule.pattern.c_str(), name, 0) == 0) {
+            result = rule.negated ? 0 : 1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Read the ignore files of a directory on top of the rules above it.
+ *
+ * @param directory The directory.
+ * @param relative The directory's path below the walk's root.
+ * @param parent The rules that apply to the directory.
+ * @return The rules for the directory's entries; the parent itself if the
+ * directory has no ignore files.
+ */
+std::shared_ptr<const IgnoreList> read_ignore_files(
+    const std::string& directory, const std::string& relative,
+    const std::shared_ptr<const IgnoreList>& parent) {
+    std::shared_ptr<IgnoreList> rules;
+    for (const char* filename : IGNORE_FILES) {
+        std::ifstream file(directory + "/" + filename);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!rules) {
+                rules = std::make_shared<IgnoreList>();
+                rules->parent = parent;
+                rules->base = relative;
+            }
+            add_ignore_pattern(line, *rules);
+        }
+    }
+    return rules ? rules : parent;
+}
+
+/**
+ * A file or directory waiting to be handled by the directory walk.
+ */
+struct WalkEntry {
+    std::string path;
+    std::string relative;
+    std::shared_ptr<const IgnoreList> ignore;
+    bool directory;
+};
+
+/**
+ * The totals of a directory walk, and the time each file took to read and
+ * check.
+ */
+struct DirectoryReport {
+    size_t files = 0;
+    size_t skipped = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+    std::vector<std::pair<double, std::string>> file_ms;
+};
+
+/**
+ * List a directory, keeping the entries that are not ignored: directories
+ * other than .git, and regular files other than the ignore files with one
+ * of the --ext extensions, or any regular file without --ext. Symbolic
+ * links to files are followed; links to directories are not, so the walk
+ * cannot loop.
+ *
+ * @param entry The directory.
+ * @param options The parsed command-line options.
+ * @param found Receives the entries to walk next.
+ * @return True if the directory could be read.
+ */
+bool list_directory(const WalkEntry& entry, const CommandOptions& options,
+                    std::vector<WalkEntry>& found) {
+    DIR* directory = opendir(entry.path.c_str());
+    if (!directory) {
+        std::cerr << "Error: could not open " << entry.path << std::endl;
+        return false;
+    }
+    auto ignore = read_ignore_files(entry.path, entry.relative, entry.ignore);
+
+    while (dirent* child = readdir(directory)) {
+        std::string name = child->d_name;
+        if (name == "." || name == ".." || name == ".git") {
+            continue;
+        }
+        std::string path = entry.path;
+        if (path.back() != '/') {
+            path += '/';
+        }
+        path += name;
+
+        struct stat info;
+        if (lstat(path.c_str(), &info) != 0) {
+            continue;
+        }
+        bool link = S_ISLNK(info.st_mode);
+        if (link && stat(path.c_str(), &info) != 0) {
+            continue;
+        }
+        bool is_directory = S_ISDIR(info.st_mode);
+        if (is_directory ? link : !S_ISREG(info.st_mode)) {
+            continue;
+        }
+
+        std::string relative =
+            entry.relative.empty() ? name : entry.relative + "/" + name;
+        if (match_ignore_rules(*ignore, relative, is_directory) == 1 ||
+            (!is_directory &&
+             std::find(std::begin(IGNORE_FILES), std::end(IGNORE_FILES),
+                       name) != std::end(IGNORE_FILES))) {
+            continue;
+        }
+        if (!is_directory && !options.extensions.empty()) {
+            size_t dot = name.rfind('.');
+            if (dot == std::string::npos ||
+                std::find(options.extensions.begin(),
+                          options.extensions.end(),
+                          name.substr(dot + 1)) == options.extensions.end()) {
+                continue;
+            }
+        }
+        found.push_back({path, relative, ignore, is_directory});
+    }
+    closedir(directory);
+    return true;
+}
+
+/**
+ * Check every file below a directory. A pool of threads takes entries from
+ * a shared stack: a directory is listed and its entries pushed, and a file
+ * is read and checked, with its results written as one block so files never
+ * interleave. Files finish in no fixed order.
+ *
+ * @param root The directory to walk.
+ * @param dictionary The dictionary snapshot to check against.
+ * @param options The parsed command-line options.
+ * @param writer Receives the misspellings.
+ * @param report Receives the totals of the walk.
+ * @return EXIT_CLEAN, EXIT_MISSPELLED if any file has misspellings, or
+ * EXIT_USAGE if a file or directory could not be read.
+ */
+int check_directory(const std::string& root,
+                    const DictionarySnapshot& dictionary,
+                    const CommandOptions& options, ResultWriter& writer,
+                    DirectoryReport& report) {
+    auto ignore = std::make_shared<IgnoreList>();
+    for (const auto& pattern : options.ignore_patterns) {
+        add_ignore_pattern(pattern, *ignore);
+    }
+
+    // Guards everything below, including the writer and the report.
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<WalkEntry> stack = {{root, "", ignore, true}};
+    // Entries on the stack or being handled; the walk is over at zero.
+    size_t pending = 1;
+    int status = EXIT_CLEAN;
+
+    auto work = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [&] { return !stack.empty() || pending == 0; });
+            if (stack.empty()) {
+                return;
+            }
+            WalkEntry entry = std::move(stack.back());
+            stack.pop_back();
+            lock.unlock();
+
+            std::vector<WalkEntry> found;
+            ScopedArena arena;
+            std::string text;
+            std::pmr::vector<Misspelling> misspellings(arena.resource());
+            bool read = true;
+            bool binary = false;
+            double elapsed = 0;
+            if (entry.directory) {
+                read = list_directory(entry, options, found);
+            } else {
+                auto start = std::chrono::steady_clock::now();
+                read = read_text(entry.path, text);
+                binary = std::memchr(text.data(), '\0',
+                                     std::min(text.size(),
+                                              BINARY_PROBE_SIZE)) != nullptr;
+                if (read && !binary) {
+                    misspellings =
+                        find_misspellings(text, dictionary, arena.resource());
+                }
+                elapsed = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+            }
+
+            lock.lock();
+            if (!read) {
+                status = EXIT_USAGE;
+            } else if (binary) {
+                report.skipped++;
+            } else if (!entry.directory) {
+                for (const auto& misspelling : misspellings) {
+                    writer.write(entry.path, text, misspelling);
+                }
+                if (!misspellings.empty() && status == EXIT_CLEAN) {
+                    status = EXIT_MISSPELLED;
+                }
+                report.files++;
+                report.bytes += text.size();
+                report.file_ms.push_back({elapsed, entry.path});
+            }
+            pending += found.size();
+            for (auto& child : found) {
+                stack.push_back(std::move(child));
+            }
+            pending--;
+            if (pending == 0 || !found.empty()) {
+                ready.notify_all();
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    report.seconds += std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    return status;
+}
+
+/**
+ * Describe the throughput of the directory walks of a `check` run and the
+ * files that took far longer than the median to check.
+ *
+ * @param report The totals of the walks.
+ * @param json Whether to describe them as JSON.
+ * @return The description.
+ */
+std::string directory_report(DirectoryReport report, bool json) {
+    auto& file_ms = report.file_ms;
+    std::sort(file_ms.begin(), file_ms.end(), std::greater<>());
+    double median = file_ms.empty() ? 0 : file_ms[file_ms.size() / 2].first;
+    double mib = report.bytes / (1024.0 * 1024.0);
+    double seconds = std::max(report.seconds, 1e-9);
+    size_t slow = 0;
+    while (slow < file_ms.size() && slow < SLOW_FILE_COUNT &&
+           file_ms[slow].first > median * SLOW_FILE_FACTOR) {
+        slow++;
+    }
+
+    std::ostringstream out;
+    char line[160];
+    if (json) {
+        std::snprintf(line, sizeof(line),
+                      "{\"files\":%zu,\"skipped\":%zu,\"bytes\":%zu,"
+                      "\"seconds\":%.3f,\"files_per_second\":%.1f,"
+                      "\"mib_per_second\":%.2f,\"median_ms\":%.3f,"
+                      "\"slow_files\":[",
+                      report.files, report.skipped, report.bytes,
+                      report.seconds, report.files / seconds, mib / seconds,
+                      median);
+        out << line;
+        for (size_t i = 0; i < slow; i++) {
+            std::string file;
+            append_json_string(file, file_ms[i].second);
+            std::snprintf(line, sizeof(line), "%s{\"file\":", i ? "," : "");
+            out << line << file;
+            std::snprintf(line, sizeof(line), ",\"ms\":%.3f}",
+                          file_ms[i].first);
+            out << line;
+        }
+        out << "]}";
+        return out.str();
+    }
+
+    std::snprintf(line, sizeof(line),
+                  "checked %zu files (%zu binary skipped), %.2f MiB in "
+                  "%.3f s: %.1f files/s, %.2f MiB/s, median %.3f ms/file\n",
+                  report.files, report.skipped, mib, report.seconds,
+                  report.files / seconds, mib / seconds, median);
+    out << line;
+    if (slow > 0) {
+        out << "slow files (over " << SLOW_FILE_FACTOR
+            << "x the median):\n";
+    }
+    for (size_t i = 0; i < slow; i++) {
+        std::snprintf(line, sizeof(line), "  %10.3f ms  ", file_ms[i].first);
+        out << line << file_ms[i].second << "\n";
+    }
+    return out.str();
+}
+
+/**
+ * The `check` subcommand. Reports each misspelled word as
+ * "file:line:column: word" so the output can be consumed by editors and
+ * scripts, or as NDJSON or SARIF with --format. Results go to standard
+ * output or to -o FILE. Directories are checked recursively; see
+ * check_directory.
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status.
+ */
+int run_check(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
+    DictionaryReader snapshot(dictionary);
+
+    std::vector<std::string> inputs = options.inputs;
+    if (inputs.empty()) {
+        inputs.push_back("-");
+    }
+
+    std::ofstream output_file;
+    if (!options.output_filename.empty()) {
+        output_file.open(options.output_filename, std::ios::binary);
+        if (!output_file) {
+            std::cerr << "Error: could not open " << options.output_filename
+                      << std::endl;
+            return EXIT_USAGE;
+        }
+    }
+    std::ostream& out = output_file.is_open() ? output_file : std::cout;
+    ResultWriter writer(out, options.results, options.flush);
+    DirectoryReport report;
+    bool walked = false;
+
+    int status = EXIT_CLEAN;
+    for (const auto& input : inputs) {
+        struct stat info;
+        if (input != "-" && stat(input.c_str(), &info) == 0 &&
+            S_ISDIR(info.st_mode)) {
+            walked = true;
+            status = std::max(status, check_directory(input, *snapshot,
+                                                      options, writer,
+                                                      report));
+            continue;
+        }
+
+        std::string text;
+        if (!read_text(input, text)) {
+            return EXIT_USAGE;
+        }
+
+        ScopedArena arena;
+        for (const auto& misspelling :
+             find_misspellings(text, *snapshot, arena.resource())) {
+            writer.write(input, text, misspelling);
+            status = std::max(status, EXIT_MISSPELLED);
+        }
+    }
+
+    if (!writer.finish()) {
+        std::cerr << "Error: could not write results" << std::endl;
+        return EXIT_USAGE;
+    }
+    if (walked && options.metrics) {
+        std::cerr << directory_report(report, options.json_format)
+                  << (options.json_format ? "\n" : "");
+    }
+    return status;
+}
+
+/**
+ * The `suggest` subcommand. Prints "word -> correction" for each misspelled
+ * word given on the command line, or read from standard input when no words
+ * are given. Words without a suggestion are printed as "word -> ?".
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status.
+ */
+int run_suggest(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
+    DictionaryReader snapshot(dictionary);
+
+    std::vector<std::string> words = options.inputs;
+    if (words.empty()) {
+        std::string word;
+        while (std::cin >> word) {
+            words.push_back(word);
+        }
+    }
+
+    int status = EXIT_CLEAN;
+    std::string suggestion;
+    for (const auto& word : words) {
+        std::string stripped = strip_punctuation(word);
+        if (stripped.empty() || snapshot->contains(stripped)) {
+            continue;
+        }
+
+        status = EXIT_MISSPELLED;
+        suggestion_text(cached_suggestion(stripped, *snapshot), *snapshot,
+                        suggestion);
+        std::cout << word << " -> " << (suggestion.empty() ? "?" : suggestion)
+                  << "\n";
+    }
+
+    return status;
+}
+
+/**
+ * The `complete` subcommand. Prints "prefix -> word word ..." with the most
+ * frequent completions of each prefix given on the command line, or read
+ * from standard input when no prefixes are given. Prefixes without a
+ * completion are printed as "prefix -> ?".
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status; prefixes without a completion count as
+ * misspelled.
+ */
+int run_complete(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
+    DictionaryReader snapshot(dictionary);
+
+    std::vector<std::string> prefixes = options.inputs;
+    if (prefixes.empty()) {
+        std::string prefix;
+        while (std::cin >> prefix) {
+            prefixes.push_back(prefix);
+        }
+    }
+
+    int status = EXIT_CLEAN;
+    for (const auto& prefix : prefixes) {
+        auto completions = snapshot->complete(strip_punctuation(prefix),
+                                              options.completions);
+        std::cout << prefix << " ->";
+        if (completions.empty()) {
+            std::cout << " ?";
+            status = EXIT_MISSPELLED;
+        }
+        for (const auto& completion : completions) {
+            std::cout << " " << completion.word;
+        }
+        std::cout << "\n";
+    }
+
+    return status;
+}
+
+/**
+ * The `correct` subcommand. Applies the suggested correction to every
+ * misspelled word without prompting. Corrected text is written to standard
+ * output, to the file given with --output, or back over each input file with
+ * --in-place.
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status; misspellings that could not be corrected
+ * count as misspelled.
+ */
+int run_correct(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
+    DictionaryReader snapshot(dictionary);
+
+    std::vector<std::string> inputs = options.inputs;
+    if (inputs.empty()) {
+        inputs.push_back("-");
+    }
+    if (options.in_place && options.inputs.empty()) {
+        std::cerr << "Error: --in-place requires input files" << std::endl;
+        return EXIT_USAGE;
+    }
+
+    std::ofstream output_file;
+    if (!options.in_place && !options.output_filename.empty()) {
+        output_file.open(options.output_filename, std::ios::binary);
+        if (!output_file) {
+            std::cerr << "Error: could not open " << options.output_filename
+                      << std::endl;
+            return EXIT_USAGE;
+        }
+    }
+    std::ostream& out = output_file.is_open() ? output_file : std::cout;
+
+    int status = EXIT_CLEAN;
+    for (const auto& input : inputs) {
+        std::string text;
+        if (!read_text(input, text)) {
+            return EXIT_USAGE;
+        }
+
+        size_t uncorrected = 0;
+        std::string corrected_text =
+            correct_text(text, *snapshot, uncorrected);
+        if (uncorrected > 0) {
+            status = EXIT_MISSPELLED;
+        }
+
+        if (options.in_place) {
+            if (!write_back(input, corrected_text)) {
+                std::cerr << "Error: could not write " << input << std::endl;
+                return EXIT_USAGE;
+            }
+        } else {
+            METRIC_TIMER(PHASE_WRITE_BACK);
+            METRIC_COUNT(COUNTER_BYTES_WRITTEN, corrected_text.size());
+            out << corrected_text;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * The `compile-dict` subcommand. Loads a text dictionary, given as an input
+ * file or with --dictionary, and writes it in the compiled format to the
+ * file named with --output, with a perfect hash index if --perfect-hash is
+ * given or as a trie if --trie is.
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status.
+ */
+int run_compile_dict(const CommandOptions& options) {
+    if (options.output_filename.empty() || options.inputs.size() > 1) {
+        std::cerr << "Usage: SpellChecker compile-dict [words.txt] -o "
+                     "dictionary.bin"
+                  << std::endl;
+        return EXIT_USAGE;
+    }
+
+    CommandOptions load_options = options;
+    if (!options.inputs.empty()) {
+        load_options.dictionary_filename = options.inputs[0];
+    }
+
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(load_options, dictionary)) {
+        return EXIT_USAGE;
+    }
+
+    DictionaryReader snapshot(dictionary);
+    if (!save_compiled_dictionary(*snapshot, options.output_filename,
+                                  options.format)) {
+        return EXIT_USAGE;
+    }
+
+    std::cerr << "Compiled " << snapshot->size() << " words into "
+              << options.output_filename;
+    std::shared_ptr<const MappedDictionary> image =
+        MappedDictionary::open(options.output_filename);
+    if (image && image->indexed()) {
+        std::cerr << " with a " << image->index_bits_per_word()
+                  << " bits/word perfect hash index";
+    }
+    std::cerr << std::endl;
+    return EXIT_CLEAN;
+}
+
+/**
+ * Report the metrics of every thread followed by the size, memory use and
+ * lookup hits of each layer of the dictionary stack.
+ *
+ * @param dictionary The dictionary snapshot to describe.
+ * @param json True for a JSON object, false for human-readable text.
+ * @return The report.
+ */
+std::string stats_report(const DictionarySnapshot& dictionary, bool json) {
+    std::string report = metrics_report(json);
+    char line[256];
+
+    if (json) {
+        // Extend the metrics object with a list of layers.
+        report.pop_back();
+        report += ",\"layers\":[";
+    } else {
+        report += "Dictionary layers:\n";
+    }
+
+    for (size_t i = 0; i < dictionary.layers.size(); i++) {
+        const DictionaryLayer& layer = dictionary.layers[i];
+        const char* kind = layer.image  ? "mapped"
+                           : layer.trie ? "trie"
+                                        : "table";
+
+        if (json) {
+            report += i ? ",{\"name\":" : "{\"name\":";
+            append_json_string(report, layer.name);
+            std::snprintf(line, sizeof(line),
+                          ",\"kind\":\"%s\",\"words\":%zu,\"bytes\":%zu",
+                          kind, layer.size(), layer.memory_bytes());
+        } else {
+            report += "  [" + std::to_string(i) + "] " + layer.name;
+            std::snprintf(line, sizeof(line), " (%s): %zu words, %.1f KiB",
+                          kind, layer.size(), layer.memory_bytes() / 1024.0);
+        }
+        report += line;
+
+#if SPELLCHECK_METRICS
+        unsigned long long hits = layer.counters->hits.load();
+        std::snprintf(line, sizeof(line),
+                      json ? ",\"hits\":%llu" : ", %llu hits", hits);
+        report += line;
+#endif
+
+        if (layer.filter) {
+            unsigned long long rejections =
+                layer.counters->filter_rejections.load();
+            unsigned long long false_positives =
+                layer.counters->filter_false_positives.load();
+            uint64_t absent = rejections + false_positives;
+            double rate = absent ? double(false_positives) / absent : 0;
+            std::snprintf(
+                line, sizeof(line),
+                json ? ",\"filter\":{\"bits_per_key\":%.2f,"
+                       "\"rejections\":%llu,\"false_positives\":%llu,"
+                       "\"false_positive_rate\":%.4f}"
+                     : "; filter %.1f bits/key, %llu rejected, %llu false "
+                       "positives (%.2f%%)",
+                layer.filter->bits_per_key(), rejections, false_positives,
+                json ? rate : rate * 100);
+            report += line;
+        }
+        if (layer.grams) {
+            std::snprintf(line, sizeof(line),
+                          json ? ",\"grams\":{\"bytes_per_word\":%.2f}"
+                               : "; gram index %.1f bytes/word",
+                          layer.grams->bytes_per_word());
+            report += line;
+        }
+        if (layer.phonetic) {
+            std::snprintf(line, sizeof(line),
+                          json ? ",\"phonetic\":{\"bytes_per_word\":%.2f}"
+                               : "; phonetic index %.1f bytes/word",
+                          layer.phonetic->bytes_per_word());
+            report += line;
+        }
+        report += json ? "}" : "\n";
+    }
+
+    if (json) {
+        report += "]}";
+    }
+    return report;
+}
+
+// Set by the signal handler to stop the daemon's event loop.
+volatile std::sig_atomic_t stop_requested = 0;
+
+/**
+ * Signal handler that asks the daemon to shut down cleanly.
+ */
+void handle_stop_signal(int) { stop_requested = 1; }
+
+/**
+ * The state of one client connection to the daemon. Bytes are read into the
+ * input buffer until a whole frame has arrived, and responses are queued in
+ * the output buffer until the socket can take them. Events is the epoll
+ * mask the connection is registered with.
+ */
+struct DaemonConnection {
+    int fd;
+    std::string input;
+    std::string output;
+    size_t output_offset = 0;
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+
+    /**
+     * @return True if the connection's unsent responses are below the
+     * high-water mark, so it may read and answer more requests.
+     */
+    bool accepting() const {
+        return output.size() - output_offset < DAEMON_OUTPUT_HIGH_WATER;
+    }
+};
+
+/**
+ * Answer a single daemon request against the shared dictionary and cache.
+ *
+ * @param opcode The request opcode.
+ * @param body The request body.
+ * @param dictionary The dictionary snapshot to answer from.
+ * @param response The buffer to append the response frame to.
+ */
+void handle_daemon_request(uint8_t opcode, const std::string& body,
+                           const DictionarySnapshot& dictionary,
+                           std::string& response) {
+    ScopedArena arena;
+    std::string reply;
+
+    if (opcode == spell_protocol::OP_PING) {
+        spell_protocol::append_frame(response, spell_protocol::STATUS_OK,
+                                     reply);
+    } else if (opcode == spell_protocol::OP_CHECK) {
+        auto misspellings =
+            find_misspellings(body, dictionary, arena.resource());
+        spell_protocol::append_varint(reply, misspellings.size());
+        for (const auto& misspelling : misspellings) {
+            spell_protocol::append_varint(reply, misspelling.offset);
+            spell_protocol::append_varint(reply, misspelling.length);
+        }
+        spell_protocol::append_frame(response, spell_protocol::STATUS_OK,
+                                     reply);
+    } else if (opcode == spell_protocol::OP_SUGGEST) {
+        size_t pos = 0;
+        uint64_t count;
+        std::vector<std::string> words;
+        bool valid = spell_protocol::read_varint(body, pos, count) &&
+                     count <= body.size();
+        for (uint64_t i = 0; valid && i < count; i++) {
+            std::string word;
+            valid = spell_protocol::read_string(body, pos, word);
+            words.push_back(word);
+        }
+        if (!valid || pos != body.size()) {
+            spell_protocol::append_frame(
+                response, spell_protocol::STATUS_BAD_REQUEST, reply);
+            return;
+        }
+
+        spell_protocol::append_varint(reply, words.size());
+        std::pmr::string stripped(arena.resource());
+        std::string suggestion;
+        for (const auto& word : words) {
+            strip_punctuation(word, stripped);
+            if (dictionary.contains(stripped)) {
+                spell_protocol::append_string(reply, word);
+                continue;
+            }
+
+            suggestion_text(cached_suggestion(stripped, dictionary),
+                            dictionary, suggestion);
+            spell_protocol::append_string(reply, suggestion);
+        }
+        spell_protocol::append_frame(response, spell_protocol::STATUS_OK,
+                                     reply);
+    } else if (opcode == spell_protocol::OP_COMPLETE) {
+        size_t pos = 0;
+        uint64_t limit;
+        std::string prefix;
+        if (!spell_protocol::read_varint(body, pos, limit) ||
+            !spell_protocol::read_string(body, pos, prefix) ||
+            pos != body.size()) {
+            spell_protocol::append_frame(
+                response, spell_protocol::STATUS_BAD_REQUEST, reply);
+            return;
+        }
+
+        auto completions =
+            dictionary.complete(strip_punctuation(prefix),
+                                std::min<uint64_t>(limit, MAX_COMPLETIONS));
+        spell_protocol::append_varint(reply, completions.size());
+        for (const auto& completion : completions) {
+            spell_protocol::append_string(reply, completion.word);
+        }
+        spell_protocol::append_frame(response, spell_protocol::STATUS_OK,
+                                     reply);
+    } else if (opcode == spell_protocol::OP_STATS) {
+        bool json = body.empty() ||
+                    static_cast<uint8_t>(body[0]) != spell_protocol::STATS_TEXT;
+        spell_protocol::append_frame(response, spell_protocol::STATUS_OK,
+                                     stats_report(dictionary, json));
+    } else {
+        spell_protocol::append_frame(
+            response, spell_protocol::STATUS_BAD_REQUEST, reply);
+    }
+}
+
+/**
+ * Answer the complete request frames sitting in a connection's input buffer,
+ * stopping early once its unsent responses pass the high-water mark. Each
+ * request is answered against the dictionary snapshot that is current when
+ * it is read.
+ *
+ * @param connection The connection to process.
+ * @param dictionary The shared dictionary of words.
+ * @return False if the client sent a malformed frame and should be dropped.
+ */
+bool process_daemon_input(DaemonConnection& connection,
+                          const SharedDictionary& dictionary) {
+    size_t consumed = 0;
+    const std::string& input = connection.input;
+
+    while (input.size() - consumed >= spell_protocol::LENGTH_PREFIX_SIZE &&
+           connection.accepting()) {
+        uint32_t length = spell_protocol::frame_length(&input[consumed]);
+        if (length == 0 || length > spell_protocol::MAX_FRAME_SIZE) {
+            return false;
+        }
+        if (input.size() - consumed <
+            spell_protocol::LENGTH_PREFIX_SIZE + length) {
+            break;
+        }
+
+        size_t start = consumed + spell_protocol::LENGTH_PREFIX_SIZE;
+        uint8_t opcode = static_cast<uint8_t>(input[start]);
+        DictionaryReader snapshot(dictionary);
+        handle_daemon_request(opcode, input.substr(start + 1, length - 1),
+                              *snapshot, connection.output);
+        consumed = start + length;
+    }
+
+    connection.input.erase(0, consumed);
+    return true;
+}
+
+/**
+ * Write as much of a connection's queued output as the socket accepts
+ * without blocking.
+ *
+ * @param connection The connection to flush.
+ * @return False if the connection failed and should be dropped.
+ */
+bool flush_daemon_output(DaemonConnection& connection) {
+    while (connection.output_offset < connection.output.size()) {
+        ssize_t written =
+            send(connection.fd,
+                 connection.output.data() + connection.output_offset,
+                 connection.output.size() - connection.output_offset,
+                 MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.output_offset += written;
+    }
+
+    connection.output.clear();
+    connection.output_offset = 0;
+    return true;
+}
+
+/**
+ * Create the daemon's listening socket, replacing a stale socket file left
+ * behind by a previous run.
+ *
+ * @param socket_path The path to listen on.
+ * @return The listening file descriptor, or -1 on failure.
+ */
+int open_daemon_socket(const std::string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path is too long" << std::endl;
+        return -1;
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    struct stat existing;
+    if (stat(socket_path.c_str(), &existing) == 0 &&
+        S_ISSOCK(existing.st_mode)) {
+        unlink(socket_path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        std::cerr << "Error: could not listen on " << socket_path << ": "
+                  << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * The `serve` subcommand. Loads the dictionary once and answers check and
+ * suggest requests from any number of clients over a Unix domain socket.
+ * Connections are multiplexed with epoll on a single thread, so every client
+ * shares the same dictionary and the same warm suggestion cache. Runs until
+ * interrupted with SIGINT or SIGTERM.
+ *
+ * @param options The parsed command-line options.
+ * @return The process exit status.
+ */
+int run_serve(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
+
+    DictionaryWatcher watcher(dictionary, options.dictionary_filename);
+    if (options.watch && !watcher.start()) {
+        return EXIT_USAGE;
+    }
+
+    int listen_fd = open_daemon_socket(options.socket_path);
+    if (listen_fd < 0) {
+        return EXIT_USAGE;
+    }
+
+    // Interrupt epoll_wait on shutdown signals rather than restarting it, and
+    // report dead clients through send errors rather than SIGPIPE.
+    struct sigaction action = {};
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event listen_event = {};
+    listen_event.events = EPOLLIN;
+    listen_event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+
+    std::unordered_map<int, DaemonConnection> connections;
+    std::cerr << "Serving " << DictionaryReader(dictionary)->size()
+              << " words on " << options.socket_path << std::endl;
+
+    const int max_events = 64;
+    epoll_event events[max_events];
+    char buffer[64 * 1024];
+
+    while (!stop_requested) {
+        int ready = epoll_wait(epoll_fd, events, max_events, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error: epoll_wait: " << std::strerror(errno)
+                      << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listen_fd) {
+                int client_fd;
+                while ((client_fd = accept4(listen_fd, nullptr, nullptr,
+                                            SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+                       0) {
+                    epoll_event client_event = {};
+                    client_event.events = EPOLLIN | EPOLLRDHUP;
+                    client_event.data.fd = client_fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd,
+                              &client_event);
+                    connections[client_fd].fd = client_fd;
+                }
+                continue;
+            }
+
+            auto found = connections.find(fd);
+            if (found == connections.end()) {
+                continue;
+            }
+            DaemonConnection& connection = found->second;
+            bool keep = !(events[i].events & EPOLLERR);
+
+            // Read no further than one frame past what is buffered, and
+            // not at all while the client is behind on its answers.
+            bool hangup = events[i].events & (EPOLLRDHUP | EPOLLHUP);
+            if (keep && connection.accepting() &&
+                (hangup || (events[i].events & EPOLLIN))) {
+                while (connection.input.size() < DAEMON_INPUT_LIMIT) {
+                    ssize_t received = recv(
+                        fd, buffer,
+                        std::min(sizeof(buffer),
+                                 DAEMON_INPUT_LIMIT - connection.input.size()),
+                        0);
+                    if (received > 0) {
+                        connection.input.append(buffer, received);
+                        continue;
+                    }
+                    if (received < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (received == 0 ||
+                        (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                        keep = false;
+                    }
+                    break;
+                }
+            } else if (hangup) {
+                keep = false;
+            }
+
+            // Answer what has already arrived even if the client has since
+            // closed its end, then drop it. Requests held back by the
+            // high-water mark are answered as the output drains.
+            while (true) {
+                size_t buffered = connection.input.size();
+                if (!process_daemon_input(connection, dictionary) ||
+                    !flush_daemon_output(connection)) {
+                    keep = false;
+                    break;
+                }
+                if (connection.input.size() == buffered ||
+                    !connection.output.empty()) {
+                    break;
+                }
+            }
+
+            if (!keep) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                close(fd);
+                connections.erase(found);
+                continue;
+            }
+
+            // Only ask for writability while output is backed up, and for
+            // readability while the client keeps up with its answers.
+            uint32_t mask = EPOLLRDHUP;
+            if (connection.accepting()) {
+                mask |= EPOLLIN;
+            }
+            if (!connection.output.empty()) {
+                mask |= EPOLLOUT;
+            }
+            if (mask != connection.events) {
+                epoll_event client_event = {};
+                client_event.events = mask;
+                client_event.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &client_event);
+                connection.events = mask;
+            }
+        }
+    }
+
+    for (const auto& pair : connections) {
+        close(pair.first);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(options.socket_path.c_str());
+    std::cerr << "Daemon stopped." << std::endl;
+
+    return EXIT_CLEAN;
+}
+
+/**
+ * A parsed JSON value, as used by the language server. Objects keep their
+ * members in the order they were written.
+ */
+struct JsonValue {
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    /**
+     * Look up a member of an object.
+     *
+     * @param key The member name.
+     * @return The member, or a null value if this is not an object or the
+     * member is missing.
+     */
+    const JsonValue& operator[](const std::string& key) const {
+        static const JsonValue null_value;
+        for (const auto& member : object) {
+            if (member.first == key) {
+                return member.second;
+            }
+        }
+        return null_value;
+    }
+};
+
+/**
+ * Skip JSON whitespace.
+ *
+ * @param text The JSON text.
+ * @param pos The position to start at; advanced past the whitespace.
+ */
+void skip_json_whitespace(const std::string& text, size_t& pos) {
+    while (pos < text.size() &&
+           (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' ||
+            text[pos] == '\r')) {
+        pos++;
+    }
+}
+
+/**
+ * Parse four hexadecimal digits of a JSON \u escape.
+ *
+ * @param text The JSON text.
+ * @param pos The position of the first digit; advanced past the digits.
+ * @param value Receives the decoded value.
+ * @return True if four valid digits were found.
+ */
+bool parse_json_hex(const std::string& text, size_t& pos, uint32_t& value) {
+    if (text.size() - pos < 4) {
+        return false;
+    }
+
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = text[pos++];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse a JSON string literal.
+ *
+ * @param text The JSON text.
+ * @param pos The position of the opening quote; advanced past the string.
+ * @param value Receives the decoded string.
+ * @return True if a valid string was found.
+ */
+bool parse_json_string(const std::string& text, size_t& pos,
+                       std::string& value) {
+    if (pos >= text.size() || text[pos] != '"') {
+        return false;
+    }
+    pos++;
+
+    value.clear();
+    while (pos < text.size()) {
+        char c = text[pos++];
+        if (c == '"') {
+            return true;
+        }
+        if (c != '\\') {
+            value += c;
+            continue;
+        }
+        if (pos >= text.size()) {
+            return false;
+        }
+
+        char escape = text[pos++];
+        switch (escape) {
+            case '"':
+            case '\\':
+            case '/':
+                value += escape;
+                break;
+            case 'b':
+                value += '\b';
+                break;
+            case 'f':
+                value += '\f';
+                break;
+            case 'n':
+                value += '\n';
+                break;
+            case 'r':
+                value += '\r';
+                break;
+            case 't':
+                value += '\t';
+                break;
+            case 'u': {
+                uint32_t code_point;
+                if (!parse_json_hex(text, pos, code_point)) {
+                    return false;
+                }
+                // Combine a UTF-16 surrogate pair into one code point.
+                uint32_t low;
+                if (code_point >= 0xD800 && code_point < 0xDC00 &&
+                    text.compare(pos, 2, "\\u") == 0) {
+                    size_t low_pos = pos + 2;
+                    if (parse_json_hex(text, low_pos, low) && low >= 0xDC00 &&
+                        low < 0xE000) {
+                        code_point =
+                            0x10000 + ((code_point - 0xD800) << 10) +
+                            (low - 0xDC00);
+                        pos = low_pos;
+                    }
+                }
+                append_utf8(value, code_point);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Parse a JSON value.
+ *
+ * @param text The JSON text.
+ * @param pos The position to start at; advanced past the value.
+ * @param value Receives the parsed value.
+ * @return True if a valid value was found.
+ */
+bool parse_json(const std::string& text, size_t& pos, JsonValue& value) {
+    skip_json_whitespace(text, pos);
+    if (pos >= text.size()) {
+        return false;
+    }
+
+    char c = text[pos];
+    if (c == '{') {
+        value.type = JsonValue::OBJECT;
+        pos++;
+        skip_json_whitespace(text, pos);
+        if (pos < text.size() && text[pos] == '}') {
+            pos++;
+            return true;
+        }
+        while (true) {
+            std::string key;
+            JsonValue member;
+            skip_json_whitespace(text, pos);
+            if (!parse_json_string(text, pos, key)) {
+                return false;
+            }
+            skip_json_whitespace(text, pos);
+            if (pos >= text.size() || text[pos++] != ':' ||
+                !parse_json(text, pos, member)) {
+                return false;
+            }
+            value.object.emplace_back(std::move(key), std::move(member));
+            skip_json_whitespace(text, pos);
+            if (pos < text.size() && text[pos] == ',') {
+                pos++;
+            } else if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    } else if (c == '[') {
+        value.type = JsonValue::ARRAY;
+        pos++;
+        skip_json_whitespace(text, pos);
+        if (pos < text.size() && text[pos] == ']') {
+            pos++;
+            return true;
+        }
+        while (true) {
+            JsonValue element;
+            if (!parse_json(text, pos, element)) {
+                return false;
+            }
+            value.array.push_back(std::move(element));
+            skip_json_whitespace(text, pos);
+            if (pos < text.size() && text[pos] == ',') {
+                pos++;
+            } else if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    } else if (c == '"') {
+        value.type = JsonValue::STRING;
+        return parse_json_string(text, pos, value.string);
+    } else if (text.compare(pos, 4, "true") == 0) {
+        value.type = JsonValue::BOOLEAN;
+        value.boolean = true;
+        pos += 4;
+        return true;
+    } else if (text.compare(pos, 5, "false") == 0) {
+        value.type = JsonValue::BOOLEAN;
+        pos += 5;
+        return true;
+    } else if (text.compare(pos, 4, "null") == 0) {
+        value.type = JsonValue::NUL;
+        pos += 4;
+        return true;
+    }
+
+    const char* start = text.c_str() + pos;
+    char* end = nullptr;
+    value.type = JsonValue::NUMBER;
+    value.number = std::strtod(start, &end);
+    if (end == start) {
+        return false;
+    }
+    pos += end - start;
+    return true;
+}
+
+/**
+ * Append a string to a buffer as a quoted JSON string literal. JSON text
+ * must be valid UTF-8, so each byte that is not part of a valid UTF-8
+ * sequence, as in a file name or document in another encoding, is written
+ * as U+FFFD.
+ *
+ * @param out The buffer to append to.
+ * @param value The string to encode.
+ */
+void append_json_string(std::string& out, const std::string& value) {
+    out += '"';
+    for (size_t pos = 0; pos < value.size();) {
+        char c = value[pos];
+        if (static_cast<unsigned char>(c) >= 0x80) {
+            size_t start = pos;
+            uint32_t code_point;
+            if (decode_utf8(value, pos, code_point)) {
+                out.append(value, start, pos - start);
+            } else {
+                out += "\ufffd";
+            }
+            continue;
+        }
+        pos++;
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escape[8];
+                    std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                    out += escape;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+/**
+ * Turn a file path into a relative or absolute URI reference by
+ * percent-encoding every byte other than the unreserved characters and the
+ * slashes between path segments.
+ *
+ * @param path The path.
+ * @return The URI reference.
+ */
+std::string path_to_uri(std::string_view path) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+    std::string uri;
+    uri.reserve(path.size());
+    for (char c : path) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (std::isalnum(byte) || c == '-' || c == '.' || c == '_' ||
+            c == '~' || c == '/') {
+            uri += c;
+        } else {
+            uri += '%';
+            uri += HEX_DIGITS[byte >> 4];
+            uri += HEX_DIGITS[byte & 0xF];
+        }
+    }
+    return uri;
+}
+
+/**
+ * Append a JSON value to a buffer. Only the value types that appear in
+ * request ids need to round-trip: numbers, strings and null.
+ *
+ * @param out The buffer to append to.
+ * @param value The value to encode.
+ */
+void append_json_id(std::string& out, const JsonValue& value) {
+    if (value.type == JsonValue::STRING) {
+        append_json_string(out, value.string);
+    } else if (value.type == JsonValue::NUMBER) {
+        std::ostringstream number;
+        number.precision(17);
+        number << value.number;
+        out += number.str();
+    } else {
+        out += "null";
+    }
+}
+
+/**
+ * Convert a UTF-16 character offset, as used by LSP positions, into a byte
+ * offset within a UTF-8 line. Offsets past the end of the line are clamped.
+ *
+ * @param line The line of text.
+ * @param character The UTF-16 offset.
+ * @return The corresponding byte offset.
+ */
+size_t utf16_to_byte_offset(const std::string& line, size_t character) {
+    size_t byte = 0;
+    size_t units = 0;
+    while (byte < line.size() && units < character) {
+        unsigned char c = line[byte];
+        size_t length = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        units += length == 4 ? 2 : 1;
+        byte = std::min(line.size(), byte + length);
+    }
+    return byte;
+}
+
+/**
+ * Convert a byte offset within a UTF-8 line into a UTF-16 character offset.
+ *
+ * @param line The line of text.
+ * @param byte The byte offset.
+ * @return The corresponding UTF-16 offset.
+ */
+size_t byte_to_utf16_offset(const std::string& line, size_t byte) {
+    size_t units = 0;
+    for (size_t i = 0; i < byte && i < line.size(); i++) {
+        unsigned char c = line[i];
+        if ((c & 0xC0) != 0x80) {
+            units += c >= 0xF0 ? 2 : 1;
+        }
+    }
+    return units;
+}
+
+/**
+ * Split text into lines. Both "\n" and "\r\n" end a line, and the line
+ * terminators are not kept. Text without a trailing newline still ends with
+ * a (possibly empty) last line, matching how editors number lines.
+ *
+ * @param text The text to split.
+ * @return The lines of the text.
+ */
+std::vector<std::string> split_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) {
+            lines.push_back(text.substr(start));
+            return lines;
+        }
+        size_t length = end - start;
+        if (length > 0 && text[end - 1] == '\r') {
+            length--;
+        }
+        lines.push_back(text.substr(start, length));
+        start = end + 1;
+    }
+}
+
+/**
+ * A misspelling diagnostic on one line of a document. The line number is not
+ * stored, so diagnostics stay valid when an edit above them shifts lines.
+ */
+struct LspDiagnostic {
+    size_t start;
+    size_t end;
+    std::string message;
+};
+
+/**
+ * An open document tracked by the language server. Each line keeps the
+ * diagnostics for its misspellings, so an edit only has to re-check the
+ * lines it touched and publishing just serializes the cached results.
+ */
+struct LspDocument {
+    std::vector<std::string> lines;
+    std::vector<std::vector<LspDiagnostic>> line_diagnostics;
+};
+
+/**
+ * Spell check one line of a document and build a diagnostic for each
+ * misspelling, including the suggested correction when there is one.
+ *
+ * @param line The text of the line.
+ * @param dictionary The dictionary snapshot to check against.
+ * @return The diagnostics for the line.
+ */
+std::vector<LspDiagnostic> check_lsp_line(
+    const std::string& line,
+    const DictionarySnapshot& dictionary) {
+    ScopedArena arena;
+    std::vector<LspDiagnostic> diagnostics;
+    std::string suggestion;
+
+    for (const auto& misspelling :
+         find_misspellings(line, dictionary, arena.resource())) {
+        std::string word = line.substr(misspelling.offset, misspelling.length);
+        std::string message = "Unknown word \"" + word + "\".";
+        suggestion_text(cached_suggestion(misspelling.word, dictionary),
+                        dictionary, suggestion);
+        if (!suggestion.empty()) {
+            message +=
+                " Did you mean \"" + match_case(word, suggestion) + "\"?";
+        }
+
+        diagnostics.push_back(
+            {byte_to_utf16_offset(line, misspelling.offset),
+             byte_to_utf16_offset(line,
+                                  misspelling.offset + misspelling.length),
+             message});
+    }
+
+    return diagnostics;
+}
+
+/**
+ * Re-check a run of lines in a document.
+ *
+ * @param document The document to update.
+ * @param first The first line to re-check.
+ * @param count The number of lines to re-check.
+ * @param dictionary The dictionary snapshot to check against.
+ */
+void recheck_lsp_lines(LspDocument& document, size_t first, size_t count,
+                       const DictionarySnapshot& dictionary) {
+    for (size_t i = first; i < first + count; i++) {
+        document.line_diagnostics[i] =
+            check_lsp_line(document.lines[i], dictionary);
+    }
+}
+
+/**
+ * Apply one incremental edit to a document and re-check only the lines the
+ * edit produced. Every other line keeps its cached diagnostics, even when the
+ * edit changes the number of lines.
+ *
+ * @param document The document to edit.
+ * @param range The LSP range being replaced.
+ * @param text The replacement text.
+ * @param dictionary The dictionary snapshot to check against.
+ */
+void apply_lsp_edit(LspDocument& document, const JsonValue& range,
+                    const std::string& text,
+                    const DictionarySnapshot& dictionary) {
+    size_t line_count = document.lines.size();
+    size_t start_line = std::min<size_t>(range["start"]["line"].number,
+                                         line_count - 1);
+    size_t end_line =
+        std::min<size_t>(range["end"]["line"].number, line_count - 1);
+    end_line = std::max(start_line, end_line);
+
+    const std::string& first = document.lines[start_line];
+    const std::string& last = document.lines[end_line];
+    size_t start_byte =
+        utf16_to_byte_offset(first, range["start"]["character"].number);
+    size_t end_byte =
+        utf16_to_byte_offset(last, range["end"]["character"].number);
+
+    std::vector<std::string> replacement = split_lines(text);
+    replacement.front().insert(0, first, 0, start_byte);
+    replacement.back().append(last, end_byte, std::string::npos);
+
+    size_t removed = end_line - start_line + 1;
+    size_t added = replacement.size();
+
+    document.lines.erase(document.lines.begin() + start_line,
+                         document.lines.begin() + start_line + removed);
+    document.lines.insert(document.lines.begin() + start_line,
+                          replacement.begin(), replacement.end());
+    document.line_diagnostics.erase(
+        document.line_diagnostics.begin() + start_line,
+        document.line_diagnostics.begin() + start_line + removed);
+    document.line_diagnostics.insert(
+        document.line_diagnostics.begin() + start_line, added,
+        std::vector<LspDiagnostic>());
+
+    recheck_lsp_lines(document, start_line, added, dictionary);
+}
+
+/**
+ * Write a JSON-RPC message to standard output with its LSP header.
+ *
+ * @param body The JSON message.
+ */
+void send_lsp_message(const std::string& body) {
+    std::cout << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    std::cout.flush();
+}
+
+/**
+ * Send a successful JSON-RPC response.
+ *
+ * @param id The id of the request being answered.
+ * @param result The JSON result.
+ */
+void send_lsp_result(const JsonValue& id, const std::string& result) {
+    std::string body = "{\"jsonrpc\":\"2.0\",\"id\":";
+    append_json_id(body, id);
+    body += ",\"result\":" + result + "}";
+    send_lsp_message(body);
+}
+
+/**
+ * Publish the diagnostics of a document to the client.
+ *
+ * @param uri The document URI.
+ * @param document The document.
+ */
+void publish_lsp_diagnostics(const std::string& uri,
+                             const LspDocument& document) {
+    std::string body =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/"
+        "publishDiagnostics\",\"params\":{\"uri\":";
+    append_json_string(body, uri);
+    body += ",\"diagnostics\":[";
+
+    bool first = true;
+    for (size_t line = 0; line < document.line_diagnostics.size(); line++) {
+        for (const auto& diagnostic : document.line_diagnostics[line]) {
+            std::string number = std::to_string(line);
+            body += first ? "" : ",";
+            body += "{\"range\":{\"start\":{\"line\":" + number +
+                    ",\"character\":" + std::to_string(diagnostic.start) +
+                    "},\"end\":{\"line\":" + number +
+                    ",\"character\":" + std::to_string(diagnostic.end) +
+                    "}},\"severity\":3,\"source\":\"SpellChecker\","
+                    "\"message\":";
+            append_json_string(body, diagnostic.message);
+            body += "}";
+            first = false;
+        }
+    }
+    body += "]}}";
+    send_lsp_message(body);
+}
+
+/**
+ * Take one LSP message from the front of the input read so far.
+ *
+ * @param input The bytes read from standard input; a complete message is
+ * removed from the front.
+ * @param body Receives the JSON body of the message.
+ * @return False if the input does not yet hold a complete message.
+ */
+bool take_lsp_message(std::string& input, std::string& body) {
+    size_t content_length = 0;
+    bool has_length = false;
+    size_t pos = 0;
+
+    while (true) {
+        size_t end = input.find('\n', pos);
+        if (end == std::string::npos) {
+            return false;
+        }
+        std::string_view header(input.data() + pos, end - pos);
+        pos = end + 1;
+        if (!header.empty() && header.back() == '\r') {
+            header.remove_suffix(1);
+        }
+        if (header.empty()) {
+            if (!has_length) {
+                continue;
+            }
+            if (input.size() - pos < content_length) {
+                return false;
+            }
+            body.assign(input, pos, content_length);
+            input.erase(0, pos + content_length);
+            return true;
+        }
+
+        const std::string_view name = "Content-Length:";
+        if (header.substr(0, name.size()) == name) {
+            content_length = std::strtoul(
+                std::string(header.substr(name.size())).c_str(), nullptr, 10);
+            has_length = true;
+        }
+    }
+}
+
+/**
+ * Read whatever standard input has available onto the end of a buffer.
+ *
+ * @param input The buffer to append to.
+ * @return False at end of input or on a read error.
+ */
+bool read_lsp_input(std::string& input) {
+    char buffer[65536];
+    while (true) {
+        ssize_t received = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (received > 0) {
+            input.append(buffer, received);
+            return true;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        return false;
+    }
+}
 
 /**
- * Implementation of the Levenshtein distance algorithm to calculate the
- * minimum number of single-character edits (insertions, deletions, or
- * substitutions) required to change one word into another.
+ * The `lsp` subcommand. Runs a Language Server Protocol server over standard
+ * input and output that publishes a diagnostic for every misspelled word in
+ * open documents. Documents are synchronized incrementally, and each change
+ * re-checks only the lines it touched. With --watch, every open document is
+ * re-checked and republished after the dictionary is reloaded.
  *
- * @param word1 The first word.
- * @param word2 The second word.
- * @return The Levenshtein distance between the two words.
- * @see https://en.wikipedia.org/wiki/Levenshtein_distance
+ * @param options The parsed command-line options.
+ * @return The process exit status.
  */
-int levenshtein_distance(const std::string& word1, const std::string& word2) {
-    // Create a 2D array to store the distances between prefixes of the two
-    // words.
-    std::vector<std::vector<int>> distances(word1.size() + 1,
-                                            std::vector<int>(word2.size() + 1));
+int run_lsp(const CommandOptions& options) {
+    SharedDictionary dictionary;
+    if (!load_command_dictionary(options, dictionary)) {
+        return EXIT_USAGE;
+    }
 
-    // Initialize the first row and column of the array with the distances from
-    // the empty string to each prefix of the words.
-    for (int i = 0; i <= word1.size(); i++) {
-        distances[i][0] = i;
+    // Standard input is read directly rather than through std::cin so the
+    // server can wait for a message and a reload at the same time.
+    int reload_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reload_fd < 0) {
+        std::cerr << "Error: eventfd: " << std::strerror(errno) << std::endl;
+        return EXIT_USAGE;
     }
-    for (int j = 0; j <= word2.size(); j++) {
-        distances[0][j] = j;
+    DictionaryWatcher watcher(dictionary, options.dictionary_filename);
+    watcher.notify(reload_fd);
+    if (options.watch && !watcher.start()) {
+        close(reload_fd);
+        return EXIT_USAGE;
     }
 
-    // Calculate the minimum distance between prefixes of the words.
-    for (int i = 1; i <= word1.size(); i++) {
-        for (int j = 1; j <= word2.size(); j++) {
-            if (word1[i - 1] == word2[j - 1]) {
-                distances[i][j] = distances[i - 1][j - 1];
-            } else {
-                distances[i][j] =
-                    1 + std::min({distances[i - 1][j], distances[i][j - 1],
-                                  distances[i - 1][j - 1]});
+    std::unordered_map<std::string, LspDocument> documents;
+    bool shutdown_requested = false;
+    bool input_open = true;
+    std::string input;
+    std::string body;
+
+    while (true) {
+        if (!take_lsp_message(input, body)) {
+            if (!input_open) {
+                break;
+            }
+            pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0},
+                             {reload_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error: poll: " << std::strerror(errno)
+                          << std::endl;
+                break;
+            }
+
+            if (fds[1].revents & POLLIN) {
+                uint64_t reloads = 0;
+                ssize_t drained = read(reload_fd, &reloads, sizeof(reloads));
+                (void)drained;
+                DictionaryReader snapshot(dictionary);
+                for (auto& entry : documents) {
+                    LspDocument& document = entry.second;
+                    recheck_lsp_lines(document, 0, document.lines.size(),
+                                      *snapshot);
+                    publish_lsp_diagnostics(entry.first, document);
+                }
+            }
+            if (fds[0].revents) {
+                input_open = read_lsp_input(input);
+            }
+            continue;
+        }
+
+        JsonValue message;
+        size_t pos = 0;
+        if (!parse_json(body, pos, message)) {
+            std::cerr << "Error: ignoring malformed LSP message" << std::endl;
+            continue;
+        }
+
+        const std::string& method = message["method"].string;
+        const JsonValue& id = message["id"];
+        const JsonValue& params = message["params"];
+        const JsonValue& text_document = params["textDocument"];
+        const std::string& uri = text_document["uri"].string;
+        DictionaryReader snapshot(dictionary);
+
+        if (method == "initialize") {
+            send_lsp_result(
+                id,
+                "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,"
+                "\"change\":2}},\"serverInfo\":{\"name\":\"SpellChecker\"}}");
+        } else if (method == "shutdown") {
+            shutdown_requested = true;
+            send_lsp_result(id, "null");
+        } else if (method == "exit") {
+            break;
+        } else if (method == "textDocument/didOpen") {
+            LspDocument& document = documents[uri];
+            document.lines = split_lines(text_document["text"].string);
+            document.line_diagnostics.assign(document.lines.size(),
+                                             std::vector<LspDiagnostic>());
+            recheck_lsp_lines(document, 0, document.lines.size(), *snapshot);
+            publish_lsp_diagnostics(uri, document);
+        } else if (method == "textDocument/didChange") {
+            auto found = documents.find(uri);
+            if (found == documents.end()) {
+                continue;
+            }
+            LspDocument& document = found->second;
+
+            for (const auto& change : params["contentChanges"].array) {
+                if (change["range"].type == JsonValue::OBJECT) {
+                    apply_lsp_edit(document, change["range"],
+                                   change["text"].string, *snapshot);
+                } else {
+                    document.lines = split_lines(change["text"].string);
+                    document.line_diagnostics.assign(
+                        document.lines.size(), std::vector<LspDiagnostic>());
+                    recheck_lsp_lines(document, 0, document.lines.size(),
+                                      *snapshot);
+                }
             }
+            publish_lsp_diagnostics(uri, document);
+        } else if (method == "textDocument/didClose") {
+            documents.erase(uri);
+            std::string clear =
+                "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/"
+                "publishDiagnostics\",\"params\":{\"uri\":";
+            append_json_string(clear, uri);
+            clear += ",\"diagnostics\":[]}}";
+            send_lsp_message(clear);
+        } else if (id.type != JsonValue::NUL) {
+            std::string error = "{\"jsonrpc\":\"2.0\",\"id\":";
+            append_json_id(error, id);
+            error +=
+                ",\"error\":{\"code\":-32601,\"message\":\"Method not "
+                "found\"}}";
+            send_lsp_message(error);
         }
     }
 
-    // The Levenshtein distance is the value in the bottom-right corner of the
-    // array.
-    return distances[word1.size()][word2.size()];
+    watcher.stop();
+    close(reload_fd);
+    return shutdown_requested ? EXIT_CLEAN : EXIT_MISSPELLED;
 }
 
 /**
- * Load a dictionary of words from a file into a hash table.
- *
- * @param filename The name of the file containing the dictionary.
- * @return A hash table containing the words from the dictionary.
+ * The timings of one benchmark phase. Each sample is one repetition of the
+ * phase; items is the number of words the phase processes per repetition.
+ * Allocations is the mean number of heap allocations per repetition, or -1
+ * when built without metrics.
  */
-std::unordered_map<std::string, bool> load_dictionary(
-    const std::string& filename) {
-    std::unordered_map<std::string, bool> dictionary(100);
-    std::ifstream file;
-
-    file.open(filename);
-    if (!file) {
-        std::cerr << "Error: could not open " << filename << std::endl;
-        return dictionary;
-    }
-
-    std::string word;
-    while (file >> word) {
-        dictionary[word] = true;
-    }
+struct BenchPhase {
+    std::string name;
+    size_t items;
+    std::vector<double> samples;
+    double allocations = -1;
+};
 
-    file.close();
+/**
+ * The results of benchmarking one dictionary and text. The filter fields
+ * are 0 when the dictionary has no membership filter; the false positive
+ * rate is measured over the misspelled words of the text.
+ */
+struct BenchCase {
+    std::string label;
+    size_t dictionary_words;
+    size_t text_words;
+    size_t misspelled;
+    std::vector<BenchPhase> phases;
+    double filter_bits_per_key = 0;
+    double filter_false_positive_rate = 0;
+};
 
-    return dictionary;
+/**
+ * Time a single call of a function.
+ *
+ * @param fn The function to time.
+ * @return The elapsed wall-clock time in milliseconds.
+ */
+template <typename Function>
+double time_ms(Function fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
 }
 
 /**
- * Add a new word to the dictionary stored in the hash table.
+ * Run a benchmark phase: a number of untimed warm-up calls followed by the
+ * timed repetitions. The reset function runs before every call, outside the
+ * timed region.
  *
- * @param dictionary The hash table containing the dictionary of words.
+ * @param name The name of the phase.
+ * @param items The number of words processed by each call.
+ * @param options The parsed command-line options.
+ * @param reset Restores any state the phase depends on.
+ * @param fn The function to time.
+ * @return The phase and its samples.
  */
-void add_word_to_dictionary(std::unordered_map<std::string, bool>& dictionary) {
-    std::string new_word;
+template <typename Reset, typename Function>
+BenchPhase measure_phase(const std::string& name, size_t items,
+                         const CommandOptions& options, Reset reset,
+                         Function fn) {
+    BenchPhase phase = {name, items, {}};
 
-    std::cout << "Enter the word to add to the dictionary: ";
-    std::getline(std::cin, new_word);
+    for (int i = 0; i < options.warmup; i++) {
+        reset();
+        fn();
+    }
+#if SPELLCHECK_METRICS
+    uint64_t allocations = 0;
+#endif
+    for (int i = 0; i < options.repeat; i++) {
+        reset();
+#if SPELLCHECK_METRICS
+        uint64_t before = heap_allocations;
+        double sample = time_ms(fn);
+        allocations += heap_allocations - before;
+        phase.samples.push_back(sample);
+#else
+        phase.samples.push_back(time_ms(fn));
+#endif
+    }
+#if SPELLCHECK_METRICS
+    phase.allocations = options.repeat ? double(allocations) / options.repeat
+                                       : 0;
+#endif
 
-    auto result = dictionary.insert({new_word, true});
+    return phase;
+}
 
-    if (result.second) {
-        std::cout << "Word added successfully." << std::endl;
-    } else {
-        std::cout << "Word already exists in the dictionary." << std::endl;
-    }
+/**
+ * Look up a percentile in a set of samples using the nearest-rank method.
+ *
+ * @param samples The samples.
+ * @param percentile The percentile to find, between 0 and 100.
+ * @return The sample at that percentile.
+ */
+double percentile(std::vector<double> samples, double percentile) {
+    std::sort(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(
+        std::ceil(percentile / 100 * samples.size()));
+    return samples[std::max<size_t>(rank, 1) - 1];
 }
 
 /**
- * Take a string of text as input and check each word in the text against the
- * words in the dictionary stored in the hash table. Identify any words that
- * are not found in the dictionary and display them as "mispelled".
+ * Generate a list of distinct pronounceable words, alternating consonant and
+ * vowel runs, with lengths between 3 and 12 letters. The same seed always
+ * produces the same list.
  *
- * @param text The string of text to check.
- * @param dictionary The hash table containing the dictionary of words.
- * @return A vector of misspelled words.
+ * @param count The number of words to generate.
+ * @param rng The random number generator to use.
+ * @return The generated words.
  */
-std::vector<std::string> spell_check(
-    const std::string& text,
-    const std::unordered_set<std::string>& dictionary) {
-    std::vector<std::string> misspelled;
-    std::string word;
-    std::string current_word;
-    std::istringstream textStream(text);
+std::vector<std::string> generate_words(size_t count, std::mt19937& rng) {
+    const std::string consonants = "bcdfghjklmnprstvwyz";
+    const std::string vowels = "aeiou";
+    std::uniform_int_distribution<int> length_distribution(3, 12);
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> words;
+    words.reserve(count);
+    seen.reserve(count);
 
-    while (textStream >> word) {
-        if (dictionary.find(word) == dictionary.end()) {
-            misspelled.push_back(word);
+    while (words.size() < count) {
+        int length = length_distribution(rng);
+        std::string word;
+        bool vowel = rng() % 2;
+        while (int(word.size()) < length) {
+            const std::string& letters = vowel ? vowels : consonants;
+            word += letters[rng() % letters.size()];
+            vowel = !vowel;
+        }
+        if (seen.insert(word).second) {
+            words.push_back(word);
         }
     }
 
-    return misspelled;
+    return words;
 }
 
 /**
- * ----------------------------------------------------------------------------
- * DEPRECATED: Replaced by suggest_corrections_cached.
- * ----------------------------------------------------------------------------
- *
- * Based off of a vector of mispelled words and a dictionary stored in a
- * hash table, suggest a correction for each misspelled word using the
- * Levenshtein distance algorithm. Only include words that are likely
- * to be mispelled and have a distance that is related to the size
- * of the word.
+ * Damage a word with a single random insertion, deletion or substitution.
  *
- * @param misspelled A vector of misspelled words.
- * @param dictionary The hash table containing the dictionary of words.
- * @return A vector of pairs, where each pair contains a misspelled word and
- *         its suggested correction.
+ * @param word The word to damage.
+ * @param rng The random number generator to use.
+ * @return The damaged word.
  */
-std::vector<std::pair<std::string, std::string>> suggest_corrections(
-    const std::vector<std::string>& misspelled,
-    const std::unordered_set<std::string>& dictionary) {
-    std::vector<std::pair<std::string, std::string>> corrections;
-
-    for (const auto& word : misspelled) {
-        std::string best_match;
-        int best_distance = std::numeric_limits<int>::max();
+std::string misspell_word(std::string word, std::mt19937& rng) {
+    size_t pos = rng() % word.size();
+    switch (rng() % 3) {
+        case 0:
+            if (word.size() > 1) {
+                word.erase(pos, 1);
+                break;
+            }
+            // Fall through for single letters, which cannot lose one.
+            [[fallthrough]];
+        case 1:
+            word.insert(pos, 1, static_cast<char>('a' + rng() % 26));
+            break;
+        default:
+            word[pos] = static_cast<char>('a' + (word[pos] - 'a' + 1 +
+                                                 rng() % 25) % 26);
+            break;
+    }
+    return word;
+}
 
-        for (const auto& entry : dictionary) {
-            int distance = levenshtein_distance(word, entry);
+/**
+ * Generate a text of dictionary words in which a controlled fraction of the
+ * words is misspelled. Misspellings are guaranteed not to be dictionary
+ * words.
+ *
+ * @param words The dictionary words to draw from.
+ * @param word_set The same words as a set.
+ * @param count The number of words in the text.
+ * @param misspell_rate The fraction of words to misspell.
+ * @param rng The random number generator to use.
+ * @return The generated text, ten words per line.
+ */
+std::string generate_text(const std::vector<std::string>& words,
+                          const std::unordered_set<std::string>& word_set,
+                          size_t count, double misspell_rate,
+                          std::mt19937& rng) {
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::string text;
 
-            if (distance < best_distance) {
-                best_distance = distance;
-                best_match = entry;
+    for (size_t i = 0; i < count; i++) {
+        std::string word = words[rng() % words.size()];
+        if (unit(rng) < misspell_rate) {
+            std::string misspelled = misspell_word(word, rng);
+            while (word_set.count(misspelled)) {
+                misspelled = misspell_word(word, rng);
             }
+            word = misspelled;
         }
-
-        if (best_distance <= 2 && !best_match.empty()) {
-            corrections.push_back({word, best_match});
-        }
+        text += word;
+        text += (i % 10 == 9) ? '\n' : ' ';
     }
 
-    return corrections;
+    return text;
 }
 
-std::vector<std::pair<std::string, std::string>> suggest_corrections_cached(
-    const std::vector<std::string>& misspelled,
-    const std::unordered_set<std::string>& dictionary) {
-    std::vector<std::pair<std::string, std::string>> corrections;
+/**
+ * Benchmark every phase against one dictionary file and text: loading the
+ * dictionary, spell checking the text, and generating suggestions for the
+ * misspelled words with the uncached function and with the cached one, both
+ * from an empty cache and from a warm one.
+ *
+ * @param label A name for the case.
+ * @param dictionary_filename The dictionary file to load.
+ * @param text The text to check.
+ * @param options The parsed command-line options.
+ * @param result Receives the results.
+ * @return True if the dictionary could be loaded.
+ */
+bool run_bench_case(const std::string& label,
+                    const std::string& dictionary_filename,
+                    const std::string& text, const CommandOptions& options,
+                    BenchCase& result) {
+    auto no_reset = [] {};
+    std::unordered_map<std::string, uint8_t> words;
+    BenchPhase load = measure_phase(
+        "load_dictionary", 0, options, no_reset,
+        [&] { words = load_dictionary(dictionary_filename); });
+    if (words.empty()) {
+        std::cerr << "Failed to load dictionary." << std::endl;
+        return false;
+    }
+    load.items = words.size();
+    SharedDictionary dictionary;
+    dictionary.replace(make_dictionary_layer(label, words));
+    DictionaryReader snapshot(dictionary);
 
-    for (const auto& word : misspelled) {
-        // Check if the word is already in the cache.
-        auto cached = cache.find(word);
-        if (cached != cache.end()) {
-            corrections.push_back({word, cached->second});
-            continue;
+    size_t text_words = tokenize(text).size();
+    auto found = spell_check(text, *snapshot);
+    std::vector<std::string> misspelled(found.begin(), found.end());
+    size_t sample_size = std::min(misspelled.size(), options.suggest_words);
+    std::vector<std::string> sample(misspelled.begin(),
+                                    misspelled.begin() + sample_size);
+
+    result = {label, snapshot->size(), text_words, misspelled.size(), {}};
+    const DictionaryLayer& layer = snapshot->layers.front();
+    if (layer.filter && !misspelled.empty()) {
+        size_t passed = 0;
+        for (const auto& word : misspelled) {
+            passed += layer.filter->may_contain(word);
         }
+        result.filter_bits_per_key = layer.filter->bits_per_key();
+        result.filter_false_positive_rate = double(passed) / misspelled.size();
+    }
+    result.phases.push_back(load);
+    result.phases.push_back(
+        measure_phase("spell_check", text_words, options, no_reset,
+                      [&] { spell_check(text, *snapshot); }));
 
-        // If the word is not in the cache, find the best match in the
-        // dictionary and add it to the cache.
-        for (const auto& entry : dictionary) {
-            int distance = levenshtein_distance(word, entry);
+    // The same document checked with its temporaries on the heap and in a
+    // request arena, to show the allocations the arena saves.
+    result.phases.push_back(
+        measure_phase("find_misspellings (heap)", text_words, options,
+                      no_reset, [&] { find_misspellings(text, *snapshot); }));
+    result.phases.push_back(measure_phase(
+        "find_misspellings (arena)", text_words, options, no_reset, [&] {
+            ScopedArena arena;
+            find_misspellings(text, *snapshot, arena.resource());
+        }));
+    result.phases.push_back(
+        measure_phase("suggest_corrections", sample.size(), options, no_reset,
+                      [&] { suggest_corrections(sample, *snapshot); }));
+    result.phases.push_back(measure_phase(
+        "suggest_corrections_cached (cold)", sample.size(), options,
+        [] { purge_cache(); },
+        [&] { suggest_corrections_cached(sample, *snapshot); }));
+    result.phases.push_back(measure_phase(
+        "suggest_corrections_cached (warm)", sample.size(), options, no_reset,
+        [&] { suggest_corrections_cached(sample, *snapshot); }));
+    purge_cache();
 
-            if (distance <= 2) {
-                cache[word] = entry;
-                corrections.push_back({word, entry});
-                break;
-            }
+    // Complete the first one to three letters of the sampled words, the
+    // short prefixes that match the most words.
+    std::vector<std::string> prefixes;
+    for (const auto& word : sample) {
+        for (size_t length = 1; length <= 3 && length <= word.size();
+             length++) {
+            prefixes.push_back(word.substr(0, length));
         }
     }
+    result.phases.push_back(
+        measure_phase("complete", prefixes.size(), options, no_reset, [&] {
+            for (const auto& prefix : prefixes) {
+                snapshot->complete(prefix, DEFAULT_COMPLETIONS);
+            }
+        }));
 
-    return corrections;
+    return true;
 }
 
 /**
- * Print the results of the spell check, including the misspelled words and
- * their suggested corrections.
+ * Print the results of a benchmark case as a table.
  *
- * @param misspelled A vector of misspelled words.
- * @param corrections A vector of pairs, where each pair contains a
- * misspelled word and its suggested correction.
+ * @param result The results to print.
  */
-void print_results(
-    const std::vector<std::string>& misspelled,
-    const std::vector<std::pair<std::string, std::string>>& corrections) {
-    std::cout << "\n";
+void print_bench_case(const BenchCase& result) {
+    std::cout << "\n" << result.label << ": " << result.dictionary_words
+              << " dictionary words, " << result.text_words
+              << " text words, " << result.misspelled << " misspelled\n";
 
-    if (misspelled.empty()) {
-        std::cout << "No misspelled words found." << std::endl;
-    } else {
-        std::cout << "Misspelled words:" << std::endl;
-        for (const auto& word : misspelled) {
-            std::cout << word << std::endl;
-        }
+    char line[160];
+    std::snprintf(line, sizeof(line),
+                  "  %-36s %10s %10s %10s %10s %12s %12s\n", "phase (ms)",
+                  "min", "p50", "p90", "max", "us/item", "allocs/call");
+    std::cout << line;
+
+    for (const auto& phase : result.phases) {
+        double p50 = percentile(phase.samples, 50);
+        std::snprintf(
+            line, sizeof(line),
+            "  %-36s %10.3f %10.3f %10.3f %10.3f %12.3f %12.1f\n",
+            phase.name.c_str(), percentile(phase.samples, 0),
+            p50, percentile(phase.samples, 90),
+            percentile(phase.samples, 100),
+            phase.items ? p50 * 1000 / phase.items : 0.0,
+            phase.allocations);
+        std::cout << line;
     }
 
-    if (!corrections.empty()) {
-        std::cout << "Corrections:" << std::endl;
-        for (const auto& correction : corrections) {
-            std::cout << correction.first << " -> " << correction.second
-                      << std::endl;
-        }
+    if (result.filter_bits_per_key > 0) {
+        std::snprintf(line, sizeof(line),
+                      "  membership filter: %.1f bits/key, %.2f%% false "
+                      "positives\n",
+                      result.filter_bits_per_key,
+                      result.filter_false_positive_rate * 100);
+        std::cout << line;
     }
 }
 
 /**
- * Removes punctuation from a given word and converts it to lowercase.
- * This function iterates through each character in the input word, checks
- * if it is an alphabetic character, and appends it to the result string
- * if true. This effectively strips the word of any punctuation.
+ * Serialize benchmark results as JSON so runs can be compared across
+ * commits.
  *
- * @param word The word from which to strip punctuation and convert to
- * lowercase.
- * @return A new string that is the lowercase version of the input word without
- * any punctuation.
+ * @param results The benchmark cases.
+ * @param options The parsed command-line options.
+ * @return The JSON document.
  */
-std::string strip_punctuation(const std::string& word) {
-    std::string stripped_word;
+std::string bench_json(const std::vector<BenchCase>& results,
+                       const CommandOptions& options) {
+    std::ostringstream out;
+    out.precision(6);
+    out << std::fixed;
+    out << "{\n  \"seed\": " << options.seed
+        << ",\n  \"misspell_rate\": " << options.misspell_rate
+        << ",\n  \"warmup\": " << options.warmup
+        << ",\n  \"repeat\": " << options.repeat << ",\n  \"cases\": [";
 
-    for (char c : word) {
-        if (std::isalpha(c)) {
-            stripped_word += std::tolower(c);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchCase& result = results[i];
+        std::string label;
+        append_json_string(label, result.label);
+        out << (i ? "," : "") << "\n    {\n      \"label\": " << label
+            << ",\n      \"dictionary_words\": " << result.dictionary_words
+            << ",\n      \"text_words\": " << result.text_words
+            << ",\n      \"misspelled\": " << result.misspelled
+            << ",\n      \"filter_bits_per_key\": "
+            << result.filter_bits_per_key
+            << ",\n      \"filter_false_positive_rate\": "
+            << result.filter_false_positive_rate
+            << ",\n      \"phases\": [";
+
+        for (size_t j = 0; j < result.phases.size(); j++) {
+            const BenchPhase& phase = result.phases[j];
+            std::string name;
+            append_json_string(name, phase.name);
+            out << (j ? "," : "") << "\n        {\"name\": " << name
+                << ", \"items\": " << phase.items
+                << ", \"min_ms\": " << percentile(phase.samples, 0)
+                << ", \"p50_ms\": " << percentile(phase.samples, 50)
+                << ", \"p90_ms\": " << percentile(phase.samples, 90)
+                << ", \"p99_ms\": " << percentile(phase.samples, 99)
+                << ", \"max_ms\": " << percentile(phase.samples, 100)
+                << ", \"allocations_per_call\": " << phase.allocations
+                << ", \"samples_ms\": [";
+            for (size_t k = 0; k < phase.samples.size(); k++) {
+                out << (k ? ", " : "") << phase.samples[k];
+            }
+            out << "]}";
         }
+        out << "\n      ]\n    }";
     }
+    out << "\n  ]\n}\n";
 
-    return stripped_word;
+    return out.str();
 }
 
 /**
- * Tokenizes a given string of text into individual words. This function
- * uses a string stream to read individual words from the text string and
- * stores them in a vector. It handles standard whitespace-delimited words
- * but does not strip punctuation or alter case; use `strip_punctuation`
- * for that purpose if needed.
+ * The `bench` subcommand. With input files, benchmarks the dictionary given
+ * with --dictionary against the text of those files. Without them, generates
+ * reproducible corpora for each of the --sizes dictionary sizes, with a
+ * generated text in which --misspell-rate of the words are misspelled, and
+ * benchmarks each. Results are printed as a table and, with --json, written
+ * as JSON.
  *
- * @param text The string of text to tokenize.
- * @return A vector of strings, where each string is a word from the input text.
+ * @param options The parsed command-line options.
+ * @return The process exit status.
  */
-std::vector<std::string> tokenize(const std::string& text) {
-    std::vector<std::string> tokens;
-    std::istringstream textStream(text);
-    std::string token;
+int run_bench(const CommandOptions& options) {
+    std::vector<BenchCase> results;
 
-    while (textStream >> token) {
-        // Check for trailing punctuation
-        if (ispunct(token.back())) {
-            // Separate word from trailing punctuation
-            tokens.push_back(token.substr(0, token.size() - 1));
-            tokens.push_back(token.substr(token.size() - 1));
+    if (!options.inputs.empty()) {
+        std::string text;
+        for (const auto& input : options.inputs) {
+            std::string file_text;
+            if (!read_text(input, file_text)) {
+                return EXIT_USAGE;
+            }
+            text += file_text;
+            text += "\n";
+        }
+
+        BenchCase result;
+        if (!run_bench_case(options.dictionary_filename,
+                            options.dictionary_filename, text, options,
+                            result)) {
+            return EXIT_USAGE;
+        }
+        print_bench_case(result);
+        results.push_back(result);
+    }
+
+    const char* tmpdir = std::getenv("TMPDIR");
+    std::string corpus_dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+
+    for (size_t i = 0; options.inputs.empty() && i < options.bench_sizes.size();
+         i++) {
+        size_t size = options.bench_sizes[i];
+        std::mt19937 rng(options.seed + i);
+        std::vector<std::string> words = generate_words(size, rng);
+        std::unordered_set<std::string> word_set(words.begin(), words.end());
+        std::string text = generate_text(words, word_set, options.text_words,
+                                         options.misspell_rate, rng);
+
+        // Write the generated dictionary out so the load phase measures
+        // load_dictionary reading a real file. Words get Zipf-distributed
+        // counts in generation order, as a real frequency list would have.
+        std::string dictionary_filename =
+            corpus_dir + "/SpellChecker-bench-" + std::to_string(size) + "-" +
+            std::to_string(options.seed) + ".txt";
+        {
+            std::ofstream out(dictionary_filename);
+            for (size_t rank = 0; rank < words.size(); rank++) {
+                out << words[rank] << "\t" << 100000000 / (rank + 1) << "\n";
+            }
+            if (!out) {
+                std::cerr << "Error: could not write " << dictionary_filename
+                          << std::endl;
+                return EXIT_USAGE;
+            }
+        }
+
+        BenchCase result;
+        bool ok = run_bench_case(std::to_string(size) + " words",
+                                 dictionary_filename, text, options, result);
+        std::remove(dictionary_filename.c_str());
+        if (!ok) {
+            return EXIT_USAGE;
+        }
+        print_bench_case(result);
+        results.push_back(result);
+    }
+
+    if (!options.json_filename.empty()) {
+        std::string json = bench_json(results, options);
+        if (options.json_filename == "-") {
+            std::cout << json;
         } else {
-            tokens.push_back(token);
+            std::ofstream out(options.json_filename);
+            out << json;
+            if (!out) {
+                std::cerr << "Error: could not write " << options.json_filename
+                          << std::endl;
+                return EXIT_USAGE;
+            }
         }
     }
 
-    return tokens;
+    return EXIT_CLEAN;
 }
 
 /**
- * Replaces the first occurrence of a specified word in a given text with
- * a new word. This function searches for the old word within the original
- * text and replaces it with the new word if found. Note that this function
- * only replaces the first occurrence of the old word.
+ * The `stats` subcommand. Fetches and prints the metrics of a daemon
+ * started with `serve`.
  *
- * @param original_text The original text in which to replace a word.
- * @param old_word The word in the original text that needs to be replaced.
- * @param new_word The word that will replace the old word in the text.
- * @return A new string with the first occurrence of the old word replaced by
- * the new word.
+ * @param options The parsed command-line options.
+ * @return The process exit status.
  */
-std::string replace_word(const std::string& original_text,
-                         const std::string& old_word,
-                         const std::string& new_word) {
-    std::string corrected_text = original_text;
-    size_t pos = corrected_text.find(old_word);
-
-    if (pos != std::string::npos) {
-        corrected_text.replace(pos, old_word.length(), new_word);
+int run_stats(const CommandOptions& options) {
+    SpellClient client;
+    std::string report;
+    if (!client.connect(options.socket_path) ||
+        !client.stats(report, options.json_format)) {
+        std::cerr << "Error: could not get stats from " << options.socket_path
+                  << std::endl;
+        return EXIT_USAGE;
     }
 
-    return corrected_text;
+    std::cout << report << (options.json_format ? "\n" : "");
+    return EXIT_CLEAN;
 }
 
 /**
- * Reads a text file, identifies misspelled words, offers suggestions for
- * corrections, allows the user to choose corrections interactively, and
- * rewrites the file with the selected corrections applied. Ignores punctuation
- * when identifying words.
+ * Run a subcommand from the command line in batch mode, without the menu.
  *
- * @param filename The name of the file to spell check and correct.
- * @param dictionary A hash table containing the validated dictionary of words.
+ * @param argc The number of arguments.
+ * @param argv The arguments; argv[1] names the subcommand.
+ * @return The process exit status.
  */
-void spell_check_and_correct_file(
-    const std::string& filename,
-    const std::unordered_map<std::string, bool>& dictionary) {
-    std::ifstream file(filename);
-    std::string text((std::istreambuf_iterator<char>(file)),
-                     std::istreambuf_iterator<char>());
-    file.close();
+int run_command(int argc, char* argv[]) {
+    CommandOptions options;
+    std::string command = argv[1];
 
-    std::unordered_set<std::string> dict_set;
-    for (const auto& pair : dictionary) {
-        dict_set.insert(pair.first);
+    if (command == "-h" || command == "--help" || command == "help") {
+        print_usage(std::cout);
+        return EXIT_CLEAN;
     }
 
-    auto tokens = tokenize(text);
-    bool made_corrections = false;
-
-    for (size_t i = 0; i < tokens.size(); ++i) {
-        std::string strippedWord = strip_punctuation(tokens[i]);
-        if (!strippedWord.empty() &&
-            dict_set.find(strippedWord) == dict_set.end()) {
-            // Misspelled word found
-            std::cout << "\nMisspelled word: " << tokens[i] << std::endl;
-            auto suggestions =
-                suggest_corrections_cached({strippedWord}, dict_set);
-
-            if (!suggestions.empty()) {
-                // Display suggestions
-                std::cout << "Suggestions for \"" << tokens[i]
-                          << "\":" << std::endl;
-                for (size_t j = 0; j < suggestions.size(); ++j) {
-                    std::cout << j + 1 << ": " << suggestions[j].second
-                              << std::endl;
-                }
-                std::cout << "0: Skip (make no change)\n";
-                std::cout << "Choose a correction (number): ";
-                int choice;
-                std::cin >> choice;
-                std::cin.ignore(std::numeric_limits<std::streamsize>::max(),
-                                '\n');  // Clears the input buffer
-
-                if (choice > 0 && choice <= suggestions.size()) {
-                    // Replace the misspelled word with the chosen correction
-                    tokens[i] = suggestions[choice - 1].second;
-                    made_corrections = true;
-                    std::cout << "Applying correction..." << std::endl;
-                }
-            }
-        }
+    if (!parse_command_line(argc, argv, options)) {
+        print_usage(std::cerr);
+        return EXIT_USAGE;
     }
+    set_distance_metric(options.distance);
+    membership_filters = options.filter;
+    gram_indexes = options.grams;
+    phonetic_indexes = options.phonetic;
 
-    if (made_corrections) {
-        // Reconstruct the text from tokens and write it back to the file,
-        // handling spaces correctly
-        std::string corrected_text;
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (i > 0 && !ispunct(tokens[i][0])) {
-                corrected_text += " ";
-            }
-            corrected_text += tokens[i];
-        }
-
-        std::ofstream out_file(filename);
-        out_file << corrected_text;
-        out_file.close();
-        std::cout << "All corrections have been applied and saved back to \""
-                  << filename << "\".\n";
+    int status;
+    if (command == "check") {
+        status = run_check(options);
+    } else if (command == "suggest") {
+        status = run_suggest(options);
+    } else if (command == "correct") {
+        status = run_correct(options);
+    } else if (command == "complete") {
+        status = run_complete(options);
+    } else if (command == "compile-dict") {
+        status = run_compile_dict(options);
+    } else if (command == "bench") {
+        status = run_bench(options);
+    } else if (command == "serve") {
+        status = run_serve(options);
+    } else if (command == "lsp") {
+        status = run_lsp(options);
+    } else if (command == "stats") {
+        status = run_stats(options);
     } else {
-        std::cout << "No corrections were made to the file.\n";
+        std::cerr << "Error: unknown command " << command << std::endl;
+        print_usage(std::cerr);
+        return EXIT_USAGE;
+    }
+
+    if (options.metrics) {
+        std::cerr << metrics_report(options.json_format)
+                  << (options.json_format ? "\n" : "");
     }
+    return status;
 }
 
 /**
- * Entry point of the program. Displays a UI to the user asking to input a
+ * Run the interactive menu. Displays a UI to the user asking to input a
  * file name and a string of text to spell check. The program then reads the
  * dictionary from the file, checks the text for misspelled words, and
  * suggests corrections for any misspelled words found. The user can add new
- * words to the dictionary, and the hash table containing the dictionary
- * will be updated.
+ * words to the dictionary, and the shared dictionary will publish them to
+ * later checks.
+ *
+ * @return The process exit status.
  */
-int main() {
-    std::unordered_map<std::string, bool> dictionary;
+int run_menu() {
+    SharedDictionary dictionary;
+    std::unique_ptr<DictionaryJournal> journal;
+    std::unique_ptr<DictionaryWatcher> watcher;
     std::string dictionary_filename, text, choice;
 
     while (true) {
@@ -433,8 +9399,10 @@ int main() {
                   << "[L] Load dictionary\n"
                   << "[C] Check spelling\n"
                   << "[F] Check spelling and correct file\n"
+                  << "[W] Complete a word\n"
                   << "[A] Add word to dictionary\n"
                   << "[P] Purge cache\n"
+                  << "[M] Show metrics\n"
                   << "[Q] Quit\n"
                   << "Choose an option: ";
         std::cin >> choice;
@@ -446,33 +9414,50 @@ int main() {
             std::cout << "\nEnter the name of the dictionary file: ";
             std::getline(std::cin, dictionary_filename);
 
-            dictionary = load_dictionary(dictionary_filename);
-
-            if (dictionary.empty()) {
+            DictionaryLayer base;
+            if (!load_dictionary_layer(dictionary_filename, base)) {
                 std::cerr << "\nFailed to load dictionary.\n";
             } else {
+                // Replay the words added to this dictionary before, journal
+                // new ones, and keep it current while the menu is in use.
+                watcher.reset();
+                journal.reset();
+                DictionaryLayer added = load_journal_layer(dictionary_filename);
+                dictionary.update([&](std::vector<DictionaryLayer>& layers) {
+                    layers = {std::move(base), std::move(added)};
+                });
+
+                journal.reset(
+                    new DictionaryJournal(dictionary, dictionary_filename));
+                if (journal->open()) {
+                    journal->start();
+                } else {
+                    journal.reset();
+                }
+                watcher.reset(
+                    new DictionaryWatcher(dictionary, dictionary_filename));
+                watcher->start();
                 std::cout << "\nDictionary loaded successfully.\n";
             }
         } else if (choice == "C" || choice == "c") {
-            if (dictionary.empty()) {
+            DictionaryReader snapshot(dictionary);
+            if (snapshot->empty()) {
                 std::cout << "\nPlease load a dictionary first.\n";
                 continue;
             }
 
-            std::unordered_set<std::string> dict_set;
-            for (const auto& pair : dictionary) {
-                dict_set.insert(pair.first);
-            }
-
             std::cout << "\nEnter the text to spell check:\n";
             std::getline(std::cin, text);
 
-            auto misspelled = spell_check(text, dict_set);
-            auto corrections = suggest_corrections_cached(misspelled, dict_set);
+            auto found = spell_check(text, *snapshot);
+            std::vector<std::string> misspelled(found.begin(), found.end());
+            auto corrections =
+                suggest_corrections_cached(misspelled, *snapshot);
 
-            print_results(misspelled, corrections);
+            print_results(misspelled, corrections, *snapshot);
         } else if (choice == "F" || choice == "f") {
-            if (dictionary.empty()) {
+            DictionaryReader snapshot(dictionary);
+            if (snapshot->empty()) {
                 std::cout << "\nPlease load a dictionary first.\n";
                 continue;
             }
@@ -481,12 +9466,36 @@ int main() {
                 << "Enter the filename for spell checking and correction: ";
             std::string filename;
             std::getline(std::cin, filename);
-            spell_check_and_correct_file(filename, dictionary);
+            spell_check_and_correct_file(filename, *snapshot);
+        } else if (choice == "W" || choice == "w") {
+            DictionaryReader snapshot(dictionary);
+            if (snapshot->empty()) {
+                std::cout << "\nPlease load a dictionary first.\n";
+                continue;
+            }
+
+            std::cout << "\nEnter the start of a word: ";
+            std::string prefix;
+            std::getline(std::cin, prefix);
+
+            auto completions = snapshot->complete(strip_punctuation(prefix),
+                                                  DEFAULT_COMPLETIONS);
+            if (completions.empty()) {
+                std::cout << "\nNo words start with \"" << prefix << "\".\n";
+            } else {
+                std::cout << "\nCompletions:\n";
+                for (const auto& completion : completions) {
+                    std::cout << completion.word << std::endl;
+                }
+            }
         } else if (choice == "A" || choice == "a") {
-            add_word_to_dictionary(dictionary);
+            add_word_to_dictionary(dictionary, journal.get());
         } else if (choice == "P" || choice == "p") {
-            cache.clear();
+            purge_cache();
             std::cout << "\nCache purged.\n";
+        } else if (choice == "M" || choice == "m") {
+            DictionaryReader snapshot(dictionary);
+            std::cout << "\n" << stats_report(*snapshot, false);
         } else if (choice == "Q" || choice == "q") {
             std::cout << "\nExiting program.\n";
             break;
@@ -496,4 +9505,16 @@ int main() {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Entry point of the program. With no arguments the interactive menu is
+ * shown; otherwise the first argument names a batch subcommand.
+ */
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return run_command(argc, argv);
+    }
+
+    return run_menu();
+}
@@ -0,0 +1,441 @@
+//
+// Copyright Caiden Sanders - All Rights Reserved
+//
+// Unauthorized copying of this file, via any medium is strictly prohibited.
+// Proprietary and confidential.
+//
+// Written by Caiden Sanders <work.caidensanders@gmail.com>, March 18, 2024.
+//
+
+// Client library and wire protocol for the spell checker daemon started with
+// `SpellChecker serve`. The daemon listens on a Unix domain socket and speaks
+// a compact length-prefixed binary protocol:
+//
+//   request:  u32 length | u8 opcode | body
+//   response: u32 length | u8 status | body
+//
+// The length counts every byte after the length field itself and is stored
+// little-endian. Counts and string lengths inside a body are LEB128 varints.
+// Requests on a connection are answered in order, so several may be written
+// before reading the responses.
+//
+//   PING     body: empty               reply: empty
+//   CHECK    body: text                reply: count, (offset, length)...
+//   SUGGEST  body: count, string...    reply: count, string...
+//   STATS    body: u8 format           reply: report text
+//   COMPLETE body: limit, prefix       reply: count, string...
+//
+// CHECK reports the byte range of each misspelled word in the request text.
+// SUGGEST answers each word with itself when it is spelled correctly, its
+// suggested correction when it is not, or an empty string when there is no
+// suggestion. STATS returns the daemon's metrics report, as human-readable
+// text when the format byte is STATS_TEXT and as JSON otherwise. COMPLETE
+// answers with up to limit dictionary words that start with the prefix,
+// most frequent first.
+
+#ifndef SPELL_CLIENT_H
+#define SPELL_CLIENT_H
+
+// System Includes
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Data Structure Includes
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace spell_protocol {
+
+// Default socket path used by both the daemon and the client tools.
+const char DEFAULT_SOCKET_PATH[] = "/tmp/SpellChecker.sock";
+
+// Frames larger than this are rejected. The daemon buffers at most one such
+// frame of input per client and stops reading from a client that falls
+// behind on its answers, which bounds the memory a single misbehaving
+// client can make it hold.
+const uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+// Size of the length prefix at the start of every frame.
+const size_t LENGTH_PREFIX_SIZE = 4;
+
+// Request opcodes.
+const uint8_t OP_PING = 0;
+const uint8_t OP_CHECK = 1;
+const uint8_t OP_SUGGEST = 2;
+const uint8_t OP_STATS = 3;
+const uint8_t OP_COMPLETE = 4;
+
+// STATS report formats.
+const uint8_t STATS_TEXT = 0;
+const uint8_t STATS_JSON = 1;
+
+// Response status codes.
+const uint8_t STATUS_OK = 0;
+const uint8_t STATUS_BAD_REQUEST = 1;
+
+/**
+ * Append an unsigned integer to a buffer as a LEB128 varint.
+ *
+ * @param out The buffer to append to.
+ * @param value The value to encode.
+ */
+inline void append_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/**
+ * Decode a LEB128 varint from a buffer.
+ *
+ * @param data The buffer to decode from.
+ * @param pos The position to start at; advanced past the varint.
+ * @param value Receives the decoded value.
+ * @return True if a complete varint was available.
+ */
+inline bool read_varint(const std::string& data, size_t& pos,
+                        uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Append a length-prefixed string to a buffer.
+ *
+ * @param out The buffer to append to.
+ * @param value The string to encode.
+ */
+inline void append_string(std::string& out, const std::string& value) {
+    append_varint(out, value.size());
+    out += value;
+}
+
+/**
+ * Decode a length-prefixed string from a buffer.
+ *
+ * @param data The buffer to decode from.
+ * @param pos The position to start at; advanced past the string.
+ * @param value Receives the decoded string.
+ * @return True if a complete string was available.
+ */
+inline bool read_string(const std::string& data, size_t& pos,
+                        std::string& value) {
+    uint64_t length;
+    if (!read_varint(data, pos, length) || length > data.size() - pos) {
+        return false;
+    }
+    value.assign(data, pos, length);
+    pos += length;
+    return true;
+}
+
+/**
+ * Append a complete frame, length prefix included, to a buffer.
+ *
+ * @param out The buffer to append to.
+ * @param code The opcode of a request or the status of a response.
+ * @param body The frame body.
+ */
+inline void append_frame(std::string& out, uint8_t code,
+                         const std::string& body) {
+    uint32_t length = body.size() + 1;
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>(length >> (8 * i));
+    }
+    out += static_cast<char>(code);
+    out += body;
+}
+
+/**
+ * Decode the length prefix at the start of a buffer.
+ *
+ * @param data The buffer; must hold at least LENGTH_PREFIX_SIZE bytes.
+ * @return The number of bytes in the frame after the prefix.
+ */
+inline uint32_t frame_length(const char* data) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    return uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 |
+           uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+}
+
+}  // namespace spell_protocol
+
+/**
+ * A blocking client for the spell checker daemon. Each client owns one
+ * connection and is not safe to share between threads; open one client per
+ * thread instead.
+ */
+class SpellClient {
+   public:
+    SpellClient() = default;
+    SpellClient(const SpellClient&) = delete;
+    SpellClient& operator=(const SpellClient&) = delete;
+    ~SpellClient() { close(); }
+
+    /**
+     * Connect to a daemon.
+     *
+     * @param socket_path The path of the daemon's Unix domain socket.
+     * @return True if the connection was established.
+     */
+    bool connect(const std::string& socket_path =
+                     spell_protocol::DEFAULT_SOCKET_PATH) {
+        close();
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::memcpy(address.sun_path, socket_path.c_str(),
+                    socket_path.size() + 1);
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<sockaddr*>(&address),
+                      sizeof(address)) < 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Close the connection, if one is open.
+     */
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    /**
+     * @return True if the client has an open connection.
+     */
+    bool connected() const { return fd_ >= 0; }
+
+    /**
+     * Round-trip an empty request, e.g. to measure protocol overhead.
+     *
+     * @return True if the daemon answered.
+     */
+    bool ping() {
+        std::string reply;
+        return call(spell_protocol::OP_PING, std::string(), reply);
+    }
+
+    /**
+     * Spell check a string of text.
+     *
+     * @param text The text to check.
+     * @param misspelled Receives the misspelled words, as they appear in the
+     * text, in order.
+     * @return True if the daemon answered.
+     */
+    bool check(const std::string& text, std::vector<std::string>& misspelled) {
+        std::string reply;
+        if (!call(spell_protocol::OP_CHECK, text, reply)) {
+            return false;
+        }
+
+        size_t pos = 0;
+        uint64_t count;
+        if (!spell_protocol::read_varint(reply, pos, count)) {
+            return false;
+        }
+
+        misspelled.clear();
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t offset, length;
+            if (!spell_protocol::read_varint(reply, pos, offset) ||
+                !spell_protocol::read_varint(reply, pos, length) ||
+                offset > text.size() || length > text.size() - offset) {
+                return false;
+            }
+            misspelled.push_back(text.substr(offset, length));
+        }
+        return true;
+    }
+
+    /**
+     * Ask for a suggested correction for each of a list of words.
+     *
+     * @param words The words to look up.
+     * @param suggestions Receives one entry per word: the word itself if it
+     * is spelled correctly, its correction, or an empty string when there is
+     * no suggestion.
+     * @return True if the daemon answered.
+     */
+    bool suggest(const std::vector<std::string>& words,
+                 std::vector<std::string>& suggestions) {
+        std::string body;
+        spell_protocol::append_varint(body, words.size());
+        for (const auto& word : words) {
+            spell_protocol::append_string(body, word);
+        }
+
+        std::string reply;
+        if (!call(spell_protocol::OP_SUGGEST, body, reply)) {
+            return false;
+        }
+
+        size_t pos = 0;
+        uint64_t count;
+        if (!spell_protocol::read_varint(reply, pos, count) ||
+            count != words.size()) {
+            return false;
+        }
+
+        suggestions.resize(count);
+        for (auto& suggestion : suggestions) {
+            if (!spell_protocol::read_string(reply, pos, suggestion)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Ask for the dictionary words that start with a prefix.
+     *
+     * @param prefix The prefix to complete.
+     * @param limit The most words to return.
+     * @param completions Receives the words, most frequent first.
+     * @return True if the daemon answered.
+     */
+    bool complete(const std::string& prefix, size_t limit,
+                  std::vector<std::string>& completions) {
+        std::string body;
+        spell_protocol::append_varint(body, limit);
+        spell_protocol::append_string(body, prefix);
+
+        std::string reply;
+        if (!call(spell_protocol::OP_COMPLETE, body, reply)) {
+            return false;
+        }
+
+        size_t pos = 0;
+        uint64_t count;
+        if (!spell_protocol::read_varint(reply, pos, count) ||
+            count > limit) {
+            return false;
+        }
+
+        completions.resize(count);
+        for (auto& completion : completions) {
+            if (!spell_protocol::read_string(reply, pos, completion)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Fetch the daemon's metrics report.
+     *
+     * @param report Receives the report.
+     * @param json True for a JSON report, false for human-readable text.
+     * @return True if the daemon answered.
+     */
+    bool stats(std::string& report, bool json = true) {
+        uint8_t format =
+            json ? spell_protocol::STATS_JSON : spell_protocol::STATS_TEXT;
+        std::string body(1, static_cast<char>(format));
+        return call(spell_protocol::OP_STATS, body, report);
+    }
+
+    /**
+     * Send a raw request and wait for its response.
+     *
+     * @param opcode The request opcode.
+     * @param body The request body.
+     * @param reply Receives the response body.
+     * @return True if the daemon answered with STATUS_OK.
+     */
+    bool call(uint8_t opcode, const std::string& body, std::string& reply) {
+        if (fd_ < 0) {
+            return false;
+        }
+
+        std::string frame;
+        spell_protocol::append_frame(frame, opcode, body);
+        if (!write_all(frame.data(), frame.size())) {
+            close();
+            return false;
+        }
+
+        char prefix[spell_protocol::LENGTH_PREFIX_SIZE];
+        if (!read_all(prefix, sizeof(prefix))) {
+            close();
+            return false;
+        }
+
+        uint32_t length = spell_protocol::frame_length(prefix);
+        if (length == 0 || length > spell_protocol::MAX_FRAME_SIZE) {
+            close();
+            return false;
+        }
+
+        reply.resize(length);
+        if (!read_all(&reply[0], length)) {
+            close();
+            return false;
+        }
+
+        uint8_t status = static_cast<uint8_t>(reply[0]);
+        reply.erase(0, 1);
+        return status == spell_protocol::STATUS_OK;
+    }
+
+   private:
+    bool write_all(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::send(fd_, data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool read_all(char* data, size_t size) {
+        while (size > 0) {
+            ssize_t received = ::recv(fd_, data, size, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    int fd_ = -1;
+};
+
+#endif  // SPELL_CLIENT_H
@@ -0,0 +1,260 @@
+//
+// Copyright Caiden Sanders - All Rights Reserved
+//
+// Unauthorized copying of this file, via any medium is strictly prohibited.
+// Proprietary and confidential.
+//
+// Written by Caiden Sanders <work.caidensanders@gmail.com>, March 18, 2024.
+//
+
+// Load generator for the spell checker daemon. Opens one connection per
+// thread, issues a mix of check and suggest requests built from a word list
+// for a fixed duration, and reports throughput and latency percentiles.
+
+// Input/Output Includes
+#include <fstream>
+#include <iostream>
+
+// Data Structure Includes
+#include <string>
+#include <vector>
+
+// Algorithm Includes
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+// Daemon Protocol Includes
+#include "SpellClient.h"
+
+/**
+ * Options for a load generation run.
+ */
+struct LoadOptions {
+    std::string socket_path = spell_protocol::DEFAULT_SOCKET_PATH;
+    std::string words_filename = "dictionary.txt";
+    int connections = 4;
+    double seconds = 5;
+    double check_fraction = 0.5;
+    int words_per_check = 20;
+    double misspell_rate = 0.1;
+};
+
+/**
+ * The latencies measured by one connection, in nanoseconds.
+ */
+struct LoadResult {
+    std::vector<int64_t> latencies;
+    size_t errors = 0;
+};
+
+/**
+ * Damage a word with a single random edit so it is likely misspelled.
+ *
+ * @param word The word to damage.
+ * @param rng The random number generator to use.
+ * @return The damaged word.
+ */
+std::string misspell(std::string word, std::mt19937& rng) {
+    if (word.size() < 2) {
+        return word + "x";
+    }
+
+    size_t pos = rng() % word.size();
+    switch (rng() % 3) {
+        case 0:
+            word.erase(pos, 1);
+            break;
+        case 1:
+            word.insert(pos, 1, static_cast<char>('a' + rng() % 26));
+            break;
+        default:
+            word[pos] = static_cast<char>('a' + rng() % 26);
+            break;
+    }
+    return word;
+}
+
+/**
+ * Issue requests on one connection until the deadline passes.
+ *
+ * @param options The load generation options.
+ * @param words The word list to build requests from.
+ * @param seed Seed for this connection's random number generator.
+ * @param deadline When to stop issuing requests.
+ * @param result Receives the measured latencies.
+ */
+void run_connection(const LoadOptions& options,
+                    const std::vector<std::string>& words, unsigned seed,
+                    std::chrono::steady_clock::time_point deadline,
+                    LoadResult& result) {
+    SpellClient client;
+    if (!client.connect(options.socket_path)) {
+        std::cerr << "Error: could not connect to " << options.socket_path
+                  << std::endl;
+        result.errors++;
+        return;
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::vector<std::string> misspelled;
+    std::vector<std::string> suggestions;
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        // Build the request before starting the clock so only the round
+        // trip is measured.
+        bool is_check = unit(rng) < options.check_fraction;
+        std::string text;
+        std::vector<std::string> query;
+        if (is_check) {
+            for (int i = 0; i < options.words_per_check; i++) {
+                const std::string& word = words[rng() % words.size()];
+                text += unit(rng) < options.misspell_rate ? misspell(word, rng)
+                                                          : word;
+                text += ' ';
+            }
+        } else {
+            query.push_back(misspell(words[rng() % words.size()], rng));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = is_check ? client.check(text, misspelled)
+                           : client.suggest(query, suggestions);
+        auto end = std::chrono::steady_clock::now();
+
+        if (!ok) {
+            result.errors++;
+            if (!client.connected()) {
+                return;
+            }
+            continue;
+        }
+        result.latencies.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                .count());
+    }
+}
+
+/**
+ * Look up a percentile in a sorted list of latencies.
+ *
+ * @param sorted The latencies in ascending order.
+ * @param percentile The percentile to find, between 0 and 100.
+ * @return The latency in microseconds.
+ */
+double percentile_us(const std::vector<int64_t>& sorted, double percentile) {
+    size_t index = static_cast<size_t>(percentile / 100 * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+/**
+ * Print the command-line usage summary.
+ */
+void print_usage() {
+    std::cerr
+        << "Usage: SpellLoadGen [options]\n"
+        << "  -s PATH  Daemon socket (default: "
+        << spell_protocol::DEFAULT_SOCKET_PATH << ")\n"
+        << "  -w FILE  Word list to build requests from (default: "
+           "dictionary.txt)\n"
+        << "  -c N     Concurrent connections (default: 4)\n"
+        << "  -t SECS  Duration of the run (default: 5)\n"
+        << "  -m FRAC  Fraction of requests that are checks (default: 0.5)\n"
+        << "  -k N     Words per check request (default: 20)\n"
+        << "  -e FRAC  Fraction of misspelled words in checks (default: "
+           "0.1)\n";
+}
+
+/**
+ * Entry point of the load generator.
+ */
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage();
+            return 2;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "-s") {
+            options.socket_path = value;
+        } else if (arg == "-w") {
+            options.words_filename = value;
+        } else if (arg == "-c") {
+            options.connections = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "-t") {
+            options.seconds = std::atof(value.c_str());
+        } else if (arg == "-m") {
+            options.check_fraction = std::atof(value.c_str());
+        } else if (arg == "-k") {
+            options.words_per_check = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "-e") {
+            options.misspell_rate = std::atof(value.c_str());
+        } else {
+            print_usage();
+            return 2;
+        }
+    }
+
+    std::vector<std::string> words;
+    std::ifstream file(options.words_filename);
+    std::string word;
+    while (file >> word) {
+        words.push_back(word);
+    }
+    if (words.empty()) {
+        std::cerr << "Error: no words in " << options.words_filename
+                  << std::endl;
+        return 2;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<
+                                std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double>(options.seconds));
+
+    std::vector<LoadResult> results(options.connections);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.connections; i++) {
+        threads.emplace_back(run_connection, std::cref(options),
+                             std::cref(words), 12345u + i, deadline,
+                             std::ref(results[i]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    std::vector<int64_t> latencies;
+    size_t errors = 0;
+    for (const auto& result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(),
+                         result.latencies.end());
+        errors += result.errors;
+    }
+    if (latencies.empty()) {
+        std::cerr << "No requests completed (" << errors << " errors)."
+                  << std::endl;
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << "Requests:   " << latencies.size() << " (" << errors
+              << " errors) over " << options.connections << " connections\n"
+              << "Throughput: " << latencies.size() / elapsed << " req/s\n"
+              << "Latency:    p50 " << percentile_us(latencies, 50)
+              << " us, p90 " << percentile_us(latencies, 90) << " us, p99 "
+              << percentile_us(latencies, 99) << " us, p99.9 "
+              << percentile_us(latencies, 99.9) << " us, max "
+              << latencies.back() / 1000.0 << " us\n";
+
+    return errors > 0 ? 1 : 0;
+}
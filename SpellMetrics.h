@@ -0,0 +1,461 @@
+//
+// Copyright Caiden Sanders - All Rights Reserved
+//
+// Unauthorized copying of this file, via any medium is strictly prohibited.
+// Proprietary and confidential.
+//
+// Written by Caiden Sanders <work.caidensanders@gmail.com>, March 18, 2024.
+//
+
+// Hot-path instrumentation for the spell checker. Every thread counts into
+// its own block of counters and latency histograms, so recording a metric is
+// a couple of plain loads and stores with no locking or shared cache lines.
+// A report merges the blocks of all threads on demand.
+//
+// Instrument code through the METRIC_COUNT and METRIC_TIMER macros, or
+// METRIC_LAP_TIMER and METRIC_LAP for a scope that switches between phases.
+// Building with -DSPELLCHECK_METRICS=0 turns them all into no-ops and
+// removes the metric storage entirely; metrics_report then just says metrics
+// are disabled.
+
+#ifndef SPELL_METRICS_H
+#define SPELL_METRICS_H
+
+#ifndef SPELLCHECK_METRICS
+#define SPELLCHECK_METRICS 1
+#endif
+
+// Data Structure Includes
+#include <cstdint>
+#include <string>
+
+#if SPELLCHECK_METRICS
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#endif
+
+// The timed phases of a spell check.
+enum MetricPhase {
+    PHASE_LOAD,
+    PHASE_TOKENIZE,
+    PHASE_LOOKUP,
+    PHASE_SUGGEST,
+    PHASE_WRITE_BACK,
+    PHASE_COMPLETE,
+    PHASE_COUNT
+};
+
+// The event counters.
+enum MetricCounter {
+    COUNTER_WORDS_LOADED,
+    COUNTER_TOKENS,
+    COUNTER_LOOKUPS,
+    COUNTER_LOOKUP_MISSES,
+    COUNTER_SUGGESTIONS,
+    COUNTER_DISTANCE_EVALUATIONS,
+    COUNTER_CACHE_HITS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_GRAM_CANDIDATES,
+    COUNTER_SEGMENTATIONS,
+    COUNTER_COUNT
+};
+
+#if SPELLCHECK_METRICS
+
+const char* const METRIC_PHASE_NAMES[PHASE_COUNT] = {
+    "load", "tokenize", "lookup", "suggest", "write_back", "complete"};
+
+const char* const METRIC_COUNTER_NAMES[COUNTER_COUNT] = {
+    "words_loaded",  "tokens",       "lookups",
+    "lookup_misses", "suggestions",  "distance_evaluations",
+    "cache_hits",    "cache_misses", "bytes_written",
+    "gram_candidates", "segmentations"};
+
+/**
+ * A latency histogram in the style of HdrHistogram. Values below 32 get a
+ * bucket each; above that, every power of two is split into 32 linear
+ * sub-buckets, so any recorded value is reported within about 3% of its
+ * true value while the whole range up to about 18 minutes in nanoseconds
+ * fits in a fixed array.
+ */
+struct LatencyHistogram {
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 40;
+    static const int BUCKETS =
+        (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+
+    /**
+     * @param value A value to record.
+     * @return The index of the bucket that holds the value.
+     */
+    static int bucket_index(uint64_t value) {
+        if (value < uint64_t(SUB_BUCKETS)) {
+            return static_cast<int>(value);
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent >= MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        int sub_bucket =
+            (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+    }
+
+    /**
+     * @param index A bucket index.
+     * @return The smallest value that falls in the bucket.
+     */
+    static uint64_t bucket_floor(int index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t sub_bucket = index % SUB_BUCKETS;
+        return (uint64_t(SUB_BUCKETS) | sub_bucket)
+               << (exponent - SUB_BUCKET_BITS);
+    }
+};
+
+/**
+ * The metrics recorded by one thread. Only the owning thread writes to a
+ * block, so updates are relaxed loads and stores rather than atomic
+ * read-modify-writes; the atomics only make concurrent reports well defined.
+ */
+struct MetricsBlock {
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    std::atomic<uint64_t> phase_counts[PHASE_COUNT] = {};
+    std::atomic<uint64_t> phase_totals[PHASE_COUNT] = {};
+    std::atomic<uint64_t> phase_maxima[PHASE_COUNT] = {};
+    LatencyHistogram histograms[PHASE_COUNT];
+};
+
+/**
+ * Add to a single-writer atomic without a read-modify-write instruction.
+ *
+ * @param value The value owned by the calling thread.
+ * @param amount The amount to add.
+ */
+inline void metric_add(std::atomic<uint64_t>& value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+}
+
+/**
+ * The set of metric blocks belonging to live threads, plus the merged
+ * metrics of threads that have exited. The mutex is only taken when a thread
+ * starts or stops recording and when a report is made.
+ */
+struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<MetricsBlock*> blocks;
+    MetricsBlock retired;
+
+    static MetricsRegistry& instance() {
+        static MetricsRegistry* registry = new MetricsRegistry();
+        return *registry;
+    }
+};
+
+/**
+ * Fold one block into another.
+ *
+ * @param into The block to add to.
+ * @param from The block to read from.
+ */
+inline void merge_metrics(MetricsBlock& into, const MetricsBlock& from) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        metric_add(into.counters[i], from.counters[i].load());
+    }
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        metric_add(into.phase_counts[phase], from.phase_counts[phase].load());
+        metric_add(into.phase_totals[phase], from.phase_totals[phase].load());
+        into.phase_maxima[phase].store(std::max(
+            into.phase_maxima[phase].load(), from.phase_maxima[phase].load()));
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            uint64_t count = from.histograms[phase].buckets[i].load();
+            if (count) {
+                metric_add(into.histograms[phase].buckets[i], count);
+            }
+        }
+    }
+}
+
+/**
+ * Owns the calling thread's block. The block is registered the first time
+ * the thread records a metric and merged into the retired totals when the
+ * thread exits.
+ */
+struct ThreadMetrics {
+    MetricsBlock* block;
+
+    ThreadMetrics() : block(new MetricsBlock()) {
+        MetricsRegistry& registry = MetricsRegistry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.blocks.push_back(block);
+    }
+
+    ~ThreadMetrics() {
+        MetricsRegistry& registry = MetricsRegistry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        merge_metrics(registry.retired, *block);
+        for (auto& registered : registry.blocks) {
+            if (registered == block) {
+                registered = registry.blocks.back();
+                registry.blocks.pop_back();
+                break;
+            }
+        }
+        delete block;
+    }
+};
+
+/**
+ * @return The calling thread's metric block.
+ */
+inline MetricsBlock& thread_metrics() {
+    thread_local ThreadMetrics metrics;
+    return *metrics.block;
+}
+
+/**
+ * Count an event on the calling thread.
+ *
+ * @param counter The counter to increment.
+ * @param amount The number of events.
+ */
+inline void metrics_count(MetricCounter counter, uint64_t amount) {
+    metric_add(thread_metrics().counters[counter], amount);
+}
+
+/**
+ * Record the duration of one run of a phase on the calling thread.
+ *
+ * @param phase The phase that ran.
+ * @param nanoseconds How long it took.
+ */
+inline void metrics_record(MetricPhase phase, uint64_t nanoseconds) {
+    MetricsBlock& block = thread_metrics();
+    metric_add(block.phase_counts[phase], 1);
+    metric_add(block.phase_totals[phase], nanoseconds);
+    auto& maximum = block.phase_maxima[phase];
+    if (nanoseconds > maximum.load(std::memory_order_relaxed)) {
+        maximum.store(nanoseconds, std::memory_order_relaxed);
+    }
+    metric_add(block.histograms[phase]
+                   .buckets[LatencyHistogram::bucket_index(nanoseconds)],
+               1);
+}
+
+/**
+ * Times the enclosing scope and records it against a phase.
+ */
+class MetricsTimer {
+   public:
+    explicit MetricsTimer(MetricPhase phase)
+        : phase_(phase), start_(std::chrono::steady_clock::now()) {}
+
+    ~MetricsTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        metrics_record(
+            phase_,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count());
+    }
+
+   private:
+    MetricPhase phase_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Times a scope that alternates between several phases, such as a loop that
+ * tokenizes a word and then looks it up. Each call to lap charges the time
+ * since the previous lap to a phase, and every phase that was charged is
+ * recorded once, with its total, when the scope ends.
+ */
+class MetricsLapTimer {
+   public:
+    MetricsLapTimer() : last_(std::chrono::steady_clock::now()) {}
+
+    /**
+     * Charge the time since the previous lap, or since construction, to a
+     * phase.
+     *
+     * @param phase The phase that just ran.
+     */
+    void lap(MetricPhase phase) {
+        auto now = std::chrono::steady_clock::now();
+        totals_[phase] += now - last_;
+        charged_[phase] = true;
+        last_ = now;
+    }
+
+    ~MetricsLapTimer() {
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            if (charged_[phase]) {
+                metrics_record(
+                    MetricPhase(phase),
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        totals_[phase])
+                        .count());
+            }
+        }
+    }
+
+   private:
+    std::chrono::steady_clock::time_point last_;
+    std::chrono::steady_clock::duration totals_[PHASE_COUNT] = {};
+    bool charged_[PHASE_COUNT] = {};
+};
+
+/**
+ * Merge the metrics of every thread, live and exited, into one block.
+ *
+ * @param total The block to fill; must start out zeroed.
+ */
+inline void collect_metrics(MetricsBlock& total) {
+    MetricsRegistry& registry = MetricsRegistry::instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    merge_metrics(total, registry.retired);
+    for (const MetricsBlock* block : registry.blocks) {
+        merge_metrics(total, *block);
+    }
+}
+
+/**
+ * Find a percentile in a merged histogram.
+ *
+ * @param histogram The histogram.
+ * @param count The number of values recorded in it.
+ * @param percentile The percentile to find, between 0 and 100.
+ * @return The floor of the bucket holding the percentile, in nanoseconds.
+ */
+inline uint64_t histogram_percentile(const LatencyHistogram& histogram,
+                                     uint64_t count, double percentile) {
+    uint64_t rank = static_cast<uint64_t>(percentile / 100 * count + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return LatencyHistogram::bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Report the metrics of every thread.
+ *
+ * @param json True for a JSON object, false for human-readable text.
+ * @return The report.
+ */
+inline std::string metrics_report(bool json) {
+    MetricsBlock* total = new MetricsBlock();
+    collect_metrics(*total);
+
+    const double percentiles[] = {50, 90, 99, 99.9};
+    std::string report = json ? "{\"counters\":{" : "Counters:\n";
+    char line[256];
+
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        unsigned long long value = total->counters[i].load();
+        if (json) {
+            std::snprintf(line, sizeof(line), "%s\"%s\":%llu", i ? "," : "",
+                          METRIC_COUNTER_NAMES[i], value);
+        } else {
+            std::snprintf(line, sizeof(line), "  %-22s %llu\n",
+                          METRIC_COUNTER_NAMES[i], value);
+        }
+        report += line;
+    }
+
+    uint64_t hits = total->counters[COUNTER_CACHE_HITS].load();
+    uint64_t misses = total->counters[COUNTER_CACHE_MISSES].load();
+    double hit_rate = hits + misses ? double(hits) / (hits + misses) : 0;
+    if (json) {
+        std::snprintf(line, sizeof(line),
+                      "},\"cache_hit_rate\":%.4f,\"phases\":{", hit_rate);
+    } else {
+        std::snprintf(line, sizeof(line),
+                      "  %-22s %.2f%%\nPhases (microseconds):\n",
+                      "cache_hit_rate", hit_rate * 100);
+    }
+    report += line;
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        uint64_t count = total->phase_counts[phase].load();
+        double mean =
+            count ? total->phase_totals[phase].load() / 1000.0 / count : 0;
+        double values[4];
+        for (int i = 0; i < 4; i++) {
+            values[i] = count ? histogram_percentile(total->histograms[phase],
+                                                     count, percentiles[i]) /
+                                    1000.0
+                              : 0;
+        }
+        double max = total->phase_maxima[phase].load() / 1000.0;
+
+        if (json) {
+            std::snprintf(line, sizeof(line),
+                          "%s\"%s\":{\"count\":%llu,\"mean_us\":%.3f,"
+                          "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+                          "\"p999_us\":%.3f,\"max_us\":%.3f}",
+                          phase ? "," : "", METRIC_PHASE_NAMES[phase],
+                          static_cast<unsigned long long>(count), mean,
+                          values[0], values[1], values[2], values[3], max);
+        } else {
+            std::snprintf(line, sizeof(line),
+                          "  %-10s count %-8llu mean %-10.3f p50 %-10.3f "
+                          "p90 %-10.3f p99 %-10.3f p99.9 %-10.3f max %.3f\n",
+                          METRIC_PHASE_NAMES[phase],
+                          static_cast<unsigned long long>(count), mean,
+                          values[0], values[1], values[2], values[3], max);
+        }
+        report += line;
+    }
+
+    if (json) {
+        report += "}}";
+    }
+    delete total;
+    return report;
+}
+
+#define METRIC_CONCAT_INNER(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT_INNER(a, b)
+#define METRIC_COUNT(counter, amount) metrics_count(counter, amount)
+#define METRIC_TIMER(phase) \
+    MetricsTimer METRIC_CONCAT(metrics_timer_, __LINE__)(phase)
+#define METRIC_LAP_TIMER(name) MetricsLapTimer name
+#define METRIC_LAP(name, phase) name.lap(phase)
+
+#else
+
+/**
+ * Report that metrics were compiled out of this build.
+ *
+ * @param json True for a JSON object, false for human-readable text.
+ * @return The report.
+ */
+inline std::string metrics_report(bool json) {
+    return json ? "{\"enabled\":false}"
+                : "Metrics are disabled in this build.\n";
+}
+
+#define METRIC_COUNT(counter, amount) ((void)0)
+#define METRIC_TIMER(phase) ((void)0)
+#define METRIC_LAP_TIMER(name) ((void)0)
+#define METRIC_LAP(name, phase) ((void)0)
+
+#endif  // SPELLCHECK_METRICS
+
+#endif  // SPELL_METRICS_H
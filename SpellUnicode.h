@@ -0,0 +1,471 @@
+//
+// Copyright Caiden Sanders - All Rights Reserved
+//
+// Unauthorized copying of this file, via any medium is strictly prohibited.
+// Proprietary and confidential.
+//
+// Written by Caiden Sanders <work.caidensanders@gmail.com>, March 18, 2024.
+//
+
+// UTF-8 text handling for the spell checker: strict decoding, case folding,
+// and canonical composition (NFC) of the Latin-1 Supplement and Latin
+// Extended-A letters, driven by small precomputed tables. Words are compared
+// in their folded, composed form, so "Café", "CAFÉ" and "cafe" followed by a
+// combining acute accent all become "café".
+//
+// Text that is pure ASCII never reaches the tables: every entry point checks
+// for that first and falls back to plain byte operations.
+
+#ifndef SPELL_UNICODE_H
+#define SPELL_UNICODE_H
+
+// Data Structure Includes
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Algorithm Includes
+#include <algorithm>
+#include <cctype>
+
+// The first code point and one past the last code point covered by the
+// Latin case folding table.
+const uint32_t LATIN_TABLE_FIRST = 0xC0;
+const uint32_t LATIN_TABLE_END = 0x180;
+
+// The simple case folding of each code point from U+00C0 to U+017F, or 0
+// for the two that are not letters, U+00D7 and U+00F7.
+const uint16_t LATIN_FOLDING[LATIN_TABLE_END - LATIN_TABLE_FIRST] = {
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x0000,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x0000,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+    0x0101, 0x0101, 0x0103, 0x0103, 0x0105, 0x0105, 0x0107, 0x0107,
+    0x0109, 0x0109, 0x010B, 0x010B, 0x010D, 0x010D, 0x010F, 0x010F,
+    0x0111, 0x0111, 0x0113, 0x0113, 0x0115, 0x0115, 0x0117, 0x0117,
+    0x0119, 0x0119, 0x011B, 0x011B, 0x011D, 0x011D, 0x011F, 0x011F,
+    0x0121, 0x0121, 0x0123, 0x0123, 0x0125, 0x0125, 0x0127, 0x0127,
+    0x0129, 0x0129, 0x012B, 0x012B, 0x012D, 0x012D, 0x012F, 0x012F,
+    0x0130, 0x0131, 0x0133, 0x0133, 0x0135, 0x0135, 0x0137, 0x0137,
+    0x0138, 0x013A, 0x013A, 0x013C, 0x013C, 0x013E, 0x013E, 0x0140,
+    0x0140, 0x0142, 0x0142, 0x0144, 0x0144, 0x0146, 0x0146, 0x0148,
+    0x0148, 0x0149, 0x014B, 0x014B, 0x014D, 0x014D, 0x014F, 0x014F,
+    0x0151, 0x0151, 0x0153, 0x0153, 0x0155, 0x0155, 0x0157, 0x0157,
+    0x0159, 0x0159, 0x015B, 0x015B, 0x015D, 0x015D, 0x015F, 0x015F,
+    0x0161, 0x0161, 0x0163, 0x0163, 0x0165, 0x0165, 0x0167, 0x0167,
+    0x0169, 0x0169, 0x016B, 0x016B, 0x016D, 0x016D, 0x016F, 0x016F,
+    0x0171, 0x0171, 0x0173, 0x0173, 0x0175, 0x0175, 0x0177, 0x0177,
+    0x00FF, 0x017A, 0x017A, 0x017C, 0x017C, 0x017E, 0x017E, 0x0073,
+};
+
+/**
+ * A canonical composition of a lowercase base letter and a combining mark.
+ */
+struct LatinComposition {
+    uint16_t base;
+    uint16_t mark;
+    uint16_t composed;
+};
+
+// Every composition whose result is a lowercase letter from U+00C0 to
+// U+017F, sorted by base and then mark. Composition happens after case
+// folding, so the uppercase compositions are never needed.
+const LatinComposition LATIN_COMPOSITIONS[] = {
+    {0x0061, 0x0300, 0x00E0}, {0x0061, 0x0301, 0x00E1},
+    {0x0061, 0x0302, 0x00E2}, {0x0061, 0x0303, 0x00E3},
+    {0x0061, 0x0304, 0x0101}, {0x0061, 0x0306, 0x0103},
+    {0x0061, 0x0308, 0x00E4}, {0x0061, 0x030A, 0x00E5},
+    {0x0061, 0x0328, 0x0105}, {0x0063, 0x0301, 0x0107},
+    {0x0063, 0x0302, 0x0109}, {0x0063, 0x0307, 0x010B},
+    {0x0063, 0x030C, 0x010D}, {0x0063, 0x0327, 0x00E7},
+    {0x0064, 0x030C, 0x010F}, {0x0065, 0x0300, 0x00E8},
+    {0x0065, 0x0301, 0x00E9}, {0x0065, 0x0302, 0x00EA},
+    {0x0065, 0x0304, 0x0113}, {0x0065, 0x0306, 0x0115},
+    {0x0065, 0x0307, 0x0117}, {0x0065, 0x0308, 0x00EB},
+    {0x0065, 0x030C, 0x011B}, {0x0065, 0x0328, 0x0119},
+    {0x0067, 0x0302, 0x011D}, {0x0067, 0x0306, 0x011F},
+    {0x0067, 0x0307, 0x0121}, {0x0067, 0x0327, 0x0123},
+    {0x0068, 0x0302, 0x0125}, {0x0069, 0x0300, 0x00EC},
+    {0x0069, 0x0301, 0x00ED}, {0x0069, 0x0302, 0x00EE},
+    {0x0069, 0x0303, 0x0129}, {0x0069, 0x0304, 0x012B},
+    {0x0069, 0x0306, 0x012D}, {0x0069, 0x0308, 0x00EF},
+    {0x0069, 0x0328, 0x012F}, {0x006A, 0x0302, 0x0135},
+    {0x006B, 0x0327, 0x0137}, {0x006C, 0x0301, 0x013A},
+    {0x006C, 0x030C, 0x013E}, {0x006C, 0x0327, 0x013C},
+    {0x006E, 0x0301, 0x0144}, {0x006E, 0x0303, 0x00F1},
+    {0x006E, 0x030C, 0x0148}, {0x006E, 0x0327, 0x0146},
+    {0x006F, 0x0300, 0x00F2}, {0x006F, 0x0301, 0x00F3},
+    {0x006F, 0x0302, 0x00F4}, {0x006F, 0x0303, 0x00F5},
+    {0x006F, 0x0304, 0x014D}, {0x006F, 0x0306, 0x014F},
+    {0x006F, 0x0308, 0x00F6}, {0x006F, 0x030B, 0x0151},
+    {0x0072, 0x0301, 0x0155}, {0x0072, 0x030C, 0x0159},
+    {0x0072, 0x0327, 0x0157}, {0x0073, 0x0301, 0x015B},
+    {0x0073, 0x0302, 0x015D}, {0x0073, 0x030C, 0x0161},
+    {0x0073, 0x0327, 0x015F}, {0x0074, 0x030C, 0x0165},
+    {0x0074, 0x0327, 0x0163}, {0x0075, 0x0300, 0x00F9},
+    {0x0075, 0x0301, 0x00FA}, {0x0075, 0x0302, 0x00FB},
+    {0x0075, 0x0303, 0x0169}, {0x0075, 0x0304, 0x016B},
+    {0x0075, 0x0306, 0x016D}, {0x0075, 0x0308, 0x00FC},
+    {0x0075, 0x030A, 0x016F}, {0x0075, 0x030B, 0x0171},
+    {0x0075, 0x0328, 0x0173}, {0x0077, 0x0302, 0x0175},
+    {0x0079, 0x0301, 0x00FD}, {0x0079, 0x0302, 0x0177},
+    {0x0079, 0x0308, 0x00FF}, {0x007A, 0x0301, 0x017A},
+    {0x007A, 0x0307, 0x017C}, {0x007A, 0x030C, 0x017E},
+};
+
+/**
+ * Check whether a string is pure ASCII, eight bytes at a time.
+ *
+ * @param text The string to check.
+ * @return True if no byte has its high bit set.
+ */
+inline bool is_ascii(std::string_view text) {
+    const char* data = text.data();
+    size_t size = text.size();
+    uint64_t high_bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t chunk;
+        std::memcpy(&chunk, data + i, 8);
+        high_bits |= chunk;
+    }
+    for (; i < size; i++) {
+        high_bits |= static_cast<unsigned char>(data[i]);
+    }
+    return (high_bits & 0x8080808080808080ULL) == 0;
+}
+
+/**
+ * Decode one code point from a UTF-8 string. Overlong encodings, surrogates,
+ * code points past U+10FFFF and truncated sequences are rejected.
+ *
+ * @param text The string to decode from.
+ * @param pos The position to start at; advanced past the code point, or past
+ * a single byte if the sequence there is invalid.
+ * @param code_point Receives the decoded code point.
+ * @return True if a valid code point was decoded.
+ */
+inline bool decode_utf8(std::string_view text, size_t& pos,
+                        uint32_t& code_point) {
+    unsigned char lead = text[pos++];
+    if (lead < 0x80) {
+        code_point = lead;
+        return true;
+    }
+
+    size_t length;
+    uint32_t minimum;
+    if (lead >= 0xC2 && lead < 0xE0) {
+        length = 1;
+        minimum = 0x80;
+        code_point = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead < 0xF0) {
+        length = 2;
+        minimum = 0x800;
+        code_point = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead < 0xF5) {
+        length = 3;
+        minimum = 0x10000;
+        code_point = lead & 0x07;
+    } else {
+        return false;
+    }
+
+    if (text.size() - pos < length) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        unsigned char continuation = text[pos + i];
+        if ((continuation & 0xC0) != 0x80) {
+            return false;
+        }
+        code_point = code_point << 6 | (continuation & 0x3F);
+    }
+    if (code_point < minimum || code_point > 0x10FFFF ||
+        (code_point >= 0xD800 && code_point < 0xE000)) {
+        return false;
+    }
+
+    pos += length;
+    return true;
+}
+
+/**
+ * Append a Unicode code point to a string as UTF-8.
+ *
+ * @param out The string to append to; any std::basic_string<char>.
+ * @param code_point The code point to encode.
+ */
+template <typename String>
+inline void append_utf8(String& out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+        out += static_cast<char>(0xC0 | code_point >> 6);
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        out += static_cast<char>(0xE0 | code_point >> 12);
+        out += static_cast<char>(0x80 | (code_point >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | code_point >> 18);
+        out += static_cast<char>(0x80 | (code_point >> 12 & 0x3F));
+        out += static_cast<char>(0x80 | (code_point >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+}
+
+/**
+ * Decode a UTF-8 string into code points, skipping invalid bytes.
+ *
+ * @param text The string to decode.
+ * @param out Receives the code points.
+ */
+inline void decode_utf8(std::string_view text, std::u32string& out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        uint32_t code_point;
+        if (decode_utf8(text, pos, code_point)) {
+            out += static_cast<char32_t>(code_point);
+        }
+    }
+}
+
+/**
+ * Count the code points in a UTF-8 string.
+ *
+ * @param text The string to measure.
+ * @return The number of bytes that start a code point.
+ */
+inline size_t utf8_length(std::string_view text) {
+    size_t length = 0;
+    for (char c : text) {
+        length += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+    }
+    return length;
+}
+
+/**
+ * @param code_point A code point.
+ * @return True if the code point is a combining diacritical mark.
+ */
+inline bool is_combining_mark(uint32_t code_point) {
+    return code_point >= 0x300 && code_point < 0x370;
+}
+
+/**
+ * Check whether a code point can be part of a word. Besides the ASCII and
+ * Latin letters, everything outside the blocks of spaces, punctuation and
+ * symbols counts, so words in other scripts are kept whole even though they
+ * are not case folded.
+ *
+ * @param code_point A code point.
+ * @return True if the code point is a letter.
+ */
+inline bool is_letter(uint32_t code_point) {
+    if (code_point < 0x80) {
+        return std::isalpha(code_point);
+    }
+    if (code_point < LATIN_TABLE_FIRST) {
+        return false;
+    }
+    if (code_point < LATIN_TABLE_END) {
+        return LATIN_FOLDING[code_point - LATIN_TABLE_FIRST] != 0;
+    }
+    return !is_combining_mark(code_point) &&
+           !(code_point >= 0x2000 && code_point < 0x2C00) &&
+           !(code_point >= 0x3000 && code_point < 0x3040) &&
+           !(code_point >= 0xFE30 && code_point < 0xFE70) &&
+           !(code_point >= 0xFF00 && code_point < 0xFF10) &&
+           !(code_point >= 0x1F000 && code_point < 0x1FB00);
+}
+
+/**
+ * Case fold a code point. Only ASCII and Latin letters are folded.
+ *
+ * @param code_point A code point.
+ * @return The folded code point.
+ */
+inline uint32_t fold_case(uint32_t code_point) {
+    if (code_point < 0x80) {
+        return std::tolower(code_point);
+    }
+    if (code_point >= LATIN_TABLE_FIRST && code_point < LATIN_TABLE_END) {
+        uint16_t folded = LATIN_FOLDING[code_point - LATIN_TABLE_FIRST];
+        return folded != 0 ? folded : code_point;
+    }
+    return code_point;
+}
+
+/**
+ * Map a code point to uppercase, the inverse of fold_case. Only ASCII and
+ * Latin letters are mapped, and a lowercase letter with no single uppercase
+ * code point, such as U+00DF, is returned unchanged.
+ *
+ * @param code_point A code point.
+ * @return The uppercase code point.
+ */
+inline uint32_t upper_case(uint32_t code_point) {
+    if (code_point < 0x80) {
+        return std::toupper(code_point);
+    }
+    if (code_point >= LATIN_TABLE_FIRST && code_point < LATIN_TABLE_END &&
+        LATIN_FOLDING[code_point - LATIN_TABLE_FIRST] == code_point) {
+        for (uint32_t upper = LATIN_TABLE_FIRST; upper < LATIN_TABLE_END;
+             upper++) {
+            if (upper != code_point &&
+                LATIN_FOLDING[upper - LATIN_TABLE_FIRST] == code_point) {
+                return upper;
+            }
+        }
+    }
+    return code_point;
+}
+
+/**
+ * Compose a case folded base letter with a combining mark.
+ *
+ * @param base The base letter.
+ * @param mark The combining mark.
+ * @return The precomposed letter, or 0 if there is none in the table.
+ */
+inline uint32_t compose(uint32_t base, uint32_t mark) {
+    const LatinComposition* begin = LATIN_COMPOSITIONS;
+    const LatinComposition* end =
+        LATIN_COMPOSITIONS + sizeof(LATIN_COMPOSITIONS) /
+                                 sizeof(LATIN_COMPOSITIONS[0]);
+    const LatinComposition* found = std::lower_bound(
+        begin, end, LatinComposition{uint16_t(base), uint16_t(mark), 0},
+        [](const LatinComposition& a, const LatinComposition& b) {
+            return a.base != b.base ? a.base < b.base : a.mark < b.mark;
+        });
+    if (found != end && found->base == base && found->mark == mark) {
+        return found->composed;
+    }
+    return 0;
+}
+
+/**
+ * Normalize a word for dictionary lookup: drop everything but letters and
+ * the combining marks that follow them, case fold, and compose Latin letters
+ * with their marks. Invalid UTF-8 is dropped. The result is written into a
+ * caller's string so it can come from any allocator.
+ *
+ * @param word The word to normalize.
+ * @param normalized Receives the normalized word; cleared first.
+ */
+template <typename String>
+inline void normalize_word(std::string_view word, String& normalized) {
+    normalized.clear();
+
+    if (is_ascii(word)) {
+        for (char c : word) {
+            if (std::isalpha(static_cast<unsigned char>(c))) {
+                normalized += std::tolower(static_cast<unsigned char>(c));
+            }
+        }
+        return;
+    }
+
+    // The last code point written and where it starts, so a combining mark
+    // can replace it with the composed letter.
+    uint32_t last = 0;
+    size_t last_start = 0;
+    size_t pos = 0;
+    while (pos < word.size()) {
+        uint32_t code_point;
+        if (!decode_utf8(word, pos, code_point)) {
+            continue;
+        }
+
+        if (is_combining_mark(code_point)) {
+            if (last == 0) {
+                continue;
+            }
+            uint32_t composed = compose(last, code_point);
+            if (composed != 0) {
+                normalized.resize(last_start);
+                code_point = composed;
+            }
+        } else if (is_letter(code_point)) {
+            code_point = fold_case(code_point);
+        } else {
+            last = 0;
+            continue;
+        }
+
+        last = code_point;
+        last_start = normalized.size();
+        append_utf8(normalized, code_point);
+    }
+}
+
+/**
+ * Normalize a word for dictionary lookup into a new string.
+ *
+ * @param word The word to normalize.
+ * @return The normalized word.
+ */
+inline std::string normalize_word(std::string_view word) {
+    std::string normalized;
+    normalize_word(word, normalized);
+    return normalized;
+}
+
+/**
+ * Narrow a token to the span from its first letter to its last letter or
+ * trailing combining mark, so surrounding punctuation is left out.
+ *
+ * @param text The text the token is in.
+ * @param first The byte offset of the token; advanced to its first letter.
+ * @param last One past the token's last byte; moved back to one past its
+ * last letter.
+ */
+inline void trim_to_letters(std::string_view text, size_t& first,
+                            size_t& last) {
+    if (is_ascii(text.substr(first, last - first))) {
+        while (first < last &&
+               !std::isalpha(static_cast<unsigned char>(text[first]))) {
+            first++;
+        }
+        while (last > first &&
+               !std::isalpha(static_cast<unsigned char>(text[last - 1]))) {
+            last--;
+        }
+        return;
+    }
+
+    std::string_view token = text.substr(0, last);
+    size_t word_start = last;
+    size_t word_end = first;
+    bool in_letter = false;
+    size_t pos = first;
+    while (pos < last) {
+        size_t start = pos;
+        uint32_t code_point;
+        bool valid = decode_utf8(token, pos, code_point);
+        if (valid && (is_letter(code_point) ||
+                      (in_letter && is_combining_mark(code_point)))) {
+            word_start = std::min(word_start, start);
+            word_end = pos;
+            in_letter = true;
+        } else {
+            in_letter = false;
+        }
+    }
+
+    if (word_start >= word_end) {
+        first = last;
+    } else {
+        first = word_start;
+        last = word_end;
+    }
+}
+
+#endif  // SPELL_UNICODE_H
@@ -0,0 +1,130 @@
+#!/bin/sh
+# Round-trip test for the dictionary formats. A generated word list is
+# loaded as text and compiled as a sorted image, a perfect-hash image and a
+# trie, each with and without --filter. Every format must accept every word,
+# reject every non-word, and give the same completions as the text list.
+#
+# Usage: tests/dictionary_formats.sh [path/to/SpellChecker]
+# Without an argument SpellChecker.cpp is built into a temporary directory.
+
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+if [ $# -gt 0 ]; then
+    spell=$1
+else
+    spell=$work/SpellChecker
+    g++ -std=c++17 -O2 -pthread "$root/SpellChecker.cpp" -o "$spell"
+fi
+
+# Words of 1 to 14 letters over a skewed alphabet, so they share prefixes,
+# some with counts, plus accented words that widen the packed alphabet, and
+# capitalized and decomposed words that must be normalized on loading.
+awk 'BEGIN {
+    srand(7);
+    letters = "eeeaaoiinstrlhdcumpqzxj";
+    for (i = 0; i < 6000; i++) {
+        length_ = 1 + int(rand() * 14);
+        word = "";
+        for (j = 0; j < length_; j++) {
+            word = word substr(letters, 1 + int(rand() * 23), 1);
+        }
+        if (rand() < 0.3) {
+            print word "\t" int(rand() * 100000);
+        } else {
+            print word;
+        }
+    }
+    print "café"; print "élan"; print "naïve"; print "façade\t500";
+    print "École"; print "Montréal\t20"; print "re\314\201sume\314\201";
+}' | awk -F'\t' '!seen[$1]++' > "$work/words.txt"
+
+cut -f1 "$work/words.txt" | sort -u > "$work/members.txt"
+
+# The normalized words in other spellings, which text is normalized to
+# before lookup as well.
+printf '\303\251cole \303\211COLE montr\303\251al r\303\251sum\303\251\n' \
+    > "$work/variants.txt"
+
+# Non-words: each word with a letter outside the alphabet added at either
+# end or in the middle, and words that differ only by a trailing letter.
+awk '{
+    print $0 "k";
+    print "w" $0;
+    if ($0 ~ /^[a-z]+$/) {
+        print substr($0, 1, 1) "y" substr($0, 2);
+    }
+    print $0 "e";
+}' "$work/members.txt" | sort -u | comm -23 - "$work/members.txt" \
+    > "$work/absent.txt"
+
+# Every prefix of up to three letters that starts some ASCII word, plus a
+# few accented prefixes and a few that start no word.
+awk '/^[a-z]+$/ {
+    for (n = 1; n <= 3 && n <= length($0); n++) {
+        print substr($0, 1, n);
+    }
+}' "$work/members.txt" | sort -u > "$work/prefixes.txt"
+printf 'caf\nfa\xc3\xa7\n\xc3\xa9\nna\xc3\xaf\nkk\nyy\nw\n' \
+    >> "$work/prefixes.txt"
+
+"$spell" compile-dict "$work/words.txt" -o "$work/plain.bin" 2>/dev/null
+"$spell" compile-dict --perfect-hash "$work/words.txt" \
+    -o "$work/perfect.bin" 2>/dev/null
+"$spell" compile-dict --trie "$work/words.txt" -o "$work/trie.bin" 2>/dev/null
+
+# complete exits with 1 when some prefix has no completions.
+# shellcheck disable=SC2046
+"$spell" complete -d "$work/words.txt" -k 5 $(cat "$work/prefixes.txt") \
+    > "$work/expected.txt" || [ $? -eq 1 ]
+
+failures=0
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+absent=$(wc -l < "$work/absent.txt")
+for dictionary in words.txt plain.bin perfect.bin trie.bin; do
+    for filter in "" --filter; do
+        label="$dictionary${filter:+ $filter}"
+        set -- -d "$work/$dictionary"
+        if [ -n "$filter" ]; then
+            set -- "$@" "$filter"
+        fi
+
+        if ! "$spell" check "$@" "$work/members.txt" > "$work/out.txt"; then
+            fail "$label rejects $(wc -l < "$work/out.txt") words," \
+                "e.g. $(head -n 1 "$work/out.txt")"
+        fi
+
+        if ! "$spell" check "$@" "$work/variants.txt" > "$work/out.txt"
+        then
+            fail "$label rejects normalized words: $(cat "$work/out.txt")"
+        fi
+
+        "$spell" check "$@" "$work/absent.txt" > "$work/out.txt" ||
+            [ $? -eq 1 ]
+        rejected=$(wc -l < "$work/out.txt")
+        if [ "$rejected" -ne "$absent" ]; then
+            fail "$label rejects $rejected of $absent non-words"
+        fi
+
+        # shellcheck disable=SC2046
+        "$spell" complete "$@" -k 5 $(cat "$work/prefixes.txt") \
+            > "$work/out.txt" || [ $? -eq 1 ]
+        if ! cmp -s "$work/expected.txt" "$work/out.txt"; then
+            fail "$label completions differ from the text dictionary:"
+            diff "$work/expected.txt" "$work/out.txt" | head -n 5
+        fi
+    done
+done
+
+if [ "$failures" -ne 0 ]; then
+    exit 1
+fi
+echo "dictionary_formats: $(wc -l < "$work/members.txt") words," \
+    "$absent non-words, 4 formats ok"
@@ -0,0 +1,82 @@
+#!/bin/sh
+# Checks that --grams never changes a suggestion. Long words are damaged
+# with several edits, transpositions among them, and suggested for with and
+# without the trigram index under both distance metrics. The index only
+# narrows the words the search verifies, so the results must be identical
+# to a full scan.
+#
+# Usage: tests/gram_candidates.sh [path/to/SpellChecker]
+# Without an argument SpellChecker.cpp is built into a temporary directory.
+
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+if [ $# -gt 0 ]; then
+    spell=$1
+else
+    spell=$work/SpellChecker
+    g++ -std=c++17 -O2 -pthread "$root/SpellChecker.cpp" -o "$spell"
+fi
+
+# A dictionary of 8 to 20 letter words over a small alphabet, so damaged
+# words have many near neighbours.
+awk 'BEGIN {
+    srand(11);
+    letters = "abcdefgh";
+    for (i = 0; i < 20000; i++) {
+        length_ = 8 + int(rand() * 13);
+        word = "";
+        for (j = 0; j < length_; j++) {
+            word = word substr(letters, 1 + int(rand() * 8), 1);
+        }
+        print word;
+    }
+}' | sort -u > "$work/words.txt"
+
+# Damage every tenth word of 12 letters or more with two to four edits,
+# half of them transpositions of adjacent letters.
+awk 'BEGIN { srand(13); letters = "abcdefgh"; }
+length($0) >= 12 && NR % 10 == 0 {
+    word = $0;
+    edits = 2 + int(rand() * 3);
+    for (e = 0; e < edits; e++) {
+        pos = 1 + int(rand() * (length(word) - 1));
+        kind = rand();
+        letter = substr(letters, 1 + int(rand() * 8), 1);
+        if (kind < 0.5) {
+            word = substr(word, 1, pos - 1) substr(word, pos + 1, 1) \
+                   substr(word, pos, 1) substr(word, pos + 2);
+        } else if (kind < 0.7) {
+            word = substr(word, 1, pos - 1) letter substr(word, pos + 1);
+        } else if (kind < 0.85) {
+            word = substr(word, 1, pos - 1) substr(word, pos + 1);
+        } else {
+            word = substr(word, 1, pos - 1) letter substr(word, pos);
+        }
+    }
+    print word;
+}' "$work/words.txt" | sort -u | comm -23 - "$work/words.txt" \
+    > "$work/misspelled.txt"
+
+failures=0
+for metric in damerau levenshtein; do
+    # suggest exits with 1 when some word has no suggestion.
+    "$spell" suggest -d "$work/words.txt" --distance "$metric" \
+        < "$work/misspelled.txt" > "$work/scan.txt" || [ $? -eq 1 ]
+    "$spell" suggest -d "$work/words.txt" --distance "$metric" --grams \
+        < "$work/misspelled.txt" > "$work/grams.txt" || [ $? -eq 1 ]
+    if ! cmp -s "$work/scan.txt" "$work/grams.txt"; then
+        echo "FAIL: --grams changes $metric suggestions:"
+        diff "$work/scan.txt" "$work/grams.txt" | head -n 10
+        failures=$((failures + 1))
+    fi
+done
+
+if [ "$failures" -ne 0 ]; then
+    exit 1
+fi
+echo "gram_candidates: $(wc -l < "$work/misspelled.txt") misspellings," \
+    "2 metrics ok"